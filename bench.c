@@ -0,0 +1,661 @@
+/*
+ * @file: bench.c
+ * @brief: a load generator for the proxy, with a stub origin server of its
+ * own, so runs are repeatable and only measure the proxy. Client threads each
+ * keep a persistent connection to the proxy and send it one request after
+ * the other for objects of the origin, recording the latency of every one.
+ *
+ * Objects are picked by a Zipf distribution over a set of popular objects,
+ * so a few are hit very often and most rarely, as on a real site. A share of
+ * the requests can instead go to objects the origin marks no-store, which
+ * always miss, to set how much of the load the cache can take at best. The
+ * size of every object is picked from a weighted mix of sizes by hashing its
+ * id, so an object keeps its size from one request to the next.
+ *
+ * At the end it reports the throughput, the latency percentiles, and the hit
+ * ratio of the cache, worked out from how many of the requests reached the
+ * origin. Requests sent during the warmup aren't counted.
+ *
+ * It is built on its own, as it shares no code with the proxy:
+ *     cc -O2 -pthread -o bench bench.c -lm
+ * and pointed at a running proxy:
+ *     ./bench -c 32 -d 10 -n 10000 -s 0.99 -m 1K:60,16K:30,256K:10
+ *         -H 90 localhost:15213
+ *
+ * @Author Sanah Imani <simani@unix.andrew.cmu.edu>
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // memmem() and strcasestr()
+#endif
+
+#include <errno.h>
+#include <math.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_BUF (64 * 1024)   // bytes read at a time by clients
+#define BENCH_MAX_MIX 16        // max entries in the size mix
+#define BENCH_MAX_OBJECT (64L * 1024 * 1024) // largest object size in the mix
+#define BENCH_LINE 1024         // longest request or response header block
+#define BENCH_MIX_DEFAULT "1K:60,16K:30,256K:10"
+
+/* One entry of the object size mix. */
+typedef struct size_class {
+    size_t size;   // bytes in the body of objects of the class
+    unsigned cum;  // sum of the weights of the classes up to this one
+} size_class_t;
+
+/* What a run is configured with. */
+typedef struct bench_config {
+    int conns;          // client threads, each with a connection
+    double duration;    // seconds of measured load
+    double warmup;      // seconds of load before measuring
+    long objects;       // number of popular objects
+    double zipf;        // exponent of the popularity distribution
+    int hitShare;       // percent of requests for cacheable objects
+    size_class_t mix[BENCH_MAX_MIX]; // the size mix
+    int nmix;           // classes in the mix
+    const char *proxyHost; // where the proxy listens
+    const char *proxyPort;
+} bench_config_t;
+
+/* The measurements of one client thread. */
+typedef struct client {
+    pthread_t tid;
+    int id;              // index of the thread, for unique URIs
+    uint64_t rng;        // state of its random number generator
+    uint32_t *lat;       // latencies of measured requests in microseconds
+    size_t nlat;         // latencies recorded
+    size_t capLat;       // room in lat
+    uint64_t bytes;      // body bytes of measured requests
+    uint64_t errors;     // requests that failed
+    char buf[BENCH_BUF]; // response bytes being read
+} client_t;
+
+static bench_config_t config;
+static double *zipf_cdf;          // cumulative popularity of the objects
+static char *origin_body;         // bytes every response body is cut from
+static int origin_port;           // where the stub origin listens
+static atomic_long origin_requests; // requests that reached the origin
+static atomic_bool measuring;     // set once the warmup is over
+static atomic_bool stopping;      // set once the run is over
+
+// seconds since an arbitrary point, for latencies and the run's timing.
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// xorshift64*, plenty for picking objects.
+static uint64_t rng_next(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 2685821657736338717ULL;
+}
+
+// a uniform double in [0, 1).
+static double rng_unit(uint64_t *state) {
+    return (double)(rng_next(state) >> 11) / 9007199254740992.0;
+}
+
+/*a helper parsing a size such as 512, 16K or 1M.
+ *
+ * @return false if it isn't one.
+ */
+static bool parse_size(const char *str, char **end, size_t *size) {
+    errno = 0;
+    unsigned long long n = strtoull(str, end, 10);
+    if (*end == str || errno != 0) {
+        return false;
+    }
+    switch (**end) {
+    case 'K':
+    case 'k':
+        n *= 1024;
+        (*end)++;
+        break;
+    case 'M':
+    case 'm':
+        n *= 1024 * 1024;
+        (*end)++;
+        break;
+    default:
+        break;
+    }
+    *size = (size_t)n;
+    return n <= (unsigned long long)BENCH_MAX_OBJECT;
+}
+
+/*a helper parsing the size mix, a list of size:weight entries separated by
+ *commas.
+ *
+ * @return false if it isn't one.
+ */
+static bool parse_mix(const char *str) {
+    config.nmix = 0;
+    unsigned cum = 0;
+    char *end = (char *)str;
+    while (*end != '\0') {
+        size_t size;
+        if (config.nmix == BENCH_MAX_MIX || !parse_size(end, &end, &size) ||
+            *end++ != ':') {
+            return false;
+        }
+        char *next;
+        unsigned long weight = strtoul(end, &next, 10);
+        if (next == end || weight == 0 || (*next != ',' && *next != '\0')) {
+            return false;
+        }
+        cum += (unsigned)weight;
+        config.mix[config.nmix].size = size;
+        config.mix[config.nmix].cum = cum;
+        config.nmix++;
+        end = *next == ',' ? next + 1 : next;
+    }
+    return config.nmix > 0;
+}
+
+// the body size of an object, picked from the mix by a hash of its id.
+static size_t object_size(uint64_t id) {
+    uint64_t h = (id + 1) * 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 29;
+    unsigned pick = (unsigned)(h % config.mix[config.nmix - 1].cum);
+    int i = 0;
+    while (config.mix[i].cum <= pick) {
+        i++;
+    }
+    return config.mix[i].size;
+}
+
+// setting up the cumulative Zipf distribution over the popular objects.
+static bool zipf_init(void) {
+    zipf_cdf = (double *)malloc((size_t)config.objects * sizeof(double));
+    if (zipf_cdf == NULL) {
+        return false;
+    }
+    double sum = 0;
+    for (long i = 0; i < config.objects; i++) {
+        sum += 1.0 / pow((double)(i + 1), config.zipf);
+        zipf_cdf[i] = sum;
+    }
+    for (long i = 0; i < config.objects; i++) {
+        zipf_cdf[i] /= sum;
+    }
+    return true;
+}
+
+// picking a popular object, by a binary search of the distribution.
+static long zipf_pick(uint64_t *rng) {
+    double u = rng_unit(rng);
+    long lo = 0;
+    long hi = config.objects - 1;
+    while (lo < hi) {
+        long mid = lo + (hi - lo) / 2;
+        if (zipf_cdf[mid] < u) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/*a helper reading from a socket until a header block ending in a blank line
+ *is in buf. The bytes read past it are left in buf after it.
+ *
+ * @return the length of the header block, 0 if the peer closed first and -1
+ * on an error.
+ */
+static ssize_t read_headers(int fd, char *buf, size_t size, size_t *have) {
+    *have = 0;
+    while (true) {
+        char *blank = memmem(buf, *have, "\r\n\r\n", 4);
+        if (blank != NULL) {
+            return blank + 4 - buf;
+        }
+        if (*have == size) {
+            return -1;
+        }
+        ssize_t n = read(fd, buf + *have, size - *have);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return *have == 0 && n == 0 ? 0 : -1;
+        }
+        *have += (size_t)n;
+    }
+}
+
+// writing all of buf, which a blocking socket may take in several goes.
+static bool write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+/*
+ * origin_conn - serving one connection of the stub origin. The path names the
+ * object: /o/<id> for a popular object, cacheable for an hour, and /u/<id>
+ * for one that may not be stored. Any other path is a 404.
+ */
+static void *origin_conn(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    char req[BENCH_LINE * 4];
+    size_t have = 0;
+    while (true) {
+        char *blank;
+        while ((blank = memmem(req, have, "\r\n\r\n", 4)) == NULL) {
+            ssize_t n;
+            if (have == sizeof(req) ||
+                (n = read(fd, req + have, sizeof(req) - have)) <= 0) {
+                close(fd);
+                return NULL;
+            }
+            have += (size_t)n;
+        }
+        atomic_fetch_add_explicit(&origin_requests, 1, memory_order_relaxed);
+        char kind = '\0';
+        unsigned long long id = 0;
+        char hdr[BENCH_LINE];
+        int hdrLen;
+        size_t size = 0;
+        if (sscanf(req, "GET /%c/%llu", &kind, &id) == 2 &&
+            (kind == 'o' || kind == 'u')) {
+            size = object_size(id);
+            hdrLen = snprintf(hdr, sizeof(hdr),
+                              "HTTP/1.1 200 OK\r\n"
+                              "Content-Type: application/octet-stream\r\n"
+                              "Content-Length: %zu\r\n"
+                              "Cache-Control: %s\r\n\r\n",
+                              size, kind == 'o' ? "max-age=3600" : "no-store");
+        } else {
+            hdrLen = snprintf(hdr, sizeof(hdr),
+                              "HTTP/1.1 404 Not Found\r\n"
+                              "Content-Length: 0\r\n\r\n");
+        }
+        if (!write_all(fd, hdr, (size_t)hdrLen) ||
+            !write_all(fd, origin_body, size)) {
+            close(fd);
+            return NULL;
+        }
+        // keeping whatever of the next request came along with this one.
+        size_t used = (size_t)(blank + 4 - req);
+        memmove(req, req + used, have - used);
+        have -= used;
+    }
+}
+
+// accepting the connections of the stub origin, a thread for each.
+static void *origin_routine(void *arg) {
+    int listenfd = (int)(intptr_t)arg;
+    while (true) {
+        int fd = accept(listenfd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            perror("origin accept");
+            return NULL;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, origin_conn, (void *)(intptr_t)fd) !=
+            0) {
+            close(fd);
+            continue;
+        }
+        pthread_detach(tid);
+    }
+}
+
+// starting the stub origin on a free port of the loopback interface.
+static bool origin_start(void) {
+    size_t largest = 0;
+    for (int i = 0; i < config.nmix; i++) {
+        if (config.mix[i].size > largest) {
+            largest = config.mix[i].size;
+        }
+    }
+    if ((origin_body = (char *)malloc(largest + 1)) == NULL) {
+        return false;
+    }
+    for (size_t i = 0; i < largest; i++) {
+        origin_body[i] = (char)('a' + i % 26);
+    }
+    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    socklen_t len = sizeof(addr);
+    if (listenfd < 0 ||
+        bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listenfd, 1024) < 0 ||
+        getsockname(listenfd, (struct sockaddr *)&addr, &len) < 0) {
+        perror("origin");
+        return false;
+    }
+    origin_port = ntohs(addr.sin_port);
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, origin_routine,
+                       (void *)(intptr_t)listenfd) != 0) {
+        return false;
+    }
+    pthread_detach(tid);
+    return true;
+}
+
+// opening a connection to the proxy, or -1.
+static int proxy_connect(void) {
+    struct addrinfo hints;
+    struct addrinfo *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(config.proxyHost, config.proxyPort, &hints, &res) != 0) {
+        return -1;
+    }
+    int fd = -1;
+    for (struct addrinfo *p = res; p != NULL; p = p->ai_next) {
+        if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) {
+            continue;
+        }
+        if (connect(fd, p->ai_addr, p->ai_addrlen) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd >= 0) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+/*a helper sending one request over a client's connection and reading the
+ *whole response.
+ *
+ * @return the length of the body, or -1 if the request failed, after which
+ * the connection can't be used again. *keep is set to whether it can be.
+ */
+static long client_request(client_t *cl, int fd, const char *uri, bool *keep) {
+    char req[BENCH_LINE];
+    int len = snprintf(req, sizeof(req),
+                       "GET %s HTTP/1.1\r\nHost: 127.0.0.1:%d\r\n\r\n", uri,
+                       origin_port);
+    if (!write_all(fd, req, (size_t)len)) {
+        return -1;
+    }
+    size_t have;
+    ssize_t hdrLen = read_headers(fd, cl->buf, sizeof(cl->buf) - 1, &have);
+    if (hdrLen <= 0) {
+        return -1;
+    }
+    char saved = cl->buf[hdrLen];
+    cl->buf[hdrLen] = '\0';
+    int status = 0;
+    sscanf(cl->buf, "HTTP/%*d.%*d %d", &status);
+    // the proxy always frames its responses by Content-Length.
+    char *cl_hdr = strcasestr(cl->buf, "\r\nContent-Length:");
+    char *conn = strcasestr(cl->buf, "\r\nConnection: close");
+    cl->buf[hdrLen] = saved;
+    if (status != 200 || cl_hdr == NULL) {
+        return -1;
+    }
+    long body = strtol(cl_hdr + 17, NULL, 10);
+    long got = (long)have - (long)hdrLen;
+    while (got < body) {
+        ssize_t n = read(fd, cl->buf, sizeof(cl->buf));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        got += n;
+    }
+    *keep = conn == NULL && got == body;
+    return body;
+}
+
+// recording the latency of a measured request.
+static void client_record(client_t *cl, double sec) {
+    if (cl->nlat == cl->capLat) {
+        size_t cap = cl->capLat == 0 ? 4096 : cl->capLat * 2;
+        uint32_t *grown = (uint32_t *)realloc(cl->lat, cap * sizeof(uint32_t));
+        if (grown == NULL) {
+            return;
+        }
+        cl->lat = grown;
+        cl->capLat = cap;
+    }
+    double us = sec * 1e6;
+    cl->lat[cl->nlat++] = us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+}
+
+// the loop of a client thread, sending requests until the run is over.
+static void *client_routine(void *arg) {
+    client_t *cl = (client_t *)arg;
+    int fd = -1;
+    uint64_t seq = 0;
+    char uri[BENCH_LINE];
+    while (!atomic_load_explicit(&stopping, memory_order_relaxed)) {
+        if (fd < 0 && (fd = proxy_connect()) < 0) {
+            cl->errors++;
+            usleep(10000);
+            continue;
+        }
+        if ((int)(rng_next(&cl->rng) % 100) < config.hitShare) {
+            snprintf(uri, sizeof(uri), "http://127.0.0.1:%d/o/%ld",
+                     origin_port, zipf_pick(&cl->rng));
+        } else {
+            // an id unique to this request, clear of the popular ones.
+            snprintf(uri, sizeof(uri), "http://127.0.0.1:%d/u/%llu",
+                     origin_port,
+                     (unsigned long long)config.objects +
+                         ((uint64_t)cl->id << 40) + seq);
+        }
+        seq++;
+        bool measured = atomic_load_explicit(&measuring, memory_order_relaxed);
+        bool keep = false;
+        double start = now_sec();
+        long body = client_request(cl, fd, uri, &keep);
+        double sec = now_sec() - start;
+        if (body < 0) {
+            cl->errors += measured;
+        } else if (measured) {
+            client_record(cl, sec);
+            cl->bytes += (uint64_t)body;
+        }
+        if (!keep) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    return NULL;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+// the latency below which a share p of the (sorted) latencies fall, in ms.
+static double percentile(const uint32_t *lat, size_t n, double p) {
+    if (n == 0) {
+        return 0;
+    }
+    size_t i = (size_t)(p * (double)(n - 1) + 0.5);
+    return lat[i] / 1000.0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-c conns] [-d seconds] [-w warmup] [-n objects] "
+            "[-s zipf] [-m size:weight,...] [-H hit%%] host:port\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    config.conns = 16;
+    config.duration = 10;
+    config.warmup = 2;
+    config.objects = 1000;
+    config.zipf = 0.99;
+    config.hitShare = 100;
+    parse_mix(BENCH_MIX_DEFAULT);
+    int opt;
+    while ((opt = getopt(argc, argv, "c:d:w:n:s:m:H:")) != -1) {
+        switch (opt) {
+        case 'c': // client connections
+            config.conns = atoi(optarg);
+            break;
+        case 'd': // seconds measured
+            config.duration = atof(optarg);
+            break;
+        case 'w': // seconds of warmup
+            config.warmup = atof(optarg);
+            break;
+        case 'n': // popular objects
+            config.objects = atol(optarg);
+            break;
+        case 's': // Zipf exponent
+            config.zipf = atof(optarg);
+            break;
+        case 'm': // object size mix
+            if (!parse_mix(optarg)) {
+                fprintf(stderr, "invalid size mix %s\n", optarg);
+                usage(argv[0]);
+            }
+            break;
+        case 'H': // percent of requests that may hit
+            config.hitShare = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || config.conns < 1 || config.duration <= 0 ||
+        config.warmup < 0 || config.objects < 1 || config.zipf < 0 ||
+        config.hitShare < 0 || config.hitShare > 100) {
+        usage(argv[0]);
+    }
+    char *target = argv[optind];
+    char *colon = strrchr(target, ':');
+    if (colon == NULL) {
+        usage(argv[0]);
+    }
+    *colon = '\0';
+    config.proxyHost = target;
+    config.proxyPort = colon + 1;
+
+    signal(SIGPIPE, SIG_IGN);
+    if (!zipf_init() || !origin_start()) {
+        fprintf(stderr, "unable to set up the benchmark\n");
+        return 1;
+    }
+    client_t *clients = (client_t *)calloc((size_t)config.conns,
+                                           sizeof(client_t));
+    if (clients == NULL) {
+        fprintf(stderr, "unable to set up the benchmark\n");
+        return 1;
+    }
+    printf("origin on 127.0.0.1:%d, %d connections to %s:%s\n", origin_port,
+           config.conns, config.proxyHost, config.proxyPort);
+    for (int i = 0; i < config.conns; i++) {
+        clients[i].id = i;
+        clients[i].rng = 0x853c49e6748fea9bULL ^ ((uint64_t)i + 1) *
+                                                     0x9e3779b97f4a7c15ULL;
+        if (pthread_create(&clients[i].tid, NULL, client_routine,
+                           &clients[i]) != 0) {
+            fprintf(stderr, "unable to start client threads\n");
+            return 1;
+        }
+    }
+    usleep((useconds_t)(config.warmup * 1e6));
+    long originStart = atomic_load(&origin_requests);
+    double start = now_sec();
+    atomic_store(&measuring, true);
+    usleep((useconds_t)(config.duration * 1e6));
+    atomic_store(&measuring, false);
+    double elapsed = now_sec() - start;
+    long originCount = atomic_load(&origin_requests) - originStart;
+    atomic_store(&stopping, true);
+
+    size_t total = 0;
+    uint64_t bytes = 0;
+    uint64_t errors = 0;
+    for (int i = 0; i < config.conns; i++) {
+        pthread_join(clients[i].tid, NULL);
+        total += clients[i].nlat;
+        bytes += clients[i].bytes;
+        errors += clients[i].errors;
+    }
+    uint32_t *lat = (uint32_t *)malloc((total + 1) * sizeof(uint32_t));
+    if (lat == NULL) {
+        fprintf(stderr, "unable to merge the latencies\n");
+        return 1;
+    }
+    size_t n = 0;
+    for (int i = 0; i < config.conns; i++) {
+        memcpy(lat + n, clients[i].lat, clients[i].nlat * sizeof(uint32_t));
+        n += clients[i].nlat;
+        free(clients[i].lat);
+    }
+    qsort(lat, n, sizeof(uint32_t), cmp_u32);
+
+    double hitRatio = 0;
+    if (total > 0 && (long)total > originCount) {
+        hitRatio = 1.0 - (double)originCount / (double)total;
+    }
+    printf("requests   %zu in %.2f s, %llu errors\n", total, elapsed,
+           (unsigned long long)errors);
+    printf("throughput %.0f req/s, %.2f MB/s\n", (double)total / elapsed,
+           (double)bytes / elapsed / (1024 * 1024));
+    printf("latency    p50 %.3f ms, p99 %.3f ms, p999 %.3f ms, max %.3f ms\n",
+           percentile(lat, n, 0.50), percentile(lat, n, 0.99),
+           percentile(lat, n, 0.999), n > 0 ? lat[n - 1] / 1000.0 : 0.0);
+    printf("hit ratio  %.2f%% (%ld origin requests)\n", hitRatio * 100,
+           originCount);
+    free(lat);
+    free(clients);
+    return 0;
+}
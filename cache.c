@@ -2,61 +2,147 @@
  * @file: cache.c
  * @brief: this is the C code for the web multi-threaded proxy cache
  * implementation for the signature in cache.h. The cache is implemented with
- * LRU principles and allows for adding unique URL-response objects with
- * MAX_OBJECT_SIZE. The web-cache struct contains a singly linked list, a size
- * variable (MAX_CACHE_SIZE is the limit), and a counter variable (LRU). The
- * struct of a web object consists of a key-value pair (urlKey and object), a
- * timestamp of use/creation and a referenceCnt to ensure that an object is not
- * being freed while in use on two or more threads.
+ * LRU principles and allows for adding unique URL-response objects of up to
+ * maxObject bytes. The web-cache struct contains a doubly linked recency list
+ * (most recently used first) and a size variable (capacity is the limit).
+ * The struct of a web object consists of a key-value pair (urlKey and
+ * object), its recency list links and an atomic referenceCnt to ensure that
+ * an object is not being freed while in use on two or more threads. Eviction
+ * only unlinks an object and drops the cache's reference; whichever thread
+ * drops the last reference frees it, so eviction never waits on client I/O.
+ * Lookups go through a chained hash table over the same objects, keyed on a
+ * precomputed hash of urlKey, so finding an object costs the same however full
+ * the cache is.
+ *
+ * All of the above is kept per shard. The high bits of the key hash pick the
+ * shard and the low bits the bucket within it. Hits hold the shard's rwlock
+ * for reading only, so recency is recorded in a per-object referenced flag
+ * instead of by relinking: eviction gives a referenced tail object a second
+ * chance at the front of the list and evicts the first unreferenced one.
+ *
+ * That is the "lru" policy. The policies are a table of hooks over a few
+ * segment lists per shard: "slru" promotes referenced objects from probation
+ * to a protected segment rather than giving them a second chance, and
+ * "tinylfu" adds an admission window in front of those two segments and a
+ * per-shard count-min sketch of lookup frequencies, fed by every lookup under
+ * the read lock with relaxed atomics, to decide which objects are admitted.
+ *
+ * Optionally, larger objects are kept in a memfd instead of on the heap so the
+ * proxy can serve hits with sendfile() without copying through user space.
  *
  * @Author Sanah Imani <simani@unix.andrew.cmu.edu>
  */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // memfd_create()
+#endif
 
+#include <cache.h>
 #include <csapp.h>
 #include <ctype.h>
 #include <inttypes.h>
 #include <limits.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
-
-#define MAX_CACHE_SIZE (1024 * 1024)
-#define MAX_OBJECT_SIZE (100 * 1024)
-
-typedef struct web_object_t {
-    char *urlKey;     // the url serves as an identifier for the response object
-    char *object;     // the response object from the server
-    int objSize;      // the length of the response
-    int tStamp;       // when the object has been last used / first created
-    int referenceCnt; // a value to check how many threads using the object.
-                      // Only when zero, then the object can be freed during
-                      // eviction
-    struct web_object_t *next; // the pointer to the next web object if any
-} web_object_t;
-
-typedef struct web_cache {
-    struct web_object_t
-        *start; // the pointer to the first web_object_t of the linked list
-    int size;   // current size of the cache that only includes the response
-                // object sizes
-    int LRU; // a variable counter to assign tStamps and implemented LRU-cache.
-} web_cache_t;
+#include <sys/mman.h>
+#include <unistd.h>
 
 // a global, external pointer to a heap-allocated web_cache object that forms
 // the basis of the cache.
 web_cache_t *web_cache = NULL;
 
-// a mutual exclusion lock used synchrony of cache accesses for the
-// multi-threaded proxy.
-static pthread_mutex_t cache_lock;
+
+/*a helper computing the 64-bit FNV-1a hash of a url key. The hash is stored
+ * in web_object_t so it is only ever computed once per object.
+ *
+ * params[in] key the url key to hash
+ * params[out] len set to strlen(key), which comes for free with the hash
+ *
+ * @return the hash of key
+ */
+static uint64_t hash_key(char const *key, size_t *len) {
+    uint64_t hash = 14695981039346656037ULL;
+    size_t n = 0;
+    for (; key[n] != '\0'; n++) {
+        hash ^= (unsigned char)key[n];
+        hash *= 1099511628211ULL;
+    }
+    *len = n;
+    return hash;
+}
+
+void cache_key_init(cache_key_t *key, const char *str) {
+    key->str = str;
+    key->hash = hash_key(str, &key->len);
+}
+
+/*a helper picking the shard owning a key hash. The high bits are used as the
+ *low bits select the bucket within the shard.*/
+static cache_shard_t *shard_for(uint64_t hash) {
+    uint64_t mask = (uint64_t)(web_cache->nshards - 1);
+    return &web_cache->shards[(hash >> 32) & mask];
+}
+
+/*a helper that doubles the number of hash buckets once the table holds more
+ *objects than buckets, keeping the chains short. Growth is skipped silently
+ *if memory is short since lookups remain correct with longer chains.
+ */
+static void hash_grow(cache_shard_t *shard) {
+    size_t nbuckets = shard->nbuckets * 2;
+    web_object_t **buckets =
+        (web_object_t **)calloc(nbuckets, sizeof(web_object_t *));
+    if (buckets == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < shard->nbuckets; i++) {
+        web_object_t *currObj = shard->buckets[i];
+        while (currObj != NULL) {
+            web_object_t *next = currObj->hnext;
+            size_t b = currObj->keyHash & (nbuckets - 1);
+            currObj->hnext = buckets[b];
+            buckets[b] = currObj;
+            currObj = next;
+        }
+    }
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->nbuckets = nbuckets;
+}
+
+/*adding a web object to the hash index, its keyHash must already be set.*/
+static void hash_insert(cache_shard_t *shard, web_object_t *webObj) {
+    if (shard->count >= shard->nbuckets) {
+        hash_grow(shard);
+    }
+    size_t b = webObj->keyHash & (shard->nbuckets - 1);
+    webObj->hnext = shard->buckets[b];
+    shard->buckets[b] = webObj;
+    shard->count++;
+}
+
+/*removing a web object from the hash index ahead of it being evicted.*/
+static void hash_remove(cache_shard_t *shard, web_object_t *webObj) {
+    web_object_t **link =
+        &shard->buckets[webObj->keyHash & (shard->nbuckets - 1)];
+    while (*link != NULL) {
+        if (*link == webObj) {
+            *link = webObj->hnext;
+            webObj->hnext = NULL;
+            shard->count--;
+            return;
+        }
+        link = &(*link)->hnext;
+    }
+}
 
 /*a method to safely free a web_object_t pointer.
  *
- * Needed during eviction where a web_object_t is removed from the linked list
- * to acoomodate newer objects.
+ * Called by release_cache_obj() once the last reference to an object has been
+ * dropped, so never while a client is still being served from it.
  *
  * params[in] obj a pointer to the web_object_t struct being freed
  *
@@ -64,108 +150,557 @@ static pthread_mutex_t cache_lock;
  */
 
 void freeWebObj(web_object_t *obj) {
-    if (obj->next != NULL) {
-        free(obj->next);
+    if (obj->bodyFd >= 0) {
+        munmap(obj->object, obj->objSize);
+        close(obj->bodyFd);
     }
-    free(obj->urlKey);
-    free(obj->object);
-    free(obj);
+    // the key and (unless in a memfd) the response are in the same chunk.
+    slab_free(&shard_for(obj->keyHash)->slab, obj, obj->chunkSize);
+}
+
+/*a helper keeping a response in a memfd, with web_cache->useMemfd, for
+ *objects of at least CACHE_MEMFD_MIN_SIZE bytes. The memfd is mapped
+ *read-only for anyone needing the bytes and can be handed to sendfile() for
+ *hits, so the bytes live in the kernel page cache rather than in a slab. An
+ *object whose memfd can't be set up (e.g. out of descriptors) goes into its
+ *slab chunk along with the rest.
+ *
+ * params[in] cacheBuf the response bytes
+ * params[in] size the number of bytes in cacheBuf
+ * params[out] bodyFd set to the memfd holding the object, or -1 if none
+ *
+ * @return the mapping of the memfd, or NULL if the response isn't in one
+ */
+static char *store_in_memfd(const char *cacheBuf, size_t size, int *bodyFd) {
+    *bodyFd = -1;
+    if (!web_cache->useMemfd || size < CACHE_MEMFD_MIN_SIZE) {
+        return NULL;
+    }
+    int fd = memfd_create("proxy-cache", MFD_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    void *map = MAP_FAILED;
+    if (rio_writen(fd, (void *)cacheBuf, size) == (ssize_t)size) {
+        map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    if (map == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    *bodyFd = fd;
+    return (char *)map;
 }
 
 /*a helper method to fetch the web object linked to the supplied key arg
- *contained in the singly linked list in web_cache.
+ *from the hash index of its shard. The caller holds the shard lock.
  *
+ * The hash and length of the key are compared before any key bytes, so a
+ * miss rarely touches a string at all.
  *
+ * params[in] shard the shard_for() the hash
  * params[in] key the url key which we are searching the cache for
+ * params[in] hash the hash_key() of key
+ * params[in] len strlen(key)
  *
- *@return a web object pointer to with urlKey = key
- * @post @return != NULL
+ *@return a web object pointer to with urlKey = key, NULL if there's none
  */
-static web_object_t *get_obj_with_key(char const *key) {
-    web_object_t *currObj = web_cache->start;
+static web_object_t *get_obj_with_key(cache_shard_t *shard, char const *key,
+                                      uint64_t hash, size_t len) {
+    web_object_t *currObj = shard->buckets[hash & (shard->nbuckets - 1)];
     while (currObj != NULL) {
-        if (strlen(key) == strlen(currObj->urlKey) &&
-            (strncmp(currObj->urlKey, key, strlen(key)) == 0)) {
+        if (currObj->keyHash == hash && currObj->keyLen == len &&
+            memcmp(currObj->urlKey, key, len) == 0) {
             return currObj;
         }
-        currObj = currObj->next;
+        currObj = currObj->hnext;
     }
     return NULL;
 }
 
-/*a method to evict one or more  web object(s) when our cache has hit peak
- *capacity and needs room to insert a new response object.
+/*a helper recording a hit on an object for its policy, skipping the store
+ *(and the cacheline transfer) if a previous hit already did.*/
+static void mark_referenced(web_object_t *webObj) {
+    if (!atomic_load_explicit(&webObj->referenced, memory_order_relaxed)) {
+        atomic_store_explicit(&webObj->referenced, true, memory_order_relaxed);
+    }
+}
+
+/*a helper clearing the referenced flag of an object, returning whether it was
+ *set, i.e. whether the object was hit since it was last looked at.*/
+static bool take_referenced(web_object_t *webObj) {
+    if (!atomic_load_explicit(&webObj->referenced, memory_order_relaxed)) {
+        return false;
+    }
+    atomic_store_explicit(&webObj->referenced, false, memory_order_relaxed);
+    return true;
+}
+
+/*a helper unlinking a web object from the list of its segment in O(1).*/
+static void list_unlink(cache_shard_t *shard, web_object_t *webObj) {
+    cache_list_t *list = &shard->lists[webObj->segment];
+    if (webObj->prev != NULL) {
+        webObj->prev->next = webObj->next;
+    } else {
+        list->start = webObj->next;
+    }
+    if (webObj->next != NULL) {
+        webObj->next->prev = webObj->prev;
+    } else {
+        list->end = webObj->prev;
+    }
+    list->size -= webObj->charge;
+    webObj->prev = NULL;
+    webObj->next = NULL;
+    webObj->segment = CACHE_SEG_NONE;
+}
+
+/*a helper linking an unlinked web object in at the most recently used end of
+ *the list of a segment in O(1).*/
+static void list_push_front(cache_shard_t *shard, web_object_t *webObj,
+                            int segment) {
+    cache_list_t *list = &shard->lists[segment];
+    webObj->prev = NULL;
+    webObj->next = list->start;
+    if (list->start != NULL) {
+        list->start->prev = webObj;
+    } else {
+        list->end = webObj;
+    }
+    list->start = webObj;
+    list->size += webObj->charge;
+    webObj->segment = segment;
+}
+
+/*a helper moving a web object to the front of the list of a segment, which
+ *may be the one it is on already.*/
+static void list_move_front(cache_shard_t *shard, web_object_t *webObj,
+                            int segment) {
+    list_unlink(shard, webObj);
+    list_push_front(shard, webObj, segment);
+}
+
+/*a helper removing a web object, linked into a list or not, from the shard
+ *locked for writing.*/
+static void remove_object(cache_shard_t *shard, web_object_t *webObj) {
+    if (webObj->segment != CACHE_SEG_NONE) {
+        list_unlink(shard, webObj);
+    }
+    hash_remove(shard, webObj);
+    // upating cache size
+    shard->size -= webObj->charge;
+    // removal drops the cache's reference, clients still being served from
+    // the object free it when they are done.
+    release_cache_obj(webObj);
+}
+
+/*a helper evicting a web object from the shard locked for writing, which
+ *also hands it to the disk tier, if any.*/
+static void evict_object(cache_shard_t *shard, web_object_t *webObj) {
+    // the disk tier takes a reference of its own until written.
+    if (web_cache->disk != NULL) {
+        disk_spill(web_cache->disk, webObj);
+    }
+    shard->evictions++;
+    remove_object(shard, webObj);
+}
+
+/*the "lru" policy. Recency is recorded by hits in the referenced flag alone,
+ *which is enough for every policy here, so the hook is shared.*/
+static void lru_access(cache_shard_t *shard, uint64_t keyHash,
+                       web_object_t *webObj) {
+    (void)shard;
+    (void)keyHash;
+    if (webObj != NULL) {
+        mark_referenced(webObj);
+    }
+}
+
+/*inserting an object with "lru", a single recency list evicted from the back.
  *
- * params[in] size the size of the new response object to be added.
+ * Hits don't relink objects, so a tail object that was hit since it last got
+ * here is moved to the front with its flag cleared instead of being evicted.
+ * Every object is passed over at most once per hit, keeping eviction amortized
+ * O(1).
+ */
+static void lru_insert(cache_shard_t *shard, web_object_t *webObj) {
+    cache_list_t *list = &shard->lists[CACHE_SEG_PROBATION];
+    list_push_front(shard, webObj, CACHE_SEG_PROBATION);
+    // evict objects until size constraint is satisfied.
+    while (shard->size > shard->capacity && list->end != NULL) {
+        web_object_t *toEvict = list->end;
+        // second chance for objects hit while at the back of the list.
+        if (take_referenced(toEvict)) {
+            list_move_front(shard, toEvict, CACHE_SEG_PROBATION);
+            continue;
+        }
+        evict_object(shard, toEvict);
+    }
+}
+
+/*a helper promoting an object hit while on probation to the protected
+ *segment, which demotes the objects falling off the back of the protected
+ *segment to the front of probation once it outgrows its share of the shard.
+ *Protected objects hit again meanwhile go round once more instead.
+ */
+static void slru_promote(cache_shard_t *shard, web_object_t *webObj) {
+    cache_list_t *protected = &shard->lists[CACHE_SEG_PROTECTED];
+    size_t limit = shard->capacity / 100 * CACHE_PROTECTED_PCT;
+    list_move_front(shard, webObj, CACHE_SEG_PROTECTED);
+    while (protected->size > limit) {
+        web_object_t *tail = protected->end;
+        list_move_front(shard, tail,
+                        take_referenced(tail) ? CACHE_SEG_PROTECTED
+                                              : CACHE_SEG_PROBATION);
+    }
+}
+
+/*a helper finding the object of the main segments to evict next: the first
+ *object at the back of probation not hit since it got there, promoting the
+ *ones that were. Protected objects are only evicted once probation is empty.
  *
- *@return a web object pointer to with urlKey = key
- * @post @return != NULL
+ * @return the object to evict, NULL if both segments are empty.
  */
-static void cache_eviction(int size) {
+static web_object_t *slru_victim(cache_shard_t *shard) {
+    while (shard->lists[CACHE_SEG_PROBATION].end != NULL) {
+        web_object_t *tail = shard->lists[CACHE_SEG_PROBATION].end;
+        if (!take_referenced(tail)) {
+            return tail;
+        }
+        slru_promote(shard, tail);
+    }
+    return shard->lists[CACHE_SEG_PROTECTED].end;
+}
 
-    // evict objects until size constraint is satisfied.
-    while (web_cache->size + size > MAX_CACHE_SIZE) {
-        web_object_t *currObj = web_cache->start;
-        web_object_t *prevObj = NULL;
-        // a struct to hold important pointers to faciliate removal of object in
-        // linked list (prev and curr objs).
-        web_object_t *toEvict[2];
-        int minStamp = INT_MAX;
-        while (currObj != NULL) {
-            // finding min tStamp.
-            if (currObj->tStamp < minStamp) {
-                minStamp = currObj->tStamp;
-                toEvict[0] = currObj;
-                toEvict[1] = prevObj;
-            }
-            // updating the two pointers
-            prevObj = currObj;
-            currObj = currObj->next;
+/*inserting an object with "slru", a segmented LRU. New objects start on
+ *probation and only move to the protected segment once hit, so a scan of
+ *objects used once only ever evicts other objects on probation.*/
+static void slru_insert(cache_shard_t *shard, web_object_t *webObj) {
+    list_push_front(shard, webObj, CACHE_SEG_PROBATION);
+    web_object_t *toEvict;
+    while (shard->size > shard->capacity &&
+           (toEvict = slru_victim(shard)) != NULL) {
+        evict_object(shard, toEvict);
+    }
+}
+
+/* The count-min sketch of "tinylfu", estimating how often the keys of a shard
+ * were looked up lately. Counters saturate at SKETCH_MAX and are all halved
+ * every resetAt lookups, so the estimates follow changes in popularity. */
+typedef struct cache_sketch {
+    atomic_uchar *counters; // SKETCH_DEPTH rows of mask + 1 counters
+    size_t mask;            // the width of a row, a power of 2, minus 1
+    atomic_size_t adds;     // lookups recorded since the counters were halved
+    size_t resetAt;         // the number of adds the counters are halved at
+} cache_sketch_t;
+
+#define SKETCH_DEPTH 4        // rows of counters, each with its own hash
+#define SKETCH_MAX 15         // the most a counter counts to, as if 4 bits
+#define SKETCH_MIN_WIDTH 1024 // fewest counters per row
+#define SKETCH_MAX_WIDTH (1 << 20) // most counters per row
+#define SKETCH_BYTES_PER_COUNTER 1024 // shard bytes a counter is kept for
+
+/*a helper picking the counter of a key hash in a row of the sketch. The key
+ *hashes of a shard share their high bits, so they are mixed again per row.*/
+static atomic_uchar *sketch_counter(cache_sketch_t *sketch, uint64_t keyHash,
+                                    int row) {
+    uint64_t h = (keyHash + (uint64_t)(row + 1) * 0x9e3779b97f4a7c15ULL) *
+                 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 31;
+    return &sketch->counters[(size_t)row * (sketch->mask + 1) +
+                             (size_t)(h & sketch->mask)];
+}
+
+/*a helper estimating how often a key hash was looked up lately, which is the
+ *smallest of its counters.*/
+static unsigned sketch_estimate(cache_sketch_t *sketch, uint64_t keyHash) {
+    unsigned freq = SKETCH_MAX;
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        unsigned c = atomic_load_explicit(sketch_counter(sketch, keyHash, row),
+                                          memory_order_relaxed);
+        freq = c < freq ? c : freq;
+    }
+    return freq;
+}
+
+/*recording a lookup with "tinylfu". Lookups of a shard run concurrently, so
+ *counting is racy: an increment is occasionally lost, which only makes an
+ *estimate a little low.*/
+static void tinylfu_access(cache_shard_t *shard, uint64_t keyHash,
+                           web_object_t *webObj) {
+    cache_sketch_t *sketch = (cache_sketch_t *)shard->policyState;
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        atomic_uchar *counter = sketch_counter(sketch, keyHash, row);
+        unsigned char c = atomic_load_explicit(counter, memory_order_relaxed);
+        if (c < SKETCH_MAX) {
+            atomic_store_explicit(counter, c + 1, memory_order_relaxed);
         }
+    }
+    atomic_fetch_add_explicit(&sketch->adds, 1, memory_order_relaxed);
+    lru_access(shard, keyHash, webObj);
+}
+
+/*a helper halving every counter of the sketch once enough lookups were
+ *recorded. Only ever called with the write lock held, so lookups may still
+ *race with it but no two agings overlap.*/
+static void sketch_age(cache_sketch_t *sketch) {
+    size_t adds = atomic_load_explicit(&sketch->adds, memory_order_relaxed);
+    if (adds < sketch->resetAt) {
+        return;
+    }
+    size_t n = SKETCH_DEPTH * (sketch->mask + 1);
+    for (size_t i = 0; i < n; i++) {
+        unsigned char c =
+            atomic_load_explicit(&sketch->counters[i], memory_order_relaxed);
+        atomic_store_explicit(&sketch->counters[i], c >> 1,
+                              memory_order_relaxed);
+    }
+    atomic_store_explicit(&sketch->adds, adds / 2, memory_order_relaxed);
+}
+
+/*setting up the sketch of a shard for "tinylfu", sized to the number of
+ *objects the shard might hold.*/
+static bool tinylfu_init(cache_shard_t *shard) {
+    size_t width = SKETCH_MIN_WIDTH;
+    while (width < SKETCH_MAX_WIDTH &&
+           width < shard->capacity / SKETCH_BYTES_PER_COUNTER) {
+        width *= 2;
+    }
+    cache_sketch_t *sketch = (cache_sketch_t *)malloc(sizeof(cache_sketch_t));
+    atomic_uchar *counters =
+        (atomic_uchar *)calloc(SKETCH_DEPTH * width, sizeof(atomic_uchar));
+    if (sketch == NULL || counters == NULL) {
+        free(sketch);
+        free(counters);
+        return false;
+    }
+    sketch->counters = counters;
+    sketch->mask = width - 1;
+    atomic_init(&sketch->adds, 0);
+    sketch->resetAt = 10 * width;
+    shard->policyState = sketch;
+    return true;
+}
 
-        // doing the removal
-        if (toEvict[1] == NULL) {
-            web_cache->start = (toEvict[0]->next);
-            toEvict[0]->next = NULL;
-        } else {
-            toEvict[1]->next = (toEvict[0]->next);
-            toEvict[0]->next = NULL;
+/*a helper deciding whether an object leaving the window is admitted to the
+ *main segments. If they have no room for it, it is weighed against the
+ *objects it would evict: it is admitted only if it was looked up more often
+ *than all of them together. Weighing by bytes this way, a large object has
+ *to be more popular than every small one it pushes out.
+ *
+ * @params[in] shard the shard, locked for writing
+ * @params[in] candidate the object, accounted for in shard->size but unlinked
+ */
+static void tinylfu_admit(cache_shard_t *shard, web_object_t *candidate) {
+    cache_sketch_t *sketch = (cache_sketch_t *)shard->policyState;
+    if (shard->size > shard->capacity) {
+        size_t excess = shard->size - shard->capacity;
+        unsigned freq = sketch_estimate(sketch, candidate->keyHash);
+        // walking the objects slru_victim() would pick, without promoting
+        // anything yet: those hit lately are going to be promoted instead.
+        unsigned victimsFreq = 0;
+        size_t freed = 0;
+        for (int seg = CACHE_SEG_PROBATION;
+             seg <= CACHE_SEG_PROTECTED && freed < excess && victimsFreq < freq;
+             seg++) {
+            web_object_t *victim = shard->lists[seg].end;
+            for (; victim != NULL && freed < excess && victimsFreq < freq;
+                 victim = victim->prev) {
+                if (seg == CACHE_SEG_PROBATION &&
+                    atomic_load_explicit(&victim->referenced,
+                                         memory_order_relaxed)) {
+                    continue;
+                }
+                victimsFreq += sketch_estimate(sketch, victim->keyHash);
+                freed += victim->charge;
+            }
         }
-        // upating cache size
-        web_cache->size = web_cache->size - (toEvict[0]->objSize);
-        // removal decreases ref count.
-        toEvict[0]->referenceCnt--;
-        // only free when we have that no threads are not using the obj
-        while (toEvict[0]->referenceCnt != 0)
-            ;
-        freeWebObj(toEvict[0]);
+        if (freq <= victimsFreq) {
+            evict_object(shard, candidate);
+            return;
+        }
+        web_object_t *toEvict;
+        while (shard->size > shard->capacity &&
+               (toEvict = slru_victim(shard)) != NULL) {
+            evict_object(shard, toEvict);
+        }
+    }
+    list_push_front(shard, candidate, CACHE_SEG_PROBATION);
+}
+
+/*inserting an object with "tinylfu", W-TinyLFU. New objects go to a small
+ *LRU window first, where they can build up some hits, and the ones falling
+ *off its back are admitted to a segmented LRU main area only if the sketch
+ *says they are worth it (see tinylfu_admit()).*/
+static void tinylfu_insert(cache_shard_t *shard, web_object_t *webObj) {
+    cache_list_t *window = &shard->lists[CACHE_SEG_WINDOW];
+    size_t limit = shard->capacity / 100 * CACHE_WINDOW_PCT;
+    sketch_age((cache_sketch_t *)shard->policyState);
+    list_push_front(shard, webObj, CACHE_SEG_WINDOW);
+    while (window->size > limit) {
+        web_object_t *candidate = window->end;
+        list_unlink(shard, candidate);
+        tinylfu_admit(shard, candidate);
+    }
+    // with the main segments empty, only the window is left to evict from.
+    while (shard->size > shard->capacity && window->end != NULL) {
+        evict_object(shard, window->end);
     }
 }
 
-/*a helper function for add_to_cache that specifically adds to the linked list
- * of web response objects by adding to the beginning of the list.
+// the policies to pick from by name, the first one being the default.
+static const cache_policy_t cache_policies[] = {
+    {"tinylfu", tinylfu_init, tinylfu_access, tinylfu_insert},
+    {"slru", NULL, lru_access, slru_insert},
+    {"lru", NULL, lru_access, lru_insert},
+};
+
+/*a helper allocating a web object, with its key and response, ready to be
+ *inserted. Everything is set up before any lock is taken so that other
+ *threads aren't kept waiting on the copy.
  *
- * Also, identifies if eviction needs to occur before insertion.
+ * params[in] shard the shard_for() the keyHash
+ * params[in] cache_key the key, of keyLen bytes and hashing to keyHash
+ * params[in] cacheBuf the response to copy in, or NULL to leave room for the
+ * caller to fill in at object
+ * params[in] size the length of the response
+ * params[in] hdrSize the length of its header block
+ * params[in] fresh for how long it may be used
  *
- * @params[in] webObj a pointer to the allocated web_object_t block on the heap.
+ * @return the object, NULL if it can't be cached or there is no memory.
+ */
+static web_object_t *object_new(cache_shard_t *shard, char const *cache_key,
+                                uint64_t keyHash, size_t keyLen,
+                                const char *cacheBuf, size_t size,
+                                size_t hdrSize,
+                                const cache_freshness_t *fresh) {
+    size_t metaSize = sizeof(web_object_t) + keyLen + 1;
+    // an object larger than a whole shard could never be cached.
+    if (size > shard->capacity || metaSize + size > shard->capacity) {
+        return NULL;
+    }
+    // the object, its key and its response share a single slab chunk.
+    int bodyFd = -1;
+    char *map = NULL;
+    if (cacheBuf != NULL) {
+        map = store_in_memfd(cacheBuf, size, &bodyFd);
+    }
+    size_t chunkSize;
+    web_object_t *webObj = (web_object_t *)slab_alloc(
+        &shard->slab, metaSize + (map != NULL ? 0 : size), &chunkSize);
+    if (webObj == NULL) {
+        if (map != NULL) {
+            munmap(map, size);
+            close(bodyFd);
+        }
+        return NULL;
+    }
+    char *keyCopy = (char *)(webObj + 1);
+    memcpy(keyCopy, cache_key, keyLen + 1);
+    char *dest = map;
+    if (dest == NULL) {
+        dest = keyCopy + keyLen + 1;
+        if (cacheBuf != NULL) {
+            memcpy(dest, cacheBuf, size);
+        }
+    }
+
+    // basic initialization.
+    webObj->object = dest;
+    webObj->bodyFd = bodyFd;
+    webObj->urlKey = keyCopy;
+    webObj->keyHash = keyHash;
+    webObj->keyLen = keyLen;
+    webObj->objSize = size;
+    webObj->hdrSize = hdrSize;
+    webObj->chunkSize = chunkSize;
+    webObj->charge = chunkSize + (map != NULL ? size : 0);
+    atomic_init(&webObj->expires, (long long)fresh->expires);
+    webObj->staleWhile = fresh->staleWhile;
+    webObj->validatable = fresh->validatable;
+    webObj->segment = CACHE_SEG_NONE;
+    webObj->prev = NULL;
+    webObj->next = NULL;
+    webObj->hnext = NULL;
+    atomic_init(&webObj->referenceCnt, 1);
+    atomic_init(&webObj->referenced, false);
+    atomic_init(&webObj->variant, CACHE_VARIANT_UNKNOWN);
+    // rounding up to the size class may have made it too big after all.
+    if (webObj->charge > shard->capacity) {
+        freeWebObj(webObj);
+        return NULL;
+    }
+    return webObj;
+}
+
+/*a helper inserting a web object from object_new() into its shard. An object
+ *read back from the disk tier (with take) loses to one with the same key that
+ *got there first, while a response just fetched replaces it.
+ *
+ * params[in] shard the shard_for() the object's keyHash
+ * params[in] webObj the object, which the cache takes over
+ * params[in] take whether to take a reference for the caller
  *
- * @pre no NULL input.
+ * @return with take, the object now cached under the key, with a reference
+ * held for the caller; otherwise NULL.
  */
-static void insert_into_cache(web_object_t *webObj) {
-    if (web_cache->start == NULL) {
-        web_cache->start = webObj;
-        return;
+static web_object_t *object_insert(cache_shard_t *shard, web_object_t *webObj,
+                                   bool take) {
+    // locks because we are adding to cache and dynamic memory is shared.
+    pthread_rwlock_wrlock(&shard->lock);
+    // checking if the key already exists as we need unique keys in cache.
+    web_object_t *cached = get_obj_with_key(shard, webObj->urlKey,
+                                            webObj->keyHash, webObj->keyLen);
+    if (cached != NULL && take) {
+        atomic_fetch_add_explicit(&cached->referenceCnt, 1,
+                                  memory_order_relaxed);
+        pthread_rwlock_unlock(&shard->lock);
+        freeWebObj(webObj);
+        return cached;
+    }
+    if (cached != NULL) {
+        remove_object(shard, cached);
     }
+    // the caller's reference is taken first, as the policy may evict the
+    // object straight away.
+    if (take) {
+        atomic_fetch_add_explicit(&webObj->referenceCnt, 1,
+                                  memory_order_relaxed);
+    }
+    // the policy links the object in, making room for it, or evicts it
+    // straight away if it isn't worth the room.
+    hash_insert(shard, webObj);
+    shard->size += webObj->charge;
+    web_cache->policy->insert(shard, webObj);
+    pthread_rwlock_unlock(&shard->lock);
+    return take ? webObj : NULL;
+}
 
-    // acounting for the eviction case.
-    int objSize = webObj->objSize;
-    if (web_cache->size + objSize >= MAX_CACHE_SIZE) {
-        cache_eviction(objSize);
+/*a helper reading an object that missed in memory back from the disk tier,
+ *if it is there, and inserting it into memory again. The read blocks, but the
+ *log is usually in the page cache.
+ *
+ * @return the object with a reference held for the caller, or NULL.
+ */
+static web_object_t *load_from_disk(cache_shard_t *shard, char const *key,
+                                    uint64_t keyHash, size_t keyLen) {
+    disk_ref_t ref;
+    if (!disk_find(web_cache->disk, key, keyLen, keyHash, &ref)) {
+        return NULL;
     }
-    // adding to the head
-    web_object_t *temp = web_cache->start;
-    web_cache->start = webObj;
-    webObj->next = temp;
+    cache_freshness_t fresh = {(time_t)ref.expires, (long)ref.staleWhile,
+                               ref.validatable};
+    web_object_t *webObj = object_new(shard, key, keyHash, keyLen, NULL,
+                                      ref.objSize, ref.hdrSize, &fresh);
+    if (webObj == NULL) {
+        return NULL;
+    }
+    if (!disk_read(web_cache->disk, key, keyLen, keyHash, &ref,
+                   webObj->object)) {
+        freeWebObj(webObj);
+        return NULL;
+    }
+    return object_insert(shard, webObj, true);
 }
 
 /* adding a web response object to the cache. The web response object can be
@@ -176,119 +711,315 @@ static void insert_into_cache(web_object_t *webObj) {
  *
  * @params[in] cache_key the request URL that is associated with the response
  * object being stored in the cache.
- * @params[in] cacheBuf a char pointer to the response from the server.
+ * @params[in] cacheBuf the response from the server, which is copied into the
+ * object's slab chunk (or memfd), so the caller keeps the buffer.
  * @params[in] size the number of bytes represented by cacheBuf/read from the
  * server
+ * @params[in] hdrSize the number of those bytes holding the response header
+ * block, which is framed by Content-Length and has no hop-by-hop headers.
+ * @params[in] fresh for how long the response may be used
  *
  * @return a boolean indicated if adding to cache happened error free.
  * @pre no NULL inputs and size > 0.
  */
-bool add_to_cache(char const *cache_key, char *cacheBuf, int size) {
-    // checking if the key already exists as we need unique keys in cache.
-    if (get_obj_with_key(cache_key) != NULL) {
-        return false;
-    }
-    // locks because we are adding to cache and dynamic memory is shared.
-    pthread_mutex_lock(&cache_lock);
-    // dynamic allocation of a web_object_t to store the web response object
-    // with other important params.
-    web_object_t *webObj = (web_object_t *)malloc(sizeof(web_object_t));
+bool add_to_cache(const cache_key_t *cache_key, const char *cacheBuf,
+                  size_t size, size_t hdrSize, const cache_freshness_t *fresh) {
+    cache_shard_t *shard = shard_for(cache_key->hash);
+    web_object_t *webObj =
+        object_new(shard, cache_key->str, cache_key->hash, cache_key->len,
+                   cacheBuf, size, hdrSize, fresh);
     if (webObj == NULL) {
-        pthread_mutex_unlock(&cache_lock);
         return true;
     }
+    object_insert(shard, webObj, false);
+    return false;
+}
+
+/*if an HTTP response object linked to the URL cache_key is present, this
+ * function returns it with a reference held for the caller, who serves the
+ * client straight from obj->object.
+ *
+ * No need to send a request to the server again. The reference is taken under
+ * the shard's read lock, which is all that keeps a concurrent eviction from
+ * dropping the cache's own reference first.
+ *
+ * @params[in] cache_key the URL key required to search and find object.
+ *
+ * @returns the cached object, which must be handed back with
+ * release_cache_obj(), or NULL if it isn't cached.
+ * @pre cache_key != NULL.
+ */
+web_object_t *serve_cache(const cache_key_t *cache_key) {
+    const char *key = cache_key->str;
+    size_t keyLen = cache_key->len;
+    uint64_t keyHash = cache_key->hash;
+    cache_shard_t *shard = shard_for(keyHash);
+    // hits only read the shard, so they can proceed concurrently.
+    pthread_rwlock_rdlock(&shard->lock);
+    // finding matching object associated with cache_key
+    web_object_t *cacheObj = get_obj_with_key(shard, key, keyHash, keyLen);
+    // recording the lookup, hit or miss, for eviction and admission.
+    web_cache->policy->access(shard, keyHash, cacheObj);
+    if (cacheObj != NULL) {
+        atomic_fetch_add_explicit(&cacheObj->referenceCnt, 1,
+                                  memory_order_relaxed);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    // falling through to the disk tier, if there is one.
+    if (cacheObj == NULL && web_cache->disk != NULL) {
+        cacheObj = load_from_disk(shard, key, keyHash, keyLen);
+    }
+    return cacheObj;
+}
+
+/*a helper building the key a segment of a large object is cached under. The
+ *generation and index follow the object's own key after a space, which no
+ *request URI holds, so it is never taken for the key of another object.
+ *
+ * @return false if the key of the object is too long.
+ */
+static bool segment_key(const cache_key_t *cache_key, uint64_t gen,
+                        uint64_t index, char *out, cache_key_t *key) {
+    int n = snprintf(out, CACHE_SEGMENT_KEY, "%s %016" PRIx64 " %" PRIu64,
+                     cache_key->str, gen, index);
+    if (n <= 0 || n >= CACHE_SEGMENT_KEY) {
+        return false;
+    }
+    cache_key_init(key, out);
+    return true;
+}
 
-    // only allocated the required size.
-    char *dest = (char *)malloc(size);
-    // memcpy as response may contain non-ASCII chars
-    dest = memcpy(dest, cacheBuf, size);
+uint64_t cache_segment_gen(const char *stored, size_t hdrSize) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < hdrSize; i++) {
+        hash ^= (unsigned char)stored[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
 
-    if (dest == NULL) {
-        freeWebObj(webObj);
-        pthread_mutex_unlock(&cache_lock);
+web_object_t *serve_cache_segment(const cache_key_t *cache_key, uint64_t gen,
+                                  uint64_t index) {
+    char buf[CACHE_SEGMENT_KEY];
+    cache_key_t key;
+    if (!segment_key(cache_key, gen, index, buf, &key)) {
+        return NULL;
+    }
+    return serve_cache(&key);
+}
+
+bool add_segment_to_cache(const cache_key_t *cache_key, uint64_t gen,
+                          uint64_t index, const char *buf, size_t len,
+                          const cache_freshness_t *fresh) {
+    char keyBuf[CACHE_SEGMENT_KEY];
+    cache_key_t key;
+    if (!segment_key(cache_key, gen, index, keyBuf, &key)) {
         return true;
     }
+    // a segment is all body, with no header block of its own.
+    return add_to_cache(&key, buf, len, 0, fresh);
+}
 
-    webObj->object = dest;
+/*a helper building the key the variant of a response is cached under, the
+ *key of the response followed by the content coding and the generation of
+ *the response after spaces, as for segment_key().
+ *
+ * @return false if the key of the response is too long.
+ */
+static bool variant_key(web_object_t *obj, char *out, cache_key_t *key) {
+    int n = snprintf(out, CACHE_SEGMENT_KEY, "%s %s %016" PRIx64, obj->urlKey,
+                     CACHE_VARIANT_CODING,
+                     cache_segment_gen(obj->object, obj->hdrSize));
+    if (n <= 0 || n >= CACHE_SEGMENT_KEY) {
+        return false;
+    }
+    cache_key_init(key, out);
+    return true;
+}
 
-    // need to create a key copy as the key will be freed in the proxy code.
-    char *keyCopy = (char *)malloc((strlen(cache_key) + 1));
-    keyCopy = strcpy(keyCopy, cache_key);
-    if (keyCopy == NULL) {
-        freeWebObj(webObj);
-        pthread_mutex_unlock(&cache_lock);
+web_object_t *serve_cache_variant(web_object_t *obj) {
+    char buf[CACHE_SEGMENT_KEY];
+    cache_key_t key;
+    if (!variant_key(obj, buf, &key)) {
+        return NULL;
+    }
+    return serve_cache(&key);
+}
+
+bool add_variant_to_cache(web_object_t *obj, const char *buf, size_t size,
+                          size_t hdrSize) {
+    char keyBuf[CACHE_SEGMENT_KEY];
+    cache_key_t key;
+    if (!variant_key(obj, keyBuf, &key)) {
         return true;
     }
+    // the freshness of the response is the one that hits go by, and a 304
+    // for it leaves the variant as good as it was.
+    cache_freshness_t fresh = {
+        (time_t)atomic_load_explicit(&obj->expires, memory_order_relaxed),
+        obj->staleWhile, false};
+    return add_to_cache(&key, buf, size, hdrSize, &fresh);
+}
 
-    // basic initialization.
-    webObj->urlKey = keyCopy;
-    webObj->objSize = size;
-    webObj->tStamp = web_cache->LRU;
-    webObj->next = NULL;
-    webObj->referenceCnt = 1;
-    insert_into_cache(webObj);
-    web_cache->size += size;
-    pthread_mutex_unlock(&cache_lock);
-    return false;
+bool cache_obj_fresh(web_object_t *obj, time_t now) {
+    return (long long)now <
+           atomic_load_explicit(&obj->expires, memory_order_relaxed);
 }
 
-/*if an HTTP response object linked to the URL cache_key is present, this
- * function writes to connfd, serving the client directly.
- *
- * No need to send a request to the server again.
- *
- * @params[out] fd this is the connection file descriptor returned when we
- * accept a client request.
- * @params[in] cache_key a const char pointer to the URL key required to search
- * and find object.
+bool cache_obj_stale_usable(web_object_t *obj, time_t now) {
+    return (long long)now <
+           atomic_load_explicit(&obj->expires, memory_order_relaxed) +
+               obj->staleWhile;
+}
+
+void cache_refresh(web_object_t *obj, time_t expires) {
+    atomic_store_explicit(&obj->expires, (long long)expires,
+                          memory_order_relaxed);
+}
+
+/*dropping a reference to a web object obtained from serve_cache(). The last
+ * reference to an object that has already been evicted frees it.
  *
- * @returns a boolean indicating if cache could serve the client (true = yes
- * client was written to with the object in the cache, false otherwise).
- * @pre cache_key != NULL and fd > 0.
+ * @params[in] obj the object to release.
+ * @pre obj != NULL
  */
-bool serve_cache(int fd, const char *cache_key) {
-    // single mutex lock while accessing global variable web_cache.
-    //
-    pthread_mutex_lock(&cache_lock);
-    web_object_t *cacheObj = NULL;
-    // update LRU var
-    web_cache->LRU++;
-    // finding matching object associated with cache_key
-    if ((cacheObj = get_obj_with_key(cache_key)) != NULL) {
-        // updated object struct to show that it is being used and for the LRU
-        // implementation.
-        cacheObj->tStamp = web_cache->LRU;
-        cacheObj->referenceCnt++;
-        pthread_mutex_unlock(&cache_lock);
-        // writing back to the client directly.
-        if (rio_writen(fd, cacheObj->object, cacheObj->objSize) <= 0) {
-            fprintf(stderr, "Could not write response to client");
-        }
-        // done with the use.
-        cacheObj->referenceCnt--;
-        return true;
+void release_cache_obj(web_object_t *obj) {
+    // acq_rel so that the freeing thread sees every other thread's last use.
+    if (atomic_fetch_sub_explicit(&obj->referenceCnt, 1,
+                                  memory_order_acq_rel) == 1) {
+        freeWebObj(obj);
     }
-    pthread_mutex_unlock(&cache_lock);
-    return false;
+}
+
+void cache_invalidate(const cache_key_t *cache_key) {
+    cache_shard_t *shard = shard_for(cache_key->hash);
+    pthread_rwlock_wrlock(&shard->lock);
+    web_object_t *cacheObj = get_obj_with_key(
+        shard, cache_key->str, cache_key->hash, cache_key->len);
+    if (cacheObj != NULL) {
+        remove_object(shard, cacheObj);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    if (web_cache->disk != NULL) {
+        disk_forget(web_cache->disk, cache_key->str, cache_key->len,
+                    cache_key->hash);
+    }
+}
+
+web_object_t *retain_cache_obj(web_object_t *obj) {
+    atomic_fetch_add_explicit(&obj->referenceCnt, 1, memory_order_relaxed);
+    return obj;
 }
 
 /* initialising the web cache by mallocing a block that web_cache variables
- * points to */
-void init_web_cache() {
+ * points to. Unless told otherwise, the cache gets as many shards (up to
+ * CACHE_SHARDS) as it can while every shard can still hold an object of
+ * maxObject. */
+void init_web_cache(size_t capacity, size_t maxObject, int nshards,
+                    const char *policy) {
+    web_cache = NULL;
+    const cache_policy_t *cachePolicy = NULL;
+    size_t npolicies = sizeof(cache_policies) / sizeof(cache_policies[0]);
+    for (size_t i = 0; i < npolicies; i++) {
+        if (policy == NULL || strcmp(cache_policies[i].name, policy) == 0) {
+            cachePolicy = &cache_policies[i];
+            break;
+        }
+    }
+    if (cachePolicy == NULL) {
+        fprintf(stderr, "unable to create cache: unknown policy %s\n", policy);
+        return;
+    }
+    if (nshards == 0) {
+        nshards = CACHE_SHARDS;
+        while (nshards > 1 && capacity / (size_t)nshards < maxObject) {
+            nshards /= 2;
+        }
+    }
+    if (nshards < 1 || nshards > CACHE_SHARDS_MAX ||
+        (nshards & (nshards - 1)) != 0) {
+        fprintf(stderr, "unable to create cache: shards must be a power of 2 "
+                        "up to %d\n",
+                CACHE_SHARDS_MAX);
+        return;
+    }
+    // an object larger than a whole shard could never be cached.
+    if (maxObject == 0 || capacity / (size_t)nshards < maxObject) {
+        fprintf(stderr, "unable to create cache: %d shard(s) of %zu bytes "
+                        "can't hold objects of %zu bytes\n",
+                nshards, capacity / (size_t)nshards, maxObject);
+        return;
+    }
     web_cache = (web_cache_t *)malloc(sizeof(web_cache_t));
     if (web_cache == NULL) {
         fprintf(stderr, "unable to create cache\n");
         return;
     }
-    if (web_cache != NULL) {
-        web_cache->size = 0;
-        web_cache->LRU = 0;
-        web_cache->start = NULL;
+    void *shards = NULL;
+    if (posix_memalign(&shards, 64, nshards * sizeof(cache_shard_t)) != 0) {
+        fprintf(stderr, "unable to create cache\n");
+        free(web_cache);
+        web_cache = NULL;
+        return;
+    }
+    web_cache->useMemfd = false;
+    web_cache->policy = cachePolicy;
+    web_cache->disk = NULL;
+    web_cache->shards = (cache_shard_t *)shards;
+    web_cache->nshards = nshards;
+    web_cache->capacity = capacity;
+    web_cache->maxObject = maxObject;
+    web_cache->maxLarge = 0;
+    if (CACHE_SEGMENT_SIZE <= maxObject) {
+        web_cache->maxLarge = capacity / 100 * CACHE_LARGE_PCT;
+    }
+    for (int i = 0; i < nshards; i++) {
+        cache_shard_t *shard = &web_cache->shards[i];
+        shard->size = 0;
+        shard->capacity = capacity / (size_t)nshards;
+        for (int seg = 0; seg < CACHE_SEGMENTS; seg++) {
+            shard->lists[seg].start = NULL;
+            shard->lists[seg].end = NULL;
+            shard->lists[seg].size = 0;
+        }
+        shard->policyState = NULL;
+        // the common objects, and segments, all come from slab pages.
+        size_t largest = maxObject > CACHE_SEGMENT_SIZE ? maxObject
+                                                        : CACHE_SEGMENT_SIZE;
+        slab_init(&shard->slab, shard->capacity,
+                  sizeof(web_object_t) + CACHE_SEGMENT_KEY + largest);
+        shard->count = 0;
+        shard->evictions = 0;
+        shard->nbuckets = CACHE_HASH_BUCKETS;
+        shard->buckets = (web_object_t **)calloc(CACHE_HASH_BUCKETS,
+                                                 sizeof(web_object_t *));
+        if (shard->buckets == NULL ||
+            (cachePolicy->init != NULL && !cachePolicy->init(shard))) {
+            fprintf(stderr, "unable to create cache\n");
+            exit(1);
+        }
     }
 }
 
-/* initialising pthread mutual exclusion lock is required. This allows for cache
- * access synchronization */
+void cache_stats(cache_stats_t *stats) {
+    stats->size = 0;
+    stats->capacity = web_cache->capacity;
+    stats->objects = 0;
+    stats->evictions = 0;
+    for (int i = 0; i < web_cache->nshards; i++) {
+        cache_shard_t *shard = &web_cache->shards[i];
+        pthread_rwlock_rdlock(&shard->lock);
+        stats->size += shard->size;
+        stats->objects += shard->count;
+        stats->evictions += shard->evictions;
+        pthread_rwlock_unlock(&shard->lock);
+    }
+}
+
+/* initialising the pthread read-write lock of every shard is required. This
+ * allows for cache access synchronization */
 void init_cache_lock() {
-    pthread_mutex_init(&cache_lock, NULL);
+    for (int i = 0; i < web_cache->nshards; i++) {
+        pthread_rwlock_init(&web_cache->shards[i].lock, NULL);
+    }
 }
@@ -2,58 +2,249 @@
  * @file: cache.h
  * @brief: this is the header file for the cache implementation for a web
  * multi-threaded proxy. The cache is implemented with LRU principles and allows
- * for adding unique URL-response objects with MAX_OBJECT_SIZE. The web-cache
- * struct contains a singly linked list, a size variable (MAX_CACHE_SIZE is the
- * limit), and a counter variable (LRU). The struct of a web object consists of
- * a key-value pair (urlKey and object), a timestamp of use/creation and a
+ * for adding unique URL-response objects of up to maxObject bytes. The
+ * web-cache struct contains a doubly linked recency list and a size variable
+ * (capacity is the limit). Hits move an object to the front of the list
+ * and eviction takes from the back, both in O(1). The struct of a web object
+ * consists of a key-value pair (urlKey and object), its list links and a
  * referenceCnt to ensure that an object is not being freed while in use on two
- * or more threads.
+ * or more threads. Objects are also chained into a hash table on urlKey so
+ * lookups are O(1).
+ *
+ * The cache is split into independently locked shards picked by key hash, each
+ * with its own recency list, hash table and share of the capacity. Hits only
+ * take their shard's lock for reading and mark the object as referenced; the
+ * object is moved to the front of the list lazily, when eviction reaches it,
+ * so concurrent hits never serialize on a writer lock.
+ *
+ * What to evict, and whether a new object is worth the ones it would push out,
+ * is up to a cache_policy_t picked by name when the cache is set up: "lru" is
+ * the above, "slru" a segmented LRU protecting objects hit since they were
+ * inserted, and "tinylfu" W-TinyLFU, which only admits an object to the main
+ * segments if a frequency sketch says it is used more than the objects it
+ * would displace, bytes for bytes.
+ *
+ * Every object is a single chunk of its shard's slab (see slab.h), with the
+ * key and the response stored inline after the web_object_t, so an insertion
+ * or an eviction never goes to malloc, and the size of a shard counts the
+ * memory its objects really take up.
+ *
+ * With a disk tier (see disk.h), evicted objects are written to a log on disk
+ * and misses in memory are looked up there before going to the server.
+ *
+ * Every object carries the time it goes stale, worked out by the proxy from
+ * the response's freshness headers. A stale object is still cached, as the
+ * proxy can revalidate it with the server and refresh it on a 304, instead of
+ * fetching it again. For a while after going stale it may also carry on being
+ * served while the proxy refreshes it in the background.
+ *
+ * Responses larger than maxObject, up to maxLarge, are cached in segments of
+ * CACHE_SEGMENT_SIZE bytes of body, each an object of its own under a key of
+ * its own, ahead of which the object under the request's key holds only the
+ * header block. The segments are cached as they arrive from the server, so
+ * clients can be served from the first segments while the rest are still
+ * being fetched, and one segment can be evicted without the others. Segment
+ * keys carry a generation, the hash of the header block, so the segments of
+ * a response that has been replaced are never served with the new one.
+ *
+ * A response worth compressing can have a gzip variant cached alongside it,
+ * an object of its own whose key carries the generation of the response as
+ * segment keys do, so a variant never outlives the response it was made from.
+ * The variant is served to clients accepting gzip, in place of the response.
+ *
+ * With useMemfd, larger objects are stored in a memfd (and mapped read-only at
+ * object) so that hits can be sent with sendfile() straight from the page
+ * cache.
  *
  * @Author Sanah Imani <simani@unix.andrew.cmu.edu>
  */
 
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <disk.h>
+#include <pthread.h>
+#include <slab.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
 
-// important size-limit constant definitions
+// important size-limit constant definitions, the defaults of the limits given
+// to init_web_cache()
 #define MAX_CACHE_SIZE (1024 * 1024) // max size of the cache in bytes
 #define MAX_OBJECT_SIZE                                                        \
     (100 * 1024) // max size of a response object being stored in the cache in
                  // bytes.
+#define CACHE_HASH_BUCKETS 64 // initial buckets per shard, a power of 2
+#define CACHE_SHARDS 16 // number of cache shards picked by default, at most
+#define CACHE_SHARDS_MAX 1024 // max number of cache shards, a power of 2
+#define CACHE_MEMFD_MIN_SIZE                                                   \
+    (16 * 1024) // objects at least this big are kept in a memfd when enabled
+#define CACHE_PROTECTED_PCT 80 // share of a shard, in percent, kept for objects
+                               // hit since insertion by "slru" and "tinylfu"
+#define CACHE_WINDOW_PCT 1 // share of a shard, in percent, that "tinylfu"
+                           // admits new objects to unconditionally
+#define CACHE_SEGMENT_SIZE (64 * 1024) // body bytes in a segment of a large
+                                       // object, the last one excepted
+#define CACHE_LARGE_PCT 25 // max share of the cache, in percent, that a large
+                           // object may take up in segments
+#define CACHE_SEGMENT_KEY 8192 // longest key of a large object, plus room for
+                               // the generation and index of its segments
+#define CACHE_VARIANT_CODING "gzip" // the content coding of variants
+
+/* The segments an object can be linked into, each with a recency list. */
+enum cache_segment {
+    CACHE_SEG_NONE = -1,    // not linked into any list
+    CACHE_SEG_WINDOW,       // new objects on probation for "tinylfu" admission
+    CACHE_SEG_PROBATION,    // objects not hit since admission, evicted first
+    CACHE_SEG_PROTECTED,    // objects hit since admission
+    CACHE_SEGMENTS
+};
+
+/* Whether a cached response has a compressed variant, as far as hits know. */
+enum cache_variant {
+    CACHE_VARIANT_UNKNOWN, // not looked at yet, or its variant may be gone
+    CACHE_VARIANT_QUEUED,  // queued to have one made in the background
+    CACHE_VARIANT_NONE     // not worth compressing, so it never has one
+};
+
+/* A cache key, with its length and hash worked out once for all the lookups
+ * of a request, rather than by each of them. */
+typedef struct cache_key {
+    const char *str; // the key, NUL-terminated, owned by the caller
+    size_t len;      // strlen(str)
+    uint64_t hash;   // its 64-bit FNV-1a hash, as stored in web_object_t
+} cache_key_t;
+
+/* For how long a cached response may be used, from its freshness headers. */
+typedef struct cache_freshness {
+    time_t expires;   // when it goes stale, in seconds since the epoch
+    long staleWhile;  // seconds after expires it may still be served for while
+                      // being refreshed in the background
+    bool validatable; // whether it can be revalidated once stale
+} cache_freshness_t;
 
 typedef struct web_object_t {
-    char *urlKey;     // the url serves as an identifier for the response object
-    char *object;     // the response object from the server
-    int objSize;      // the length of the response
-    int tStamp;       // when the object has been last used / first created
-    int referenceCnt; // a value to check how many threads using the object.
-                      // Only when zero, then the object can be freed during
-                      // eviction
-    struct web_object_t *next; // the pointer to the next web object if any
+    char *urlKey;     // the url serves as an identifier for the response
+                      // object, stored right after the web_object_t
+    uint64_t keyHash; // hash of urlKey, computed once at insertion
+    size_t keyLen;    // strlen(urlKey)
+    char *object;     // the response object from the server, stored right
+                      // after urlKey unless it is in a memfd
+    int bodyFd;       // memfd object is mapped from, for sendfile(), or -1 if
+                      // object is in the slab chunk
+    size_t objSize;   // the length of the response
+    size_t hdrSize;   // the length of its header block, which ends in the
+                      // blank line ahead of the body
+    size_t chunkSize; // the size of the slab chunk the object is in
+    size_t charge;    // the bytes it takes up, counted by the shard's size: its
+                      // chunk, plus its memfd if it has one
+    atomic_llong expires; // when it goes stale, in seconds since the epoch,
+                          // pushed back when revalidated
+    long staleWhile;      // seconds after expires it may still be served
+                          // for while being refreshed
+    bool validatable;     // whether the server can be asked if the stale
+                          // object is still good (it has a validator)
+    atomic_int referenceCnt; // one reference held by the cache while the
+                             // object is linked in, plus one per client being
+                             // served from it. Whoever drops the last one
+                             // frees the object.
+    atomic_bool referenced; // set by hits, the object gets a second chance
+                            // (or a promotion) at the back of its list
+    atomic_int variant;     // the enum cache_variant of the response
+    int segment;                // the enum cache_segment list it is on
+    struct web_object_t *prev;  // the next more recently used web object
+    struct web_object_t *next;  // the next less recently used web object
+    struct web_object_t *hnext; // the next web object in the same hash bucket
 } web_object_t;
 
+/* A recency list of web objects, most recently used first. */
+typedef struct cache_list {
+    struct web_object_t *start; // the most recently used web_object_t
+    struct web_object_t *end;   // the least recently used web_object_t, which
+                                // is evicted first
+    size_t size;                // the sum of the objSize of its objects
+} cache_list_t;
+
+typedef struct cache_shard {
+    pthread_rwlock_t lock; // read-locked by hits, write-locked for changes
+    cache_list_t lists[CACHE_SEGMENTS]; // recency list of every segment
+    void *policyState; // state the policy keeps per shard, if any
+    slab_t slab;           // where the shard's objects are allocated
+    size_t size;     // current size of the shard, the sum of the charge of
+                     // its objects
+    size_t capacity; // the shard's share of the cache capacity
+    struct web_object_t **buckets; // hash table of the objects on keyHash
+    size_t nbuckets;               // number of buckets, a power of 2
+    size_t count;                  // number of objects in the table
+    uint64_t evictions;            // objects evicted to make room, ever
+} __attribute__((aligned(64))) cache_shard_t;
+
+/* An eviction and admission policy, which threads the objects of a shard
+ * through its segment lists. */
+typedef struct cache_policy {
+    const char *name; // what the policy is picked by
+    // setting up policyState of a new shard, NULL if there is none. Returns
+    // false if there is no memory for it.
+    bool (*init)(cache_shard_t *shard);
+    // recording a lookup of keyHash, which found obj or NULL for a miss. Only
+    // the read lock is held, so it must make do with atomics.
+    void (*access)(cache_shard_t *shard, uint64_t keyHash, web_object_t *obj);
+    // linking in an object just added to shard->size and the hash table, and
+    // evicting objects, possibly obj itself, until the shard fits its
+    // capacity again. The write lock is held.
+    void (*insert)(cache_shard_t *shard, web_object_t *obj);
+} cache_policy_t;
+
 typedef struct web_cache {
-    struct web_object_t
-        *start; // the pointer to the first web_object_t of the linked list
-    int size;   // current size of the cache that only includes the response
-                // object sizes
-    int LRU; // a variable counter to assign tStamps and implemented LRU-cache.
+    const cache_policy_t *policy; // the eviction and admission policy
+    cache_shard_t *shards; // the shards, selected by the key hash
+    int nshards;           // number of shards, a power of 2
+    size_t capacity;       // max size of the cache in bytes
+    size_t maxObject;      // max size of a cached response in bytes
+    size_t maxLarge;       // max size of a response cached in segments, 0
+                           // if segments don't fit under maxObject
+    bool useMemfd; // whether to keep objects of CACHE_MEMFD_MIN_SIZE or more
+                   // in a memfd for zero-copy hits (default false)
+    disk_tier_t *disk; // the tier evicted objects go to and misses are looked
+                       // up in, NULL if none (the default)
 } web_cache_t;
 
+/* What the cache holds, summed over its shards. */
+typedef struct cache_stats {
+    size_t size;        // the bytes its objects take up
+    size_t capacity;    // its max size in bytes
+    size_t objects;     // the objects in it, segments included
+    uint64_t evictions; // objects evicted to make room
+} cache_stats_t;
+
 // a global, external pointer to a heap-allocated web_cache object that forms
 // the basis of the cache.
 extern web_cache_t *web_cache;
 
 /* initialising the web cache by mallocing a block that web_cache variables
- * points to */
-void init_web_cache();
+ * points to. web_cache is left NULL if the limits don't make sense, the policy
+ * is unknown or there is no memory for the cache.
+ *
+ * @params[in] capacity the max size of the cache in bytes (MAX_CACHE_SIZE)
+ * @params[in] maxObject the max size of a cached response (MAX_OBJECT_SIZE)
+ * @params[in] nshards the number of shards, a power of 2 no bigger than
+ * CACHE_SHARDS_MAX, or 0 to pick the most (up to CACHE_SHARDS) that can each
+ * hold an object of maxObject.
+ * @params[in] policy the name of the cache_policy_t, or NULL for "tinylfu"
+ */
+void init_web_cache(size_t capacity, size_t maxObject, int nshards,
+                    const char *policy);
 
-/* initialising pthread mutual exclusion lock is required. This allows for cache
- * access synchronization */
+/* initialising the pthread read-write lock of every shard is required. This
+ * allows for cache access synchronization */
 void init_cache_lock();
 /*a method to safely free a web_object_t pointer.
  *
- * Needed during eviction where a web_object_t is removed from the linked list
- * to acoomodate newer objects.
+ * Called by release_cache_obj() once the last reference to an object has been
+ * dropped, so never while a client is still being served from it.
  *
  * params[in] obj a pointer to the web_object_t struct being freed
  *
@@ -61,21 +252,146 @@ void init_cache_lock();
  */
 void freeWebObj(web_object_t *obj);
 
+/* hashing a key for the cache, once.
+ *
+ * @params[out] key the key
+ * @params[in] str its string, which must outlive key
+ */
+void cache_key_init(cache_key_t *key, const char *str);
+
 /*if an HTTP response object linked to the URL cache_key is present, this
- * function writes to connfd, serving the client directly.
+ * function returns it with a reference held for the caller, who serves the
+ * client straight from obj->object, or with sendfile() from obj->bodyFd when
+ * that isn't -1.
+ *
+ * No need to send a request to the server again. The reference keeps the
+ * object alive even if it is evicted while the client is still being written
+ * to, so the event loop can write it out over several non-blocking writes.
+ * An object only in the disk tier is read back into memory first.
+ *
+ * @params[in] cache_key the URL key required to search and find object.
+ *
+ * @returns the cached object, which must be handed back with
+ * release_cache_obj(), or NULL if it isn't cached.
+ * @pre cache_key != NULL.
+ */
+web_object_t *serve_cache(const cache_key_t *cache_key);
+
+/* whether a cached object is still fresh, and can be served without asking
+ * the server.
+ *
+ * @params[in] obj the object, with a reference held
+ * @params[in] now the current time
+ */
+bool cache_obj_fresh(web_object_t *obj, time_t now);
+
+/* whether a stale cached object may still be served while it is refreshed in
+ * the background, as it went stale less than its staleWhile ago.
+ *
+ * @params[in] obj the object, with a reference held
+ * @params[in] now the current time
+ */
+bool cache_obj_stale_usable(web_object_t *obj, time_t now);
+
+/* pushing back when a cached object goes stale, after the server has said
+ * with a 304 that it is still good. Clients being served from the object are
+ * unaffected, as the response itself doesn't change.
  *
- * No need to send a request to the server again.
+ * @params[in] obj the object, with a reference held
+ * @params[in] expires when it goes stale now
+ */
+void cache_refresh(web_object_t *obj, time_t expires);
+
+/*dropping a reference to a web object obtained from serve_cache(). The last
+ * reference to an object that has already been evicted frees it.
  *
- * @params[out] fd this is the connection file descriptor returned when we
- * accept a client request.
- * @params[in] cache_key a const char pointer to the URL key required to search
- * and find object.
+ * @params[in] obj the object to release.
+ * @pre obj != NULL
+ */
+void release_cache_obj(web_object_t *obj);
+
+/* dropping whatever is cached under a key, in memory and on disk, as a
+ * request that may have changed the resource has gone through.
  *
- * @returns a boolean indicating if cache could serve the client (true = yes
- * client was written to with the object in the cache, false otherwise).
- * @pre cache_key != NULL and fd > 0.
+ * @params[in] cache_key the key
  */
-bool serve_cache(int fd, const char *cache_key);
+void cache_invalidate(const cache_key_t *cache_key);
+
+/*taking another reference to a web object already held, to be dropped with
+ * release_cache_obj() in turn.
+ *
+ * @params[in] obj the object
+ * @return obj
+ */
+web_object_t *retain_cache_obj(web_object_t *obj);
+
+/* summing up what the shards of the cache hold, for the metrics. Shards are
+ * read-locked one at a time, so the sums are not a snapshot of the cache as
+ * a whole.
+ *
+ * @params[out] stats the sums
+ */
+void cache_stats(cache_stats_t *stats);
+
+/* the generation of a large object, which the keys of its segments carry.
+ *
+ * @params[in] stored the header block of the object under the request's key
+ * @params[in] hdrSize its length
+ *
+ * @return the hash of the header block
+ */
+uint64_t cache_segment_gen(const char *stored, size_t hdrSize);
+
+/* looking up a segment of a large object, as serve_cache() does an object.
+ *
+ * @params[in] cache_key the key of the large object
+ * @params[in] gen its generation
+ * @params[in] index which segment, the first one being 0
+ *
+ * @returns the segment with a reference held, whose objSize bytes of body
+ * start at object, or NULL if it isn't cached.
+ */
+web_object_t *serve_cache_segment(const cache_key_t *cache_key, uint64_t gen,
+                                  uint64_t index);
+
+/* adding a segment of a large object, once the server has sent all of it.
+ *
+ * @params[in] cache_key the key of the large object
+ * @params[in] gen its generation
+ * @params[in] index which segment, the first one being 0
+ * @params[in] buf the body bytes of the segment, copied as by add_to_cache()
+ * @params[in] len their number, CACHE_SEGMENT_SIZE but for the last segment
+ * @params[in] fresh the freshness of the large object
+ *
+ * @return true if the segment could not be cached, as for add_to_cache().
+ */
+bool add_segment_to_cache(const cache_key_t *cache_key, uint64_t gen,
+                          uint64_t index, const char *buf, size_t len,
+                          const cache_freshness_t *fresh);
+
+/* looking up the compressed variant of a cached response, as serve_cache()
+ * does an object.
+ *
+ * @params[in] obj the response, with a reference held
+ *
+ * @returns the variant with a reference held, a response of its own with a
+ * header block of hdrSize bytes, or NULL if it isn't cached.
+ */
+web_object_t *serve_cache_variant(web_object_t *obj);
+
+/* adding the compressed variant of a cached response, which goes stale along
+ * with it.
+ *
+ * @params[in] obj the response, with a reference held
+ * @params[in] buf the variant, its header block and then its body, copied as
+ * by add_to_cache()
+ * @params[in] size the length of the variant
+ * @params[in] hdrSize the length of its header block
+ *
+ * @return true if the variant could not be cached, as for add_to_cache().
+ */
+bool add_variant_to_cache(web_object_t *obj, const char *buf, size_t size,
+                          size_t hdrSize);
 
 /* adding a web response object to the cache. The web response object can be
  * thought of as a block of memory with the content supplied in cacheBuf along
@@ -85,11 +401,21 @@ bool serve_cache(int fd, const char *cache_key);
  *
  * @params[in] cache_key the request URL that is associated with the response
  * object being stored in the cache.
- * @params[in] cacheBuf a char pointer to the response from the server.
+ * @params[in] cacheBuf the response from the server, which is copied into the
+ * object's slab chunk (or memfd), so the caller keeps the buffer.
  * @params[in] size the number of bytes represented by cacheBuf/read from the
  * server
+ * @params[in] hdrSize the number of those bytes holding the response header
+ * block, which is framed by Content-Length and has no hop-by-hop headers.
+ * @params[in] fresh for how long the response may be used
+ *
+ * An object already cached under the key is replaced, as the response just
+ * fetched is the more recent one.
  *
  * @return a boolean indicated if adding to cache happened error free.
  * @pre no NULL inputs and size > 0.
  */
-bool add_to_cache(char const *cache_key, char *cacheBuf, int size);
+bool add_to_cache(const cache_key_t *cache_key, const char *cacheBuf,
+                  size_t size, size_t hdrSize, const cache_freshness_t *fresh);
+
+#endif /* __CACHE_H__ */
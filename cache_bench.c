@@ -0,0 +1,502 @@
+/*
+ * @file: cache_bench.c
+ * @brief: a microbenchmark of the web cache on its own, linked straight
+ * against cache.c, with no sockets or proxy in the way. For every combination
+ * of object count, thread count and key length asked for, it measures three
+ * phases on a cache of its own:
+ *
+ *  - insert: the threads add the objects to an empty cache big enough to
+ *    hold them all.
+ *  - lookup: the threads look objects up, picked uniformly or by a Zipf
+ *    distribution, and write every hit to /dev/null as a client would be
+ *    written to.
+ *  - evict: the threads add as many new objects again, so that every insert
+ *    into the now full cache evicts.
+ *
+ * Every combination runs in a child process of its own, as the cache can't be
+ * torn down, so one doesn't start with the memory left by the other. The cost
+ * of an operation is given as the time a thread spends on it, along with the
+ * throughput of all of the threads together.
+ *
+ * It is built with the cache's sources:
+ *     cc -O2 -pthread -I. -o cache_bench cache_bench.c cache.c slab.c disk.c
+ *         csapp.c -lm
+ * and run, for instance, as
+ *     ./cache_bench -n 1000,100000 -t 1,4,16 -k 32,64-512 -a 0.99 -p lru
+ *
+ * @Author Sanah Imani <simani@unix.andrew.cmu.edu>
+ */
+
+#include <cache.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_MAX_LIST 16  // max entries in a list of option values
+#define BENCH_KEY_PREFIX "http://bench.example/"
+
+/* A range of key lengths, picked from uniformly. */
+typedef struct key_range {
+    size_t min;
+    size_t max;
+} key_range_t;
+
+/* What the benchmark is configured with. */
+typedef struct bench_config {
+    long counts[BENCH_MAX_LIST];       // object counts to measure
+    int ncounts;
+    long threads[BENCH_MAX_LIST];      // thread counts to measure
+    int nthreads;
+    key_range_t keys[BENCH_MAX_LIST];  // key lengths to measure
+    int nkeys;
+    size_t bodySize;   // bytes in the body of every object
+    long lookups;      // lookups per phase, across all threads
+    double zipf;       // exponent of the lookup distribution, 0 for uniform
+    int shards;        // shards of the cache, 0 to let the cache pick
+    const char *policy; // the cache policy, NULL for the default
+    bool useMemfd;     // whether to store objects in memfds
+} bench_config_t;
+
+/* One run: a combination of the values measured. */
+typedef struct bench_run {
+    long count;       // objects
+    int threads;      // threads
+    key_range_t key;  // key lengths
+    cache_key_t *keyv; // 2 * count keys, the first half inserted first,
+                       // hashed ahead as the proxy hashes a request's once
+    char *response;   // the response every object is cached with
+    size_t respSize;  // its length
+    size_t hdrSize;   // the length of its header block
+    double *zipfCdf;  // the cumulative lookup distribution, or NULL
+    pthread_barrier_t start; // released once every thread is ready
+} bench_run_t;
+
+/* A thread of a phase. */
+typedef struct worker {
+    bench_run_t *run;
+    int id;          // index of the thread
+    uint64_t rng;    // state of its random number generator
+    long hits;       // lookups that found their object
+    long failed;     // inserts the cache didn't take
+    double start;    // when it started on the phase
+    double end;      // when it was done with it
+} worker_t;
+
+static bench_config_t config;
+static int devnull = -1;
+
+// seconds since an arbitrary point.
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// xorshift64*, plenty for picking keys.
+static uint64_t rng_next(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 2685821657736338717ULL;
+}
+
+/*a helper parsing a list of numbers separated by commas.
+ *
+ * @return the number of entries, or 0 if it isn't such a list.
+ */
+static int parse_list(const char *str, long *list) {
+    int n = 0;
+    char *end = (char *)str;
+    while (*end != '\0') {
+        char *next;
+        long v = strtol(end, &next, 10);
+        if (n == BENCH_MAX_LIST || next == end || v < 1 ||
+            (*next != ',' && *next != '\0')) {
+            return 0;
+        }
+        list[n++] = v;
+        end = *next == ',' ? next + 1 : next;
+    }
+    return n;
+}
+
+/*a helper parsing a list of key lengths separated by commas, each either a
+ *length or a range of them, as in 32,64-512.
+ *
+ * @return the number of entries, or 0 if it isn't such a list.
+ */
+static int parse_keys(const char *str, key_range_t *keys) {
+    int n = 0;
+    char *end = (char *)str;
+    size_t prefix = strlen(BENCH_KEY_PREFIX);
+    while (*end != '\0') {
+        char *next;
+        long min = strtol(end, &next, 10);
+        long max = min;
+        if (next != end && *next == '-') {
+            end = next + 1;
+            max = strtol(end, &next, 10);
+        }
+        if (n == BENCH_MAX_LIST || next == end || min <= (long)prefix + 16 ||
+            max < min || (*next != ',' && *next != '\0')) {
+            return 0;
+        }
+        keys[n].min = (size_t)min;
+        keys[n].max = (size_t)max;
+        n++;
+        end = *next == ',' ? next + 1 : next;
+    }
+    return n;
+}
+
+/*a helper making the keys and response of a run, ahead of timing it. Keys
+ *start with a unique number so no two are the same whatever their length.
+ *
+ * @return false if there is no memory for them.
+ */
+static bool run_setup(bench_run_t *run) {
+    uint64_t rng = 0x2545f4914f6cdd1dULL;
+    run->keyv = (cache_key_t *)malloc(2 * (size_t)run->count *
+                                      sizeof(cache_key_t));
+    if (run->keyv == NULL) {
+        return false;
+    }
+    for (long i = 0; i < 2 * run->count; i++) {
+        size_t span = run->key.max - run->key.min + 1;
+        size_t len = run->key.min + (size_t)(rng_next(&rng) % span);
+        char *key = (char *)malloc(len + 1);
+        if (key == NULL) {
+            return false;
+        }
+        int n = snprintf(key, len + 1, "%s%015ld/", BENCH_KEY_PREFIX, i);
+        for (size_t j = (size_t)n; j < len; j++) {
+            key[j] = (char)('a' + rng_next(&rng) % 26);
+        }
+        key[len] = '\0';
+        cache_key_init(&run->keyv[i], key);
+    }
+    char hdr[128];
+    int hdrLen = snprintf(hdr, sizeof(hdr),
+                          "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\n\r\n",
+                          config.bodySize);
+    run->hdrSize = (size_t)hdrLen;
+    run->respSize = (size_t)hdrLen + config.bodySize;
+    if ((run->response = (char *)malloc(run->respSize)) == NULL) {
+        return false;
+    }
+    memcpy(run->response, hdr, (size_t)hdrLen);
+    memset(run->response + hdrLen, 'x', config.bodySize);
+    run->zipfCdf = NULL;
+    if (config.zipf > 0) {
+        run->zipfCdf = (double *)malloc((size_t)run->count * sizeof(double));
+        if (run->zipfCdf == NULL) {
+            return false;
+        }
+        double sum = 0;
+        for (long i = 0; i < run->count; i++) {
+            sum += 1.0 / pow((double)(i + 1), config.zipf);
+            run->zipfCdf[i] = sum;
+        }
+        for (long i = 0; i < run->count; i++) {
+            run->zipfCdf[i] /= sum;
+        }
+    }
+    return true;
+}
+
+// picking one of the objects inserted first, for a lookup.
+static long pick_key(worker_t *w) {
+    bench_run_t *run = w->run;
+    if (run->zipfCdf == NULL) {
+        return (long)(rng_next(&w->rng) % (uint64_t)run->count);
+    }
+    double u = (double)(rng_next(&w->rng) >> 11) / 9007199254740992.0;
+    long lo = 0;
+    long hi = run->count - 1;
+    while (lo < hi) {
+        long mid = lo + (hi - lo) / 2;
+        if (run->zipfCdf[mid] < u) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// adding the thread's share of the keys from first up to first + count.
+static void insert_keys(worker_t *w, long first) {
+    bench_run_t *run = w->run;
+    cache_freshness_t fresh = {time(NULL) + 3600, 0, false};
+    for (long i = w->id; i < run->count; i += run->threads) {
+        if (add_to_cache(&run->keyv[first + i], run->response,
+                         run->respSize, run->hdrSize, &fresh)) {
+            w->failed++;
+        }
+    }
+}
+
+static void *insert_routine(void *arg) {
+    worker_t *w = (worker_t *)arg;
+    pthread_barrier_wait(&w->run->start);
+    w->start = now_sec();
+    insert_keys(w, 0);
+    w->end = now_sec();
+    return NULL;
+}
+
+static void *evict_routine(void *arg) {
+    worker_t *w = (worker_t *)arg;
+    pthread_barrier_wait(&w->run->start);
+    w->start = now_sec();
+    insert_keys(w, w->run->count);
+    w->end = now_sec();
+    return NULL;
+}
+
+// looking keys up, and writing hits out as serving them would.
+static void *lookup_routine(void *arg) {
+    worker_t *w = (worker_t *)arg;
+    bench_run_t *run = w->run;
+    long n = config.lookups / run->threads;
+    pthread_barrier_wait(&run->start);
+    w->start = now_sec();
+    for (long i = 0; i < n; i++) {
+        web_object_t *obj = serve_cache(&run->keyv[pick_key(w)]);
+        if (obj == NULL) {
+            continue;
+        }
+        w->hits++;
+        if (obj->bodyFd >= 0) {
+            off_t off = 0;
+            if (write(devnull, obj->object, obj->hdrSize) < 0 ||
+                sendfile(devnull, obj->bodyFd, &off,
+                         obj->objSize - obj->hdrSize) < 0) {
+                perror("sendfile");
+            }
+        } else if (write(devnull, obj->object, obj->objSize) < 0) {
+            perror("write");
+        }
+        release_cache_obj(obj);
+    }
+    w->end = now_sec();
+    return NULL;
+}
+
+/*a helper running one phase on every thread of the run.
+ *
+ * @return the seconds it took, from when the first thread started on it to
+ * when the last one was done.
+ */
+static double run_phase(bench_run_t *run, worker_t *workers,
+                        void *(*routine)(void *)) {
+    pthread_t *tids = (pthread_t *)malloc((size_t)run->threads *
+                                          sizeof(pthread_t));
+    if (tids == NULL) {
+        fprintf(stderr, "unable to start threads\n");
+        exit(1);
+    }
+    pthread_barrier_init(&run->start, NULL, (unsigned)run->threads + 1);
+    for (int i = 0; i < run->threads; i++) {
+        if (pthread_create(&tids[i], NULL, routine, &workers[i]) != 0) {
+            fprintf(stderr, "unable to start threads\n");
+            exit(1);
+        }
+    }
+    pthread_barrier_wait(&run->start);
+    double start = 0;
+    double end = 0;
+    for (int i = 0; i < run->threads; i++) {
+        pthread_join(tids[i], NULL);
+        if (i == 0 || workers[i].start < start) {
+            start = workers[i].start;
+        }
+        if (workers[i].end > end) {
+            end = workers[i].end;
+        }
+    }
+    double sec = end - start;
+    pthread_barrier_destroy(&run->start);
+    free(tids);
+    return sec;
+}
+
+/*a helper sizing the cache to hold all of the objects inserted first, with
+ *some room for what the slab rounds their chunks up by.
+ */
+static size_t run_capacity(bench_run_t *run) {
+    size_t perObject = sizeof(web_object_t) + run->key.max + 1 +
+                       run->respSize + 16;
+    size_t capacity = (size_t)run->count * perObject / 4 * 5;
+    int shards = config.shards == 0 ? CACHE_SHARDS : config.shards;
+    // every shard must be able to hold an object, with the same room.
+    if (capacity / (size_t)shards < perObject * 2) {
+        capacity = (size_t)shards * perObject * 2;
+    }
+    return capacity;
+}
+
+// the cost of an operation to a thread in nanoseconds, and the throughput.
+static void print_cost(double sec, long ops, int threads) {
+    printf(" %9.0f %8.2f", ops > 0 ? sec * 1e9 * threads / (double)ops : 0.0,
+           ops / sec / 1e6);
+}
+
+// measuring one combination, in a process of its own.
+static void run_one(long count, int threads, key_range_t key) {
+    bench_run_t run;
+    run.count = count;
+    run.threads = threads;
+    run.key = key;
+    if (!run_setup(&run)) {
+        fprintf(stderr, "unable to set up %ld objects\n", count);
+        exit(1);
+    }
+    size_t capacity = run_capacity(&run);
+    init_web_cache(capacity, run.respSize, config.shards, config.policy);
+    if (web_cache == NULL) {
+        exit(1);
+    }
+    web_cache->useMemfd = config.useMemfd;
+    init_cache_lock();
+
+    worker_t *workers = (worker_t *)calloc((size_t)threads, sizeof(worker_t));
+    if (workers == NULL) {
+        fprintf(stderr, "unable to start threads\n");
+        exit(1);
+    }
+    for (int i = 0; i < threads; i++) {
+        workers[i].run = &run;
+        workers[i].id = i;
+        workers[i].rng = 0x853c49e6748fea9bULL ^ ((uint64_t)i + 1) *
+                                                     0x9e3779b97f4a7c15ULL;
+    }
+    double insertSec = run_phase(&run, workers, insert_routine);
+    double lookupSec = run_phase(&run, workers, lookup_routine);
+    double evictSec = run_phase(&run, workers, evict_routine);
+    long hits = 0;
+    long failed = 0;
+    for (int i = 0; i < threads; i++) {
+        hits += workers[i].hits;
+        failed += workers[i].failed;
+    }
+    long lookups = config.lookups / threads * threads;
+
+    printf("%9ld %7d %4zu-%-4zu", count, threads, key.min, key.max);
+    print_cost(insertSec, count, threads);
+    print_cost(lookupSec, lookups, threads);
+    print_cost(evictSec, count, threads);
+    printf(" %6.1f%% %8ld\n", lookups > 0 ? 100.0 * hits / lookups : 0.0,
+           failed);
+    fflush(stdout);
+    free(workers);
+    exit(0);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-n counts] [-t threads] [-k lengths] [-b bytes] "
+            "[-l lookups] [-a zipf] [-s shards] [-p policy] [-z]\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    config.ncounts = parse_list("1000,10000,100000", config.counts);
+    config.nthreads = parse_list("1,2,4,8", config.threads);
+    config.nkeys = parse_keys("48,64-512", config.keys);
+    config.bodySize = 512;
+    config.lookups = 2000000;
+    config.zipf = 0;
+    config.shards = 0;
+    config.policy = NULL;
+    config.useMemfd = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:t:k:b:l:a:s:p:z")) != -1) {
+        switch (opt) {
+        case 'n': // object counts
+            config.ncounts = parse_list(optarg, config.counts);
+            break;
+        case 't': // thread counts
+            config.nthreads = parse_list(optarg, config.threads);
+            break;
+        case 'k': // key lengths
+            config.nkeys = parse_keys(optarg, config.keys);
+            break;
+        case 'b': // body bytes per object
+            config.bodySize = (size_t)atol(optarg);
+            break;
+        case 'l': // lookups per run
+            config.lookups = atol(optarg);
+            break;
+        case 'a': // Zipf exponent of lookups
+            config.zipf = atof(optarg);
+            break;
+        case 's': // cache shards
+            config.shards = atoi(optarg);
+            break;
+        case 'p': // cache policy
+            config.policy = optarg;
+            break;
+        case 'z': // objects in memfds
+            config.useMemfd = true;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc || config.ncounts == 0 || config.nthreads == 0 ||
+        config.nkeys == 0 || config.lookups < 1 || config.zipf < 0) {
+        usage(argv[0]);
+    }
+    if ((devnull = open("/dev/null", O_WRONLY)) < 0) {
+        perror("/dev/null");
+        return 1;
+    }
+
+    printf("policy %s, %d shard(s)%s, %zu byte bodies, %s lookups, costs "
+           "in ns a thread spends per operation\n",
+           config.policy == NULL ? "default" : config.policy, config.shards,
+           config.shards == 0 ? " (picked by the cache)" : "", config.bodySize,
+           config.zipf > 0 ? "zipf" : "uniform");
+    printf("%9s %7s %9s %9s %8s %9s %8s %9s %8s %7s %8s\n", "objects",
+           "threads", "key", "insert", "Mops/s", "lookup", "Mops/s", "evict",
+           "Mops/s", "hits", "refused");
+    for (int c = 0; c < config.ncounts; c++) {
+        for (int k = 0; k < config.nkeys; k++) {
+            for (int t = 0; t < config.nthreads; t++) {
+                fflush(stdout);
+                pid_t pid = fork();
+                if (pid < 0) {
+                    perror("fork");
+                    return 1;
+                }
+                if (pid == 0) {
+                    run_one(config.counts[c], (int)config.threads[t],
+                            config.keys[k]);
+                }
+                int status;
+                while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+                }
+                if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                    fprintf(stderr, "run of %ld objects on %ld threads "
+                                    "failed\n",
+                            config.counts[c], config.threads[t]);
+                }
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,153 @@
+/*
+ * @file: compress.c
+ * @brief: the background compression of cached responses, following the
+ * signature in compress.h. The queue is a ring under a mutex, as the disk
+ * tier's is, and a response is only ever in it once, as hits move its
+ * variant state from CACHE_VARIANT_UNKNOWN to CACHE_VARIANT_QUEUED before
+ * queuing it.
+ *
+ * @Author Sanah Imani <simani@unix.andrew.cmu.edu>
+ */
+
+#include <compress.h>
+
+#include <cache.h>
+#include <http_response.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+static int compress_level = Z_DEFAULT_COMPRESSION;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queued = PTHREAD_COND_INITIALIZER;
+static web_object_t *queue[COMPRESS_QUEUE]; // responses to compress
+static size_t queue_start;                  // the first response in queue
+static size_t queue_len;                    // number of responses in queue
+
+/*a helper gzipping a body into out, which has room for deflateBound() bytes.
+ *
+ * @return the length of the compressed body, 0 on error.
+ */
+static size_t gzip_body(const char *body, size_t len, char *out,
+                        size_t outSize) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    // 16 more window bits ask zlib for a gzip header and trailer.
+    if (deflateInit2(&zs, compress_level, Z_DEFLATED, 15 + 16, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        return 0;
+    }
+    zs.next_in = (Bytef *)body;
+    zs.avail_in = (uInt)len;
+    zs.next_out = (Bytef *)out;
+    zs.avail_out = (uInt)outSize;
+    int rc = deflate(&zs, Z_FINISH);
+    size_t outLen = (size_t)zs.total_out;
+    deflateEnd(&zs);
+    return rc == Z_STREAM_END ? outLen : 0;
+}
+
+/*a helper making the variant of a response and caching it. The variant's
+ *header block is written ahead of room for it, and the compressed body
+ *moved down to meet it once its length is known.
+ *
+ * @return the state of the response's variant from now on.
+ */
+static int compress_object(web_object_t *obj) {
+    const char *body = obj->object + obj->hdrSize;
+    size_t bodyLen = obj->objSize - obj->hdrSize;
+    // zlib counts in unsigned ints.
+    if (bodyLen > UINT_MAX / 2) {
+        return CACHE_VARIANT_NONE;
+    }
+    size_t bound = (size_t)compressBound((uLong)bodyLen) + 18; // gzip framing
+    char *buf = (char *)malloc(RESP_HDRBUF + bound);
+    if (buf == NULL) {
+        return CACHE_VARIANT_UNKNOWN;
+    }
+    size_t gzLen = gzip_body(body, bodyLen, buf + RESP_HDRBUF, bound);
+    size_t hdrLen = 0;
+    if (gzLen > 0 && gzLen <= bodyLen / 100 * (100 - COMPRESS_MIN_SAVING)) {
+        hdrLen = response_encoded_header(obj->object, obj->hdrSize,
+                                         CACHE_VARIANT_CODING, gzLen, buf,
+                                         RESP_HDRBUF);
+    }
+    if (hdrLen == 0) {
+        free(buf);
+        return CACHE_VARIANT_NONE;
+    }
+    memmove(buf + hdrLen, buf + RESP_HDRBUF, gzLen);
+    if (add_variant_to_cache(obj, buf, hdrLen + gzLen, hdrLen)) {
+        fprintf(stderr, "Could not cache compressed variant of %s\n",
+                obj->urlKey);
+    }
+    free(buf);
+    return CACHE_VARIANT_UNKNOWN;
+}
+
+/*
+ * compress_routine - the compressing thread, making the variants of the
+ * queued responses one at a time and dropping the reference compress_offer()
+ * took for each.
+ */
+static void *compress_routine(void *args) {
+    (void)args;
+    while (true) {
+        pthread_mutex_lock(&queue_lock);
+        while (queue_len == 0) {
+            pthread_cond_wait(&queued, &queue_lock);
+        }
+        web_object_t *obj = queue[queue_start];
+        queue_start = (queue_start + 1) % COMPRESS_QUEUE;
+        queue_len--;
+        pthread_mutex_unlock(&queue_lock);
+
+        atomic_store_explicit(&obj->variant, compress_object(obj),
+                              memory_order_relaxed);
+        release_cache_obj(obj);
+    }
+    return NULL;
+}
+
+bool compress_init(int level) {
+    compress_level = level;
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, compress_routine, NULL) != 0) {
+        return false;
+    }
+    pthread_detach(tid);
+    return true;
+}
+
+void compress_offer(web_object_t *obj) {
+    int state = atomic_load_explicit(&obj->variant, memory_order_relaxed);
+    if (state != CACHE_VARIANT_UNKNOWN) {
+        return;
+    }
+    if (obj->objSize - obj->hdrSize < COMPRESS_MIN_SIZE ||
+        !response_compressible(obj->object, obj->hdrSize)) {
+        atomic_store_explicit(&obj->variant, CACHE_VARIANT_NONE,
+                              memory_order_relaxed);
+        return;
+    }
+    // only the hit that moves the state on queues the response.
+    if (!atomic_compare_exchange_strong(&obj->variant, &state,
+                                        CACHE_VARIANT_QUEUED)) {
+        return;
+    }
+    pthread_mutex_lock(&queue_lock);
+    // the thread can't keep up, so the response waits for another hit.
+    if (queue_len == COMPRESS_QUEUE) {
+        pthread_mutex_unlock(&queue_lock);
+        atomic_store_explicit(&obj->variant, CACHE_VARIANT_UNKNOWN,
+                              memory_order_relaxed);
+        return;
+    }
+    queue[(queue_start + queue_len) % COMPRESS_QUEUE] = retain_cache_obj(obj);
+    queue_len++;
+    pthread_cond_signal(&queued);
+    pthread_mutex_unlock(&queue_lock);
+}
@@ -0,0 +1,46 @@
+/*
+ * @file: compress.h
+ * @brief: optional, transparent gzip compression of cached responses. A hit
+ * from a client accepting gzip on a response worth compressing that has no
+ * compressed variant in the cache yet queues the response for a background
+ * thread, which compresses its body once and caches the result as the
+ * response's variant (see serve_cache_variant()). Later clients accepting
+ * gzip are served the variant, so compression costs the workers nothing and
+ * happens once per response rather than once per hit.
+ *
+ * Responses for which compression saves too little are marked so, and never
+ * queued again. Responses finding the queue full are left for a later hit.
+ *
+ * @Author Sanah Imani <simani@unix.andrew.cmu.edu>
+ */
+
+#ifndef __COMPRESS_H__
+#define __COMPRESS_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define COMPRESS_QUEUE 256    // responses waiting to be compressed
+#define COMPRESS_MIN_SIZE 256 // shortest body worth compressing
+#define COMPRESS_MIN_SAVING 10 // percent of the body a variant has to save
+
+struct web_object_t;
+
+/* starting the thread compressing queued responses.
+ *
+ * @params[in] level the zlib compression level, from 1 (fastest) to 9
+ *
+ * @return false if the thread can't be started.
+ */
+bool compress_init(int level);
+
+/* offering a cached response without a variant for compression, after a hit
+ * from a client accepting gzip. Whether it is worth compressing is only
+ * worked out once per response, and the thread takes a reference to the
+ * responses it queues until done with them.
+ *
+ * @params[in] obj the response, with a reference held
+ */
+void compress_offer(struct web_object_t *obj);
+
+#endif /* __COMPRESS_H__ */
@@ -566,6 +566,41 @@ ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) {
     return (ssize_t)(n - 1);
 }
 
+/*
+ * rio_fillb - Append whatever bytes are currently available on the
+ *    descriptor to the internal buffer, without blocking on a non-blocking
+ *    descriptor. Unread bytes are first moved to the front of the buffer so
+ *    that a later rio_readlineb() can consume them without touching the fd.
+ *
+ *    Returns the number of bytes appended, 0 on EOF, and -1 with errno set
+ *    on error (EAGAIN when nothing is available, ENOBUFS when full).
+ */
+ssize_t rio_fillb(rio_t *rp) {
+    ssize_t nread;
+
+    if (rp->rio_cnt > 0 && rp->rio_bufptr != rp->rio_buf) {
+        memmove(rp->rio_buf, rp->rio_bufptr, (size_t)rp->rio_cnt);
+    }
+    rp->rio_bufptr = rp->rio_buf;
+    if (rp->rio_cnt < 0) {
+        rp->rio_cnt = 0;
+    }
+    if ((size_t)rp->rio_cnt == sizeof(rp->rio_buf)) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    do {
+        nread = read(rp->rio_fd, rp->rio_buf + rp->rio_cnt,
+                     sizeof(rp->rio_buf) - (size_t)rp->rio_cnt);
+    } while (nread < 0 && errno == EINTR);
+
+    if (nread > 0) {
+        rp->rio_cnt += nread;
+    }
+    return nread;
+}
+
 /********************************
  * Client/server helper functions
  ********************************/
@@ -0,0 +1,496 @@
+/*
+ * @file: disk.c
+ * @brief: the disk tier of the web cache, following the signature in disk.h.
+ * The log is a file of capacity bytes written from the start to the end and
+ * then from the start again. Every record is a disk_record_t followed by the
+ * key and the response, and records are numbered in the order written, so the
+ * valid records at startup are those from the start of the file for as long
+ * as the numbers keep going up.
+ *
+ * The index is a hash table on the key hash over entries that are also kept
+ * in log order, oldest first, which is the order in which they get
+ * overwritten. A single mutex protects both, and is never held across I/O.
+ *
+ * @Author Sanah Imani <simani@unix.andrew.cmu.edu>
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // preadv(), pwritev()
+#endif
+
+#include <disk.h>
+
+#include <cache.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define DISK_MAGIC 0x50525833u // "PRX3", the start of every record
+#define DISK_VALIDATABLE 1u     // in flags, the object can be revalidated
+#define DISK_MIN_BUCKETS 1024
+#define DISK_MAX_BUCKETS (1 << 22)
+
+/* The header of a record in the log. */
+typedef struct disk_record {
+    uint32_t magic;    // DISK_MAGIC
+    uint32_t keyLen;   // the length of the key following the header
+    uint64_t seq;      // the number of the record, one more than the last
+    uint64_t keyHash;  // the hash of the key, as in web_object_t
+    uint64_t objSize;  // the length of the response following the key
+    uint64_t hdrSize;  // the length of its header block
+    uint64_t bodyHash; // the checksum of the key and the response
+    int64_t expires;   // when the object goes stale
+    int64_t staleWhile; // for how long it may be served stale after that
+    uint64_t flags;    // DISK_VALIDATABLE, or 0
+    uint64_t check;    // the checksum of the fields above
+} disk_record_t;
+
+/* An object in the log. */
+typedef struct disk_entry {
+    char *key;                 // the cache key
+    size_t keyLen;             // strlen(key)
+    uint64_t keyHash;          // the hash of key
+    disk_ref_t ref;            // where its record is
+    bool ready;                // whether the record has been written in full
+    bool forgotten;            // dropped by disk_forget() while being written
+    struct disk_entry *hnext;  // next entry in the same hash bucket
+    struct disk_entry *older;  // the entry of the record written before
+    struct disk_entry *newer;  // the entry of the record written after
+} disk_entry_t;
+
+struct disk_tier {
+    int fd;                       // the log file
+    size_t capacity;              // the size of the log file
+    pthread_mutex_t lock;         // protects everything below
+    pthread_cond_t queued;        // signalled when an object is queued
+    disk_entry_t **buckets;       // the index, on the key hash
+    size_t nbuckets;              // number of buckets, a power of 2
+    disk_entry_t *oldest;         // the entry overwritten next
+    disk_entry_t *newest;         // the entry written last
+    uint64_t head;                // where the next record goes
+    uint64_t seq;                 // the number of the last record
+    struct web_object_t *queue[DISK_QUEUE]; // objects waiting to be written
+    bool queueForgotten[DISK_QUEUE]; // by slot of queue, dropped by
+                                     // disk_forget() while waiting
+    size_t queueStart;               // the first object in queue
+    size_t queueLen;                 // number of objects in queue
+    struct web_object_t *writing;    // the object being written, if any
+    bool writingForgotten;           // dropped by disk_forget() before its
+                                     // entry was linked in
+};
+
+// FNV-1a, as for cache keys, carried on from hash over len more bytes.
+static uint64_t fnv_update(uint64_t hash, const void *buf, size_t len) {
+    const unsigned char *p = (const unsigned char *)buf;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ p[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+#define FNV_BASIS 14695981039346656037ULL
+
+static uint64_t record_check(const disk_record_t *rec) {
+    return fnv_update(FNV_BASIS, rec, offsetof(disk_record_t, check));
+}
+
+static size_t record_len(size_t keyLen, size_t objSize) {
+    return sizeof(disk_record_t) + keyLen + objSize;
+}
+
+static disk_entry_t **bucket_of(disk_tier_t *disk, uint64_t keyHash) {
+    return &disk->buckets[keyHash & (disk->nbuckets - 1)];
+}
+
+/*a helper finding the entry of a key, ready or not. The caller holds the
+ *lock.*/
+static disk_entry_t *entry_find(disk_tier_t *disk, const char *key,
+                                size_t keyLen, uint64_t keyHash) {
+    disk_entry_t *e = *bucket_of(disk, keyHash);
+    for (; e != NULL; e = e->hnext) {
+        if (e->keyHash == keyHash && e->keyLen == keyLen &&
+            memcmp(e->key, key, keyLen) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+// whether an object is of a key.
+static bool object_is(const web_object_t *obj, const char *key, size_t keyLen,
+                      uint64_t keyHash) {
+    return obj->keyHash == keyHash && obj->keyLen == keyLen &&
+           memcmp(obj->urlKey, key, keyLen) == 0;
+}
+
+/*a helper allocating an entry, with its key in the same block, before it is
+ *linked in with entry_link().*/
+static disk_entry_t *entry_new(const char *key, size_t keyLen,
+                               uint64_t keyHash, const disk_ref_t *ref) {
+    disk_entry_t *e = (disk_entry_t *)malloc(sizeof(disk_entry_t) + keyLen);
+    if (e == NULL) {
+        return NULL;
+    }
+    e->key = (char *)(e + 1);
+    memcpy(e->key, key, keyLen);
+    e->keyLen = keyLen;
+    e->keyHash = keyHash;
+    e->ref = *ref;
+    e->ready = false;
+    e->forgotten = false;
+    return e;
+}
+
+/*a helper linking an entry in as the newest. The caller holds the lock.*/
+static void entry_link(disk_tier_t *disk, disk_entry_t *e) {
+    disk_entry_t **bucket = bucket_of(disk, e->keyHash);
+    e->hnext = *bucket;
+    *bucket = e;
+    e->older = disk->newest;
+    e->newer = NULL;
+    if (disk->newest != NULL) {
+        disk->newest->newer = e;
+    } else {
+        disk->oldest = e;
+    }
+    disk->newest = e;
+}
+
+/*a helper dropping an entry from the index and freeing it. The caller holds
+ *the lock.*/
+static void entry_remove(disk_tier_t *disk, disk_entry_t *e) {
+    disk_entry_t **link = bucket_of(disk, e->keyHash);
+    while (*link != e) {
+        link = &(*link)->hnext;
+    }
+    *link = e->hnext;
+    if (e->older != NULL) {
+        e->older->newer = e->newer;
+    } else {
+        disk->oldest = e->newer;
+    }
+    if (e->newer != NULL) {
+        e->newer->older = e->older;
+    } else {
+        disk->newest = e->older;
+    }
+    free(e);
+}
+
+/*a helper picking where a record of len bytes goes and dropping the entries
+ *of the records it overwrites, which are always the oldest ones. Once the
+ *record doesn't fit before the end of the file, the (older still) records
+ *between the head and the end are dropped and the log starts over at the
+ *beginning. The caller holds the lock.
+ *
+ * @return the offset of the record
+ */
+static uint64_t log_reserve(disk_tier_t *disk, size_t len) {
+    uint64_t pos = disk->head;
+    if (pos + len > disk->capacity) {
+        while (disk->oldest != NULL && disk->oldest->ref.offset >= pos) {
+            entry_remove(disk, disk->oldest);
+        }
+        pos = 0;
+    }
+    while (disk->oldest != NULL) {
+        disk_entry_t *e = disk->oldest;
+        uint64_t end = e->ref.offset + record_len(e->keyLen, e->ref.objSize);
+        if (e->ref.offset >= pos + len || end <= pos) {
+            break;
+        }
+        entry_remove(disk, e);
+    }
+    disk->head = pos + len;
+    return pos;
+}
+
+/*a helper appending an object evicted from memory to the log, on the writer
+ *thread. The response is written ahead of the header, so a record whose
+ *header made it to the file is usually whole; the checksum tells otherwise.
+ */
+static void disk_write(disk_tier_t *disk, web_object_t *obj) {
+    size_t len = record_len(obj->keyLen, obj->objSize);
+    if (len > disk->capacity) {
+        return;
+    }
+    uint64_t bodyHash = fnv_update(FNV_BASIS, obj->urlKey, obj->keyLen);
+    bodyHash = fnv_update(bodyHash, obj->object, obj->objSize);
+    int64_t expires = (int64_t)atomic_load_explicit(&obj->expires,
+                                                    memory_order_relaxed);
+    disk_ref_t ref = {0,       obj->objSize,    obj->hdrSize,    bodyHash,
+                      expires, obj->staleWhile, obj->validatable};
+    disk_entry_t *e = entry_new(obj->urlKey, obj->keyLen, obj->keyHash, &ref);
+    if (e == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&disk->lock);
+    if (disk->writingForgotten) {
+        // invalidated after it was evicted from memory.
+        pthread_mutex_unlock(&disk->lock);
+        free(e);
+        return;
+    }
+    disk_entry_t *old =
+        entry_find(disk, obj->urlKey, obj->keyLen, obj->keyHash);
+    if (old != NULL && old->ready && old->ref.bodyHash == bodyHash &&
+        old->ref.objSize == obj->objSize && old->ref.expires == expires) {
+        // read back from the log earlier and evicted again unchanged, and
+        // not revalidated since either.
+        pthread_mutex_unlock(&disk->lock);
+        free(e);
+        return;
+    }
+    if (old != NULL) {
+        entry_remove(disk, old);
+    }
+    e->ref.offset = log_reserve(disk, len);
+    entry_link(disk, e);
+    disk_record_t rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.seq = ++disk->seq;
+    pthread_mutex_unlock(&disk->lock);
+
+    rec.magic = DISK_MAGIC;
+    rec.keyLen = (uint32_t)obj->keyLen;
+    rec.keyHash = obj->keyHash;
+    rec.objSize = obj->objSize;
+    rec.hdrSize = obj->hdrSize;
+    rec.bodyHash = bodyHash;
+    rec.expires = expires;
+    rec.staleWhile = obj->staleWhile;
+    rec.flags = obj->validatable ? DISK_VALIDATABLE : 0;
+    rec.check = record_check(&rec);
+    struct iovec iov[2] = {{obj->urlKey, obj->keyLen},
+                           {obj->object, obj->objSize}};
+    ssize_t n = pwritev(disk->fd, iov, 2,
+                        (off_t)(e->ref.offset + sizeof(disk_record_t)));
+    bool ok = n == (ssize_t)(obj->keyLen + obj->objSize) &&
+              pwrite(disk->fd, &rec, sizeof(rec), (off_t)e->ref.offset) ==
+                  (ssize_t)sizeof(rec);
+    if (!ok) {
+        perror("write disk cache");
+    }
+
+    // only this thread drops entries that aren't ready, so e is still in.
+    pthread_mutex_lock(&disk->lock);
+    if (ok && !e->forgotten) {
+        e->ready = true;
+    } else {
+        entry_remove(disk, e);
+    }
+    pthread_mutex_unlock(&disk->lock);
+}
+
+/*
+ * disk_routine - the writer thread, writing out the queued objects one at a
+ * time and dropping the reference disk_spill() took for each.
+ */
+static void *disk_routine(void *args) {
+    disk_tier_t *disk = (disk_tier_t *)args;
+    while (true) {
+        pthread_mutex_lock(&disk->lock);
+        while (disk->queueLen == 0) {
+            pthread_cond_wait(&disk->queued, &disk->lock);
+        }
+        web_object_t *obj = disk->queue[disk->queueStart];
+        disk->writing = obj;
+        disk->writingForgotten = disk->queueForgotten[disk->queueStart];
+        disk->queueStart = (disk->queueStart + 1) % DISK_QUEUE;
+        disk->queueLen--;
+        pthread_mutex_unlock(&disk->lock);
+
+        disk_write(disk, obj);
+        pthread_mutex_lock(&disk->lock);
+        disk->writing = NULL;
+        pthread_mutex_unlock(&disk->lock);
+        release_cache_obj(obj);
+    }
+    return NULL;
+}
+
+/*a helper rebuilding the index from the records at the start of the log,
+ *reading only their headers and keys.*/
+static void log_scan(disk_tier_t *disk) {
+    uint64_t pos = 0;
+    disk_record_t rec;
+    char key[DISK_MAX_KEY];
+    size_t count = 0;
+    while (pos + sizeof(rec) <= disk->capacity &&
+           pread(disk->fd, &rec, sizeof(rec), (off_t)pos) ==
+               (ssize_t)sizeof(rec)) {
+        if (rec.magic != DISK_MAGIC || rec.check != record_check(&rec) ||
+            rec.seq <= disk->seq || rec.keyLen == 0 ||
+            rec.keyLen > DISK_MAX_KEY ||
+            rec.objSize > disk->capacity ||
+            pos + record_len(rec.keyLen, rec.objSize) > disk->capacity) {
+            break; // the head of the log when it was last written
+        }
+        if (pread(disk->fd, key, rec.keyLen, (off_t)(pos + sizeof(rec))) !=
+            (ssize_t)rec.keyLen) {
+            break;
+        }
+        disk_ref_t ref = {pos,
+                          rec.objSize,
+                          rec.hdrSize,
+                          rec.bodyHash,
+                          rec.expires,
+                          rec.staleWhile,
+                          (rec.flags & DISK_VALIDATABLE) != 0};
+        disk_entry_t *e = entry_new(key, rec.keyLen, rec.keyHash, &ref);
+        if (e == NULL) {
+            break;
+        }
+        disk_entry_t *old = entry_find(disk, key, rec.keyLen, rec.keyHash);
+        if (old != NULL) {
+            entry_remove(disk, old); // a later version of the same key
+        } else {
+            count++;
+        }
+        e->ready = true;
+        entry_link(disk, e);
+        disk->seq = rec.seq;
+        pos += record_len(rec.keyLen, rec.objSize);
+    }
+    disk->head = pos;
+    fprintf(stderr, "disk cache: %zu objects in %llu bytes\n", count,
+            (unsigned long long)pos);
+}
+
+disk_tier_t *disk_open(const char *path, size_t capacity) {
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        perror(path);
+        return NULL;
+    }
+    // the file is sparse, so the blocks are only taken up as the log grows.
+    if (ftruncate(fd, (off_t)capacity) < 0) {
+        perror(path);
+        close(fd);
+        return NULL;
+    }
+    disk_tier_t *disk = (disk_tier_t *)calloc(1, sizeof(disk_tier_t));
+    size_t nbuckets = DISK_MIN_BUCKETS;
+    while (nbuckets < DISK_MAX_BUCKETS &&
+           nbuckets < capacity / DISK_BYTES_PER_BUCKET) {
+        nbuckets *= 2;
+    }
+    disk_entry_t **buckets =
+        (disk_entry_t **)calloc(nbuckets, sizeof(disk_entry_t *));
+    if (disk == NULL || buckets == NULL) {
+        fprintf(stderr, "unable to create disk cache\n");
+        free(disk);
+        free(buckets);
+        close(fd);
+        return NULL;
+    }
+    disk->fd = fd;
+    disk->capacity = capacity;
+    pthread_mutex_init(&disk->lock, NULL);
+    pthread_cond_init(&disk->queued, NULL);
+    disk->buckets = buckets;
+    disk->nbuckets = nbuckets;
+    log_scan(disk);
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, disk_routine, disk) != 0) {
+        fprintf(stderr, "unable to start disk cache writer\n");
+        while (disk->oldest != NULL) {
+            entry_remove(disk, disk->oldest);
+        }
+        pthread_mutex_destroy(&disk->lock);
+        pthread_cond_destroy(&disk->queued);
+        free(disk->buckets);
+        free(disk);
+        close(fd);
+        return NULL;
+    }
+    pthread_detach(tid);
+    return disk;
+}
+
+void disk_spill(disk_tier_t *disk, web_object_t *obj) {
+    if (obj->keyLen > DISK_MAX_KEY) {
+        return;
+    }
+    pthread_mutex_lock(&disk->lock);
+    // the writer can't keep up, so the object is just dropped as before.
+    if (disk->queueLen == DISK_QUEUE) {
+        pthread_mutex_unlock(&disk->lock);
+        return;
+    }
+    atomic_fetch_add_explicit(&obj->referenceCnt, 1, memory_order_relaxed);
+    size_t slot = (disk->queueStart + disk->queueLen) % DISK_QUEUE;
+    disk->queue[slot] = obj;
+    disk->queueForgotten[slot] = false;
+    disk->queueLen++;
+    pthread_cond_signal(&disk->queued);
+    pthread_mutex_unlock(&disk->lock);
+}
+
+bool disk_find(disk_tier_t *disk, const char *key, size_t keyLen,
+               uint64_t keyHash, disk_ref_t *ref) {
+    pthread_mutex_lock(&disk->lock);
+    disk_entry_t *e = entry_find(disk, key, keyLen, keyHash);
+    bool found = e != NULL && e->ready;
+    if (found) {
+        *ref = e->ref;
+    }
+    pthread_mutex_unlock(&disk->lock);
+    return found;
+}
+
+void disk_forget(disk_tier_t *disk, const char *key, size_t keyLen,
+                 uint64_t keyHash) {
+    pthread_mutex_lock(&disk->lock);
+    disk_entry_t *e = entry_find(disk, key, keyLen, keyHash);
+    // only the writer thread drops entries that aren't ready, once written.
+    if (e != NULL && e->ready) {
+        entry_remove(disk, e);
+    } else if (e != NULL) {
+        e->forgotten = true;
+    }
+    // objects evicted but not written yet have no entry to drop.
+    for (size_t i = 0; i < disk->queueLen; i++) {
+        size_t slot = (disk->queueStart + i) % DISK_QUEUE;
+        if (object_is(disk->queue[slot], key, keyLen, keyHash)) {
+            disk->queueForgotten[slot] = true;
+        }
+    }
+    if (disk->writing != NULL &&
+        object_is(disk->writing, key, keyLen, keyHash)) {
+        disk->writingForgotten = true;
+    }
+    pthread_mutex_unlock(&disk->lock);
+}
+
+bool disk_read(disk_tier_t *disk, const char *key, size_t keyLen,
+               uint64_t keyHash, const disk_ref_t *ref, char *dest) {
+    disk_record_t rec;
+    char recKey[DISK_MAX_KEY];
+    struct iovec iov[3] = {
+        {&rec, sizeof(rec)}, {recKey, keyLen}, {dest, ref->objSize}};
+    ssize_t n = preadv(disk->fd, iov, 3, (off_t)ref->offset);
+    // the record may have been overwritten since the lookup, or torn.
+    bool ok = n == (ssize_t)record_len(keyLen, ref->objSize) &&
+              rec.magic == DISK_MAGIC && rec.check == record_check(&rec) &&
+              rec.keyLen == keyLen && rec.objSize == ref->objSize &&
+              memcmp(recKey, key, keyLen) == 0 &&
+              fnv_update(fnv_update(FNV_BASIS, recKey, keyLen), dest,
+                         ref->objSize) == ref->bodyHash;
+    if (!ok) {
+        pthread_mutex_lock(&disk->lock);
+        disk_entry_t *e = entry_find(disk, key, keyLen, keyHash);
+        if (e != NULL && e->ready && e->ref.offset == ref->offset) {
+            entry_remove(disk, e);
+        }
+        pthread_mutex_unlock(&disk->lock);
+    }
+    return ok;
+}
@@ -0,0 +1,106 @@
+/*
+ * @file: disk.h
+ * @brief: an optional second tier of the web cache in a file on disk. Objects
+ * evicted from memory are handed to a writer thread, which appends them to
+ * the file as a circular log, overwriting the oldest objects once it is full.
+ * A miss in memory is looked up in the index of the log before going to the
+ * server, and an object found there is read back into memory.
+ *
+ * The index only lives in memory, but every record in the log carries its own
+ * key and sizes, so the index is rebuilt at startup by reading the record
+ * headers alone, and a restarted proxy serves what the previous one spilled.
+ * Records are checksummed, so one torn by a crash or overwritten while being
+ * read is treated as a miss rather than served. Records keep the freshness of
+ * their object, so an object read back goes stale when it would have in
+ * memory.
+ *
+ * @Author Sanah Imani <simani@unix.andrew.cmu.edu>
+ */
+
+#ifndef __DISK_H__
+#define __DISK_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define DISK_DEFAULT_SIZE (1024L * 1024 * 1024) // bytes in the log by default
+#define DISK_QUEUE 1024 // evicted objects waiting to be written, beyond which
+                        // evictions aren't spilled
+#define DISK_MAX_KEY 8192 // longest key spilled to disk
+#define DISK_BYTES_PER_BUCKET (16 * 1024) // bytes of log per index bucket
+
+struct web_object_t;
+typedef struct disk_tier disk_tier_t;
+
+/* Where an object is in the log, as found by disk_find(). */
+typedef struct disk_ref {
+    uint64_t offset;   // where its record starts
+    size_t objSize;    // the length of the response
+    size_t hdrSize;    // the length of its header block
+    uint64_t bodyHash; // the checksum of its key and response
+    int64_t expires;   // when it goes stale, as in web_object_t
+    int64_t staleWhile; // for how long it may be served stale after that
+    bool validatable;  // whether it can be revalidated once stale
+} disk_ref_t;
+
+/* opening (or creating) the log at path, rebuilding the index from the
+ * records already in it, and starting the writer thread.
+ *
+ * @params[in] path the log file
+ * @params[in] capacity the max size of the log in bytes
+ *
+ * @return the disk tier, or NULL if the file can't be used.
+ */
+disk_tier_t *disk_open(const char *path, size_t capacity);
+
+/* handing an object evicted from memory to the writer thread, which takes a
+ * reference to it until written. Objects already in the log as they are, and
+ * objects that don't fit, aren't written again.
+ *
+ * @params[in] disk the disk tier
+ * @params[in] obj the object
+ */
+void disk_spill(disk_tier_t *disk, struct web_object_t *obj);
+
+/* looking a key up in the index.
+ *
+ * @params[in] disk the disk tier
+ * @params[in] key the cache key
+ * @params[in] keyLen strlen(key)
+ * @params[in] keyHash the hash of key, as in web_object_t
+ * @params[out] ref where the object is, if found
+ *
+ * @return true if the object is in the log.
+ */
+bool disk_find(disk_tier_t *disk, const char *key, size_t keyLen,
+               uint64_t keyHash, disk_ref_t *ref);
+
+/* dropping a key from the index, so it is no longer found, even once an
+ * object of the key being written right now, or still queued, is.
+ *
+ * @params[in] disk the disk tier
+ * @params[in] key the cache key
+ * @params[in] keyLen strlen(key)
+ * @params[in] keyHash the hash of key
+ */
+void disk_forget(disk_tier_t *disk, const char *key, size_t keyLen,
+                 uint64_t keyHash);
+
+/* reading the response of an object found with disk_find(). This is a
+ * blocking read, usually from the page cache.
+ *
+ * @params[in] disk the disk tier
+ * @params[in] key the cache key
+ * @params[in] keyLen strlen(key)
+ * @params[in] keyHash the hash of key
+ * @params[in] ref where the object is
+ * @params[out] dest where the ref->objSize bytes of the response go
+ *
+ * @return false if the record could not be read or no longer holds the
+ * object, which is then dropped from the index.
+ */
+bool disk_read(disk_tier_t *disk, const char *key, size_t keyLen,
+               uint64_t keyHash, const disk_ref_t *ref, char *dest);
+
+#endif /* __DISK_H__ */
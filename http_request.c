@@ -0,0 +1,391 @@
+/*
+ * @file: http_request.c
+ * @brief: the incremental HTTP request parser, following the signature in
+ * http_request.h. Each call parses the complete lines it hasn't seen yet and
+ * records where their parts are, leaving a line without its line ending for
+ * the next call, once more of it has arrived.
+ *
+ * @Author Sanah Imani <simani@unix.andrew.cmu.edu>
+ */
+
+#include <http_request.h>
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+/* The names of the known headers, by req_hdr. */
+static const char *const known_names[REQ_HDR_KNOWN] = {
+    "Host",          "Connection",        "Proxy-Connection",
+    "Keep-Alive",    "User-Agent",        "Expect",
+    "Range",         "If-Range",          "If-None-Match",
+    "If-Modified-Since", "Transfer-Encoding", "Content-Length",
+    "Accept-Encoding", "Authorization", "Cookie"};
+
+static uint32_t known_hashes[REQ_HDR_KNOWN]; // of known_names, case folded
+static size_t known_lens[REQ_HDR_KNOWN];     // of known_names
+static pthread_once_t known_once = PTHREAD_ONCE_INIT;
+
+// hashing a header name, case folded (FNV-1a).
+static uint32_t name_hash(const char *name, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (uint32_t)tolower((unsigned char)name[i]);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void known_init(void) {
+    for (int k = 0; k < REQ_HDR_KNOWN; k++) {
+        known_lens[k] = strlen(known_names[k]);
+        known_hashes[k] = name_hash(known_names[k], known_lens[k]);
+    }
+}
+
+void request_init(http_request_t *r) {
+    pthread_once(&known_once, known_init);
+    r->state = REQ_LINE;
+    r->scanned = 0;
+    r->len = 0;
+    r->base = NULL;
+    r->nheaders = 0;
+    memset(r->known, 0, sizeof(r->known));
+}
+
+// whether a byte may be part of a method or header name (RFC 9110 tchar).
+static bool is_tchar(unsigned char ch) {
+    return isalnum(ch) || (ch != '\0' && strchr("!#$%&'*+-.^_`|~", ch));
+}
+
+/*a helper reading the authority of an absolute http URI into the host and
+ *port of the request, where auth is the start of the authority and end the
+ *end of the URI.
+ *
+ * @return the end of the authority, or NULL if it is invalid.
+ */
+static const char *parse_authority(http_request_t *r, const char *auth,
+                                   const char *end) {
+    const char *stop = auth;
+    while (stop < end && *stop != '/' && *stop != '?') {
+        stop++;
+    }
+    // a literal IPv6 address is bracketed, as it has colons of its own, and
+    // the host is the address alone.
+    const char *host = auth;
+    const char *hostEnd = auth;
+    if (auth < stop && *auth == '[') {
+        host = auth + 1;
+        if ((hostEnd = memchr(host, ']', (size_t)(stop - host))) == NULL) {
+            return NULL;
+        }
+    } else {
+        while (hostEnd < stop && *hostEnd != ':') {
+            hostEnd++;
+        }
+    }
+    size_t hostLen = (size_t)(hostEnd - host);
+    if (hostLen == 0 || hostLen >= REQ_HOSTLEN) {
+        return NULL;
+    }
+    if (host != auth) {
+        hostEnd++; // past the bracket
+    }
+    // host names are case-insensitive, and kept in lower case for the key.
+    for (size_t i = 0; i < hostLen; i++) {
+        r->host[i] = (char)tolower((unsigned char)host[i]);
+    }
+    r->host[hostLen] = '\0';
+    strcpy(r->port, "80");
+    if (hostEnd < stop) {
+        if (*hostEnd != ':') {
+            return NULL;
+        }
+        size_t portLen = (size_t)(stop - hostEnd - 1);
+        if (portLen >= REQ_PORTLEN) {
+            return NULL;
+        }
+        for (size_t i = 0; i < portLen; i++) {
+            if (!isdigit((unsigned char)hostEnd[1 + i])) {
+                return NULL;
+            }
+        }
+        // an empty port is the default one.
+        if (portLen > 0) {
+            memcpy(r->port, hostEnd + 1, portLen);
+            r->port[portLen] = '\0';
+        }
+    }
+    return stop;
+}
+
+/*a helper parsing the request line, "<method> <uri> HTTP/1.<minor>", which
+ *runs from buf + off for len bytes without its line ending.
+ */
+static bool parse_request_line(http_request_t *r, const char *buf, size_t off,
+                               size_t len) {
+    const char *line = buf + off;
+    const char *end = line + len;
+    const char *p = line;
+    while (p < end && is_tchar((unsigned char)*p)) {
+        p++;
+    }
+    if (p == line || p == end || *p != ' ') {
+        return false;
+    }
+    r->method = (req_span_t){(uint32_t)off, (uint32_t)(p - line)};
+    const char *uri = ++p;
+    while (p < end && *p != ' ') {
+        p++;
+    }
+    size_t uriLen = (size_t)(p - uri);
+    if (uriLen == 0 || (size_t)(end - p) != 9 ||
+        memcmp(p, " HTTP/1.", 8) != 0 || (p[8] != '0' && p[8] != '1')) {
+        return false;
+    }
+    r->version = p[8];
+    r->uri = (req_span_t){(uint32_t)(uri - buf), (uint32_t)uriLen};
+    const char *path = uri;
+    if (uriLen > 7 && strncasecmp(uri, "http://", 7) == 0) {
+        if ((path = parse_authority(r, uri + 7, p)) == NULL) {
+            return false;
+        }
+    } else if (*uri == '/') {
+        // a request for the proxy itself, which names no server.
+        r->host[0] = '\0';
+        strcpy(r->port, "80");
+    } else {
+        return false;
+    }
+    r->path = (req_span_t){(uint32_t)(path - buf), (uint32_t)(p - path)};
+    return true;
+}
+
+/*a helper parsing a header line, "<name>:<value>", which runs from buf + off
+ *for len bytes without its line ending, next being the offset of the line
+ *after it.
+ */
+static bool parse_header(http_request_t *r, const char *buf, size_t off,
+                         size_t len, size_t next) {
+    if (r->nheaders == REQ_MAXHDRS) {
+        return false;
+    }
+    const char *line = buf + off;
+    const char *end = line + len;
+    const char *p = line;
+    // a line folded onto the previous one, or a name followed by whitespace,
+    // is rejected rather than guessed at (RFC 9112).
+    while (p < end && is_tchar((unsigned char)*p)) {
+        p++;
+    }
+    if (p == line || p == end || *p != ':') {
+        return false;
+    }
+    req_header_t *h = &r->headers[r->nheaders];
+    size_t nameLen = (size_t)(p - line);
+    h->name = (req_span_t){(uint32_t)off, (uint32_t)nameLen};
+    h->hash = name_hash(line, nameLen);
+    h->end = (uint32_t)next;
+    h->known = REQ_HDR_KNOWN;
+    for (int k = 0; k < REQ_HDR_KNOWN; k++) {
+        if (known_hashes[k] == h->hash && known_lens[k] == nameLen &&
+            strncasecmp(known_names[k], line, nameLen) == 0) {
+            h->known = (req_hdr)k;
+            if (r->known[k] == 0) {
+                r->known[k] = r->nheaders + 1;
+            }
+            break;
+        }
+    }
+    p++;
+    while (p < end && (*p == ' ' || *p == '\t')) {
+        p++;
+    }
+    while (end > p && (end[-1] == ' ' || end[-1] == '\t')) {
+        end--;
+    }
+    h->value = (req_span_t){(uint32_t)(p - buf), (uint32_t)(end - p)};
+    r->nheaders++;
+    return true;
+}
+
+req_state request_feed(http_request_t *r, char *buf, size_t len) {
+    while (r->state == REQ_LINE || r->state == REQ_HEADERS) {
+        size_t off = r->scanned;
+        char *nl = memchr(buf + off, '\n', len - off);
+        if (nl == NULL) {
+            break; // the rest of the line is still to come
+        }
+        size_t next = (size_t)(nl - buf) + 1;
+        size_t lineLen = (size_t)(nl - buf) - off;
+        if (lineLen > 0 && nl[-1] == '\r') {
+            lineLen--;
+        }
+        r->scanned = next;
+        if (r->state == REQ_LINE) {
+            // blank lines ahead of a request are ignored (RFC 9112).
+            if (lineLen == 0) {
+                continue;
+            }
+            r->state = parse_request_line(r, buf, off, lineLen) ? REQ_HEADERS
+                                                                : REQ_ERROR;
+        } else if (lineLen == 0) {
+            r->state = REQ_DONE;
+            r->len = next;
+            r->base = buf;
+            buf[r->uri.off + r->uri.len] = '\0';
+        } else if (!parse_header(r, buf, off, lineLen, next)) {
+            r->state = REQ_ERROR;
+        }
+    }
+    return r->state;
+}
+
+const req_header_t *request_header(const http_request_t *r, req_hdr which) {
+    int i = r->known[which];
+    return i == 0 ? NULL : &r->headers[i - 1];
+}
+
+const req_header_t *request_find(const http_request_t *r, const char *name) {
+    size_t len = strlen(name);
+    uint32_t hash = name_hash(name, len);
+    for (int i = 0; i < r->nheaders; i++) {
+        const req_header_t *h = &r->headers[i];
+        if (h->hash == hash && h->name.len == len &&
+            strncasecmp(request_at(r, h->name), name, len) == 0) {
+            return h;
+        }
+    }
+    return NULL;
+}
+
+bool request_value_is(const http_request_t *r, const req_header_t *h,
+                      const char *token) {
+    size_t len = strlen(token);
+    return h != NULL && h->value.len == len &&
+           strncasecmp(request_at(r, h->value), token, len) == 0;
+}
+
+/*a helper reading the q-value of an element of Accept-Encoding from its
+ *parameters, which run from p to end: 1 unless "q=0" or "q=0.0..." with no
+ *other digit, as only whether it is zero matters here.*/
+static bool element_weighted(const char *p, const char *end) {
+    while (p < end) {
+        while (p < end && (*p == ';' || *p == ' ' || *p == '\t')) {
+            p++;
+        }
+        if (end - p >= 2 && (*p == 'q' || *p == 'Q') && p[1] == '=') {
+            p += 2;
+            while (p < end && (*p == '0' || *p == '.')) {
+                p++;
+            }
+            return p < end && isdigit((unsigned char)*p);
+        }
+        while (p < end && *p != ';') {
+            p++;
+        }
+    }
+    return true;
+}
+
+bool request_accepts(const http_request_t *r, const char *coding) {
+    const req_header_t *h = request_header(r, REQ_HDR_ACCEPT_ENCODING);
+    if (h == NULL) {
+        return false;
+    }
+    size_t len = strlen(coding);
+    const char *p = request_at(r, h->value);
+    const char *end = p + h->value.len;
+    // the coding named outright wins over "*", whichever comes first.
+    bool wildcard = false;
+    while (p < end) {
+        while (p < end && (*p == ',' || *p == ' ' || *p == '\t')) {
+            p++;
+        }
+        const char *name = p;
+        while (p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') {
+            p++;
+        }
+        size_t nameLen = (size_t)(p - name);
+        const char *elemEnd = memchr(p, ',', (size_t)(end - p));
+        if (elemEnd == NULL) {
+            elemEnd = end;
+        }
+        if (nameLen == len && strncasecmp(name, coding, len) == 0) {
+            return element_weighted(p, elemEnd);
+        }
+        if (nameLen == 1 && *name == '*') {
+            wildcard = element_weighted(p, elemEnd);
+        }
+        p = elemEnd;
+    }
+    return wildcard;
+}
+
+// whether a query parameter is among those of the ignore list.
+static bool param_ignored(const char *name, size_t len, const char *ignore) {
+    while (ignore != NULL && *ignore != '\0') {
+        const char *comma = strchr(ignore, ',');
+        size_t n = comma != NULL ? (size_t)(comma - ignore) : strlen(ignore);
+        if (n > 0 && ignore[n - 1] == '*') {
+            if (len >= n - 1 && memcmp(name, ignore, n - 1) == 0) {
+                return true;
+            }
+        } else if (n == len && memcmp(name, ignore, n) == 0) {
+            return true;
+        }
+        ignore = comma != NULL ? comma + 1 : NULL;
+    }
+    return false;
+}
+
+const char *request_cache_key(http_request_t *r, const char *ignore) {
+    char key[REQ_KEYMAX];
+    const char *path = request_at(r, r->path);
+    size_t pathLen = r->path.len;
+    const char *fragment = memchr(path, '#', pathLen);
+    if (fragment != NULL) {
+        pathLen = (size_t)(fragment - path);
+    }
+    const char *query = memchr(path, '?', pathLen);
+    const char *queryEnd = path + pathLen;
+    if (query != NULL) {
+        pathLen = (size_t)(query - path);
+    }
+    bool v6 = strchr(r->host, ':') != NULL;
+    bool port = strcmp(r->port, "80") != 0;
+    int n = snprintf(key, sizeof(key), "http://%s%s%s%s%s%s%.*s",
+                     v6 ? "[" : "", r->host, v6 ? "]" : "", port ? ":" : "",
+                     port ? r->port : "", pathLen > 0 ? "" : "/",
+                     (int)pathLen, path);
+    if (n < 0 || (size_t)n >= sizeof(key)) {
+        return NULL;
+    }
+    size_t len = (size_t)n;
+    // the parameters kept, in the order they came in.
+    char sep = '?';
+    for (const char *p = query; p != NULL && p < queryEnd;) {
+        const char *param = p + 1;
+        const char *amp = memchr(param, '&', (size_t)(queryEnd - param));
+        const char *paramEnd = amp != NULL ? amp : queryEnd;
+        size_t paramLen = (size_t)(paramEnd - param);
+        const char *eq = memchr(param, '=', paramLen);
+        size_t nameLen = eq != NULL ? (size_t)(eq - param) : paramLen;
+        if (paramLen > 0 && !param_ignored(param, nameLen, ignore)) {
+            if (len + 1 + paramLen >= sizeof(key)) {
+                return NULL;
+            }
+            key[len++] = sep;
+            memcpy(key + len, param, paramLen);
+            len += paramLen;
+            sep = '&';
+        }
+        p = amp;
+    }
+    char *out = r->base + r->uri.off;
+    memcpy(out, key, len);
+    out[len] = '\0';
+    return out;
+}
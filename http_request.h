@@ -0,0 +1,176 @@
+/*
+ * @file: http_request.h
+ * @brief: an incremental parser for the HTTP requests clients send the
+ * proxy. It works on the header block as it sits in the connection's rio
+ * buffer, and is fed the whole of what is buffered every time more arrives
+ * from the non-blocking socket, picking up at the first line it hasn't seen
+ * yet, so a request split across any number of reads is only ever scanned
+ * once.
+ *
+ * Nothing is copied or allocated. The method, URI, path and every header name
+ * and value are recorded as spans, offsets into the header block, which stay
+ * right when the rio buffer moves the bytes it holds to its front. Each header
+ * name is hashed as it is scanned, and the headers the proxy acts on are
+ * matched up front against the precomputed hashes of their names, so looking
+ * one of them up afterwards is an array index. Only the server host and port
+ * are copied out of the URI, as short NUL-terminated strings, and the URI is
+ * NUL-terminated in place.
+ *
+ * The cache key of a request is its URI normalized, written over the URI
+ * itself, so that the spellings of the same URL share an object in the cache.
+ *
+ * @Author Sanah Imani <simani@unix.andrew.cmu.edu>
+ */
+
+#ifndef __HTTP_REQUEST_H__
+#define __HTTP_REQUEST_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define REQ_MAXHDRS 100  // max headers in a request
+#define REQ_HOSTLEN 256  // max length of a server host, plus its NUL
+#define REQ_PORTLEN 8    // max length of a server port, plus its NUL
+#define REQ_KEYMAX 8192  // max length of a cache key, plus its NUL
+
+/* The parts of a request the parser moves through. */
+typedef enum req_state {
+    REQ_LINE,    // waiting for the request line
+    REQ_HEADERS, // reading the headers
+    REQ_DONE,    // the header block is complete
+    REQ_ERROR    // the request is malformed
+} req_state;
+
+/* The headers the proxy acts on, which are looked up without a search. */
+typedef enum req_hdr {
+    REQ_HDR_HOST,
+    REQ_HDR_CONNECTION,
+    REQ_HDR_PROXY_CONNECTION,
+    REQ_HDR_KEEP_ALIVE,
+    REQ_HDR_USER_AGENT,
+    REQ_HDR_EXPECT,
+    REQ_HDR_RANGE,
+    REQ_HDR_IF_RANGE,
+    REQ_HDR_IF_NONE_MATCH,
+    REQ_HDR_IF_MODIFIED_SINCE,
+    REQ_HDR_TRANSFER_ENCODING,
+    REQ_HDR_CONTENT_LENGTH,
+    REQ_HDR_ACCEPT_ENCODING,
+    REQ_HDR_AUTHORIZATION,
+    REQ_HDR_COOKIE,
+    REQ_HDR_KNOWN, // the number of them, and the mark of any other header
+} req_hdr;
+
+/* Where some bytes of the header block are. */
+typedef struct req_span {
+    uint32_t off; // from the start of the block
+    uint32_t len;
+} req_span_t;
+
+/* One header line of a request. */
+typedef struct req_header {
+    req_span_t name;  // the name, which starts the line
+    req_span_t value; // the value, without the whitespace around it
+    uint32_t end;     // the offset of the next line
+    uint32_t hash;    // of the name, case folded
+    req_hdr known;    // which of the known headers it is, if any
+} req_header_t;
+
+typedef struct http_request {
+    req_state state;
+    size_t scanned;      // bytes of the block parsed so far, whole lines
+    size_t len;          // the length of the block, once REQ_DONE
+    char *base;          // the block, once REQ_DONE
+    req_span_t method;   // the method
+    req_span_t uri;      // the URI, NUL-terminated in place once REQ_DONE
+    req_span_t path;     // the path and query of the URI, empty for "/"
+    char version;        // the minor HTTP version, '0' or '1'
+    char host[REQ_HOSTLEN]; // the server host in lower case, without the
+                            // brackets of an IPv6 address, "" if the URI
+                            // names none
+    char port[REQ_PORTLEN]; // the server port, "80" by default
+    int nheaders;        // headers in headers[]
+    int known[REQ_HDR_KNOWN]; // by req_hdr, the first header of the name in
+                              // headers[] plus one, 0 if there is none
+    req_header_t headers[REQ_MAXHDRS];
+} http_request_t;
+
+/* resetting a parser for the next request.
+ *
+ * @params[out] r the parser
+ */
+void request_init(http_request_t *r);
+
+/* feeding the parser the request buffered so far. Lines parsed by an earlier
+ * call are skipped, so buf may have moved since, but must start with the same
+ * bytes. Parsing stops at the blank line ending the header block, and
+ * whatever follows it in buf, a body or pipelined requests, is left alone.
+ *
+ * @params[in] r the parser
+ * @params[in,out] buf the start of the header block
+ * @params[in] len the bytes buffered from buf on
+ *
+ * @return the state of the parser: REQ_DONE once the whole header block has
+ * been parsed, with its length in r->len.
+ */
+req_state request_feed(http_request_t *r, char *buf, size_t len);
+
+/* finding one of the headers the proxy acts on.
+ *
+ * @params[in] r a parser in REQ_DONE
+ * @params[in] which the header
+ *
+ * @return the first header of that name, NULL if there is none.
+ */
+const req_header_t *request_header(const http_request_t *r, req_hdr which);
+
+/* finding a header by name, hashed and then compared with those of every
+ * header of the request. For headers that aren't among the known ones.
+ *
+ * @params[in] r a parser in REQ_DONE
+ * @params[in] name the name, matched case-insensitively
+ *
+ * @return the first header of that name, NULL if there is none.
+ */
+const req_header_t *request_find(const http_request_t *r, const char *name);
+
+/* whether a header's value is the given token, case-insensitively.
+ *
+ * @params[in] r a parser in REQ_DONE
+ * @params[in] h one of its headers, or NULL
+ * @params[in] token the token
+ */
+bool request_value_is(const http_request_t *r, const req_header_t *h,
+                      const char *token);
+
+/* whether the client accepts a content coding, as Accept-Encoding names it
+ * (or "*") with a non-zero q-value. A client that sends no Accept-Encoding
+ * is taken to want the response as it is.
+ *
+ * @params[in] r a parser in REQ_DONE
+ * @params[in] coding the content coding, e.g. "gzip"
+ */
+bool request_accepts(const http_request_t *r, const char *coding);
+
+/* normalizing the URI of a request naming a server into its cache key, in
+ * place: the scheme and host are put in lower case, the default port is left
+ * out, an empty path becomes "/", and the fragment and the query parameters
+ * named in ignore are dropped. The key may be a byte longer than the URI,
+ * taking up the rest of the request line, and r->path goes with it, so this
+ * is only done once the request line has been rewritten for the server.
+ *
+ * @params[in,out] r a parser in REQ_DONE, whose host isn't ""
+ * @params[in] ignore the query parameters to drop, by name, separated by
+ * commas, where a name ending in '*' stands for every name it starts; or NULL
+ *
+ * @return the key, NUL-terminated, or NULL if it doesn't fit in REQ_KEYMAX.
+ */
+const char *request_cache_key(http_request_t *r, const char *ignore);
+
+// the bytes of a span of the header block of a parser in REQ_DONE.
+static inline const char *request_at(const http_request_t *r, req_span_t s) {
+    return r->base + s.off;
+}
+
+#endif /* __HTTP_REQUEST_H__ */
@@ -0,0 +1,877 @@
+/*
+ * @file: http_response.c
+ * @brief: the incremental HTTP response parser used by the proxy to frame
+ * responses from web servers, following the signature in http_response.h.
+ * Header bytes are buffered until the blank line ending them, at which point
+ * the status line and the framing headers are parsed. Body bytes are only
+ * counted (Content-Length) or run through a small chunked-coding state
+ * machine, never copied.
+ *
+ * @Author Sanah Imani <simani@unix.andrew.cmu.edu>
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // strptime(), timegm()
+#endif
+
+#include <http_response.h>
+
+#include <ctype.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define HDR_MAX (RESP_HDRBUF - 64) // header bytes accepted from the server
+#define CL_WIDTH 12 // width of the Content-Length value in stored headers
+
+// positions within the chunked framing of a body
+enum chunk_state {
+    CHUNK_SIZE,     // reading the hex chunk size
+    CHUNK_EXT,      // skipping chunk extensions up to the end of the line
+    CHUNK_DATA,     // the chunk's data
+    CHUNK_DATA_END, // the CRLF after the data
+    CHUNK_TRAILER,  // at the start of a trailer line (or the final CRLF)
+    CHUNK_TRAILER_LINE // skipping a trailer line
+};
+
+void response_init(http_response_t *r) {
+    r->state = RESP_HEADERS;
+    r->hdrLen = 0;
+    r->status = 0;
+    r->keepAlive = false;
+    r->framing = FRAMING_CLOSE;
+    r->length = 0;
+    r->remaining = 0;
+    r->chunkState = CHUNK_SIZE;
+    r->maxAge = -1;
+    r->expires = 0;
+    r->date = 0;
+    r->lastModified = 0;
+    r->age = 0;
+    r->noStore = false;
+    r->noCache = false;
+    r->mustRevalidate = false;
+    r->hasEtag = false;
+    r->staleWhile = -1;
+}
+
+/*a helper finding the end of the header line starting at p.
+ *
+ * @return the start of the next line, and the length of this line without
+ * its line ending in *lineLen.
+ */
+static const char *next_line(const char *p, const char *end, size_t *lineLen) {
+    const char *nl = memchr(p, '\n', (size_t)(end - p));
+    const char *next = nl == NULL ? end : nl + 1;
+    const char *stop = nl == NULL ? end : nl;
+    if (stop > p && stop[-1] == '\r') {
+        stop--;
+    }
+    *lineLen = (size_t)(stop - p);
+    return next;
+}
+
+// whether a header line's name is the given (case-insensitive) name.
+static bool header_is(const char *line, size_t lineLen, const char *name) {
+    size_t n = strlen(name);
+    return lineLen > n && line[n] == ':' && strncasecmp(line, name, n) == 0;
+}
+
+// whether a comma separated header value contains the given token.
+static bool has_token(const char *value, size_t len, const char *token) {
+    size_t n = strlen(token);
+    const char *end = value + len;
+    while (value < end) {
+        while (value < end && (*value == ' ' || *value == '\t' ||
+                               *value == ',')) {
+            value++;
+        }
+        const char *tokEnd = value;
+        while (tokEnd < end && *tokEnd != ',' && *tokEnd != ' ' &&
+               *tokEnd != '\t' && *tokEnd != ';') {
+            tokEnd++;
+        }
+        if ((size_t)(tokEnd - value) == n &&
+            strncasecmp(value, token, n) == 0) {
+            return true;
+        }
+        while (tokEnd < end && *tokEnd != ',') {
+            tokEnd++;
+        }
+        value = tokEnd;
+    }
+    return false;
+}
+
+// stripping the whitespace around a header value.
+static const char *trim_value(const char *value, size_t *len) {
+    while (*len > 0 && (*value == ' ' || *value == '\t')) {
+        value++;
+        (*len)--;
+    }
+    while (*len > 0 && (value[*len - 1] == ' ' || value[*len - 1] == '\t')) {
+        (*len)--;
+    }
+    return value;
+}
+
+/*a helper parsing an HTTP date in any of the three formats of RFC 9110.
+ *
+ * @return the time, 0 if the date is invalid.
+ */
+static time_t parse_http_date(const char *value, size_t len) {
+    static const char *formats[] = {
+        "%a, %d %b %Y %H:%M:%S GMT", // IMF-fixdate
+        "%A, %d-%b-%y %H:%M:%S GMT", // RFC 850
+        "%a %b %e %H:%M:%S %Y",      // asctime()
+    };
+    char buf[64];
+    value = trim_value(value, &len);
+    if (len >= sizeof(buf)) {
+        return 0;
+    }
+    memcpy(buf, value, len);
+    buf[len] = '\0';
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        const char *end = strptime(buf, formats[i], &tm);
+        if (end != NULL && *end == '\0') {
+            time_t t = timegm(&tm);
+            return t > 0 ? t : 0;
+        }
+    }
+    return 0;
+}
+
+// parsing a delta-seconds value, -1 if invalid.
+static long parse_seconds(const char *value, size_t len) {
+    value = trim_value(value, &len);
+    if (len > 0 && *value == '"') { // tolerating a quoted value
+        value++;
+        len -= len >= 2 ? 2 : 1;
+    }
+    long seconds = 0;
+    if (len == 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (!isdigit((unsigned char)value[i])) {
+            return -1;
+        }
+        // values too large to represent count as a very long time.
+        seconds = seconds > (1L << 31) ? seconds
+                                       : seconds * 10 + (value[i] - '0');
+    }
+    return seconds;
+}
+
+/*a helper parsing the directives of a Cache-Control header. s-maxage is set
+ *aside, as it takes over from max-age for shared caches whatever the order.*/
+static void parse_cache_control(http_response_t *r, const char *value,
+                                size_t len, long *sMaxAge) {
+    const char *end = value + len;
+    while (value < end) {
+        while (value < end && (*value == ' ' || *value == '\t' ||
+                               *value == ',')) {
+            value++;
+        }
+        const char *name = value;
+        while (value < end && *value != '=' && *value != ',' &&
+               *value != ' ' && *value != '\t') {
+            value++;
+        }
+        size_t nameLen = (size_t)(value - name);
+        const char *arg = NULL;
+        size_t argLen = 0;
+        if (value < end && *value == '=') {
+            arg = ++value;
+            bool quoted = false;
+            while (value < end && (quoted || *value != ',')) {
+                quoted = *value == '"' ? !quoted : quoted;
+                value++;
+            }
+            argLen = (size_t)(value - arg);
+        }
+        if (nameLen == 7 && strncasecmp(name, "max-age", 7) == 0 && arg) {
+            r->maxAge = parse_seconds(arg, argLen);
+        } else if (nameLen == 8 && strncasecmp(name, "s-maxage", 8) == 0 &&
+                   arg) {
+            *sMaxAge = parse_seconds(arg, argLen);
+        } else if ((nameLen == 8 && strncasecmp(name, "no-store", 8) == 0) ||
+                   (nameLen == 7 && strncasecmp(name, "private", 7) == 0)) {
+            r->noStore = true;
+        } else if (nameLen == 22 &&
+                   strncasecmp(name, "stale-while-revalidate", 22) == 0 &&
+                   arg) {
+            r->staleWhile = parse_seconds(arg, argLen);
+        } else if (nameLen == 8 && strncasecmp(name, "no-cache", 8) == 0) {
+            r->noCache = true;
+        } else if ((nameLen == 15 &&
+                    strncasecmp(name, "must-revalidate", 15) == 0) ||
+                   (nameLen == 16 &&
+                    strncasecmp(name, "proxy-revalidate", 16) == 0)) {
+            r->mustRevalidate = true;
+        }
+        while (value < end && *value != ',') {
+            value++;
+        }
+    }
+}
+
+// headers describing the connection to the server rather than the response.
+static bool is_hop_by_hop(const char *line, size_t lineLen) {
+    return header_is(line, lineLen, "Connection") ||
+           header_is(line, lineLen, "Keep-Alive") ||
+           header_is(line, lineLen, "Proxy-Connection") ||
+           header_is(line, lineLen, "TE") ||
+           header_is(line, lineLen, "Trailer") ||
+           header_is(line, lineLen, "Upgrade");
+}
+
+/*a helper parsing the now complete header block: the status code, whether the
+ *server keeps the connection open, and how the body is framed.
+ */
+static void parse_headers(http_response_t *r) {
+    int major;
+    int minor;
+    if (sscanf(r->hdr, "HTTP/%d.%d %d", &major, &minor, &r->status) != 3 ||
+        r->status < 100 || r->status > 999) {
+        r->state = RESP_ERROR;
+        return;
+    }
+    bool http11 = major > 1 || (major == 1 && minor >= 1);
+    bool chunked = false;
+    bool hasLength = false;
+    bool closeTok = false;
+    bool keepAliveTok = false;
+    long sMaxAge = -1;
+
+    const char *end = r->hdr + r->hdrLen;
+    size_t lineLen;
+    const char *line = next_line(r->hdr, end, &lineLen);
+    while (line < end) {
+        const char *next = next_line(line, end, &lineLen);
+        const char *colon = memchr(line, ':', lineLen);
+        if (lineLen > 0 && colon != NULL) {
+            const char *value = colon + 1;
+            size_t valueLen = lineLen - (size_t)(value - line);
+            if (header_is(line, lineLen, "Content-Length")) {
+                char *numEnd;
+                char num[32];
+                size_t n = valueLen < sizeof(num) - 1 ? valueLen
+                                                      : sizeof(num) - 1;
+                memcpy(num, value, n);
+                num[n] = '\0';
+                unsigned long long length = strtoull(num, &numEnd, 10);
+                while (*numEnd == ' ' || *numEnd == '\t') {
+                    numEnd++;
+                }
+                // conflicting lengths can't be framed safely.
+                if (numEnd == num || *numEnd != '\0' ||
+                    (hasLength && length != r->length)) {
+                    r->state = RESP_ERROR;
+                    return;
+                }
+                r->length = length;
+                hasLength = true;
+            } else if (header_is(line, lineLen, "Transfer-Encoding")) {
+                chunked = has_token(value, valueLen, "chunked");
+            } else if (header_is(line, lineLen, "Connection")) {
+                closeTok = closeTok || has_token(value, valueLen, "close");
+                keepAliveTok =
+                    keepAliveTok || has_token(value, valueLen, "keep-alive");
+            } else if (header_is(line, lineLen, "Cache-Control")) {
+                parse_cache_control(r, value, valueLen, &sMaxAge);
+            } else if (header_is(line, lineLen, "Expires")) {
+                // an invalid date means already expired.
+                r->expires = parse_http_date(value, valueLen);
+                r->expires = r->expires != 0 ? r->expires : 1;
+            } else if (header_is(line, lineLen, "Date")) {
+                r->date = parse_http_date(value, valueLen);
+            } else if (header_is(line, lineLen, "Last-Modified")) {
+                r->lastModified = parse_http_date(value, valueLen);
+            } else if (header_is(line, lineLen, "Age")) {
+                long age = parse_seconds(value, valueLen);
+                r->age = age > 0 ? age : 0;
+            } else if (header_is(line, lineLen, "ETag")) {
+                r->hasEtag = true;
+            } else if (header_is(line, lineLen, "Vary")) {
+                // varying on every request detail, so never the same.
+                r->noStore = r->noStore || has_token(value, valueLen, "*");
+            }
+        }
+        line = next;
+    }
+    if (sMaxAge >= 0) {
+        r->maxAge = sMaxAge;
+    }
+
+    if (r->status == 204 || r->status == 304) {
+        r->framing = FRAMING_NONE;
+    } else if (chunked) {
+        r->framing = FRAMING_CHUNKED;
+    } else if (hasLength) {
+        r->framing = FRAMING_LENGTH;
+    } else {
+        r->framing = FRAMING_CLOSE;
+    }
+    r->keepAlive = (http11 ? !closeTok : keepAliveTok) &&
+                   r->framing != FRAMING_CLOSE;
+    r->remaining = r->framing == FRAMING_LENGTH ? r->length : 0;
+    r->chunkState = CHUNK_SIZE;
+    if (r->framing == FRAMING_NONE ||
+        (r->framing == FRAMING_LENGTH && r->length == 0)) {
+        r->state = RESP_DONE;
+    } else {
+        r->state = RESP_BODY;
+    }
+}
+
+// running body bytes through the chunked framing, returning those consumed.
+static size_t feed_chunked(http_response_t *r, const char *buf, size_t len) {
+    size_t i = 0;
+    while (i < len && r->state == RESP_BODY) {
+        char ch = buf[i];
+        switch (r->chunkState) {
+        case CHUNK_SIZE:
+            if (isxdigit((unsigned char)ch)) {
+                int digit = isdigit((unsigned char)ch)
+                                ? ch - '0'
+                                : tolower((unsigned char)ch) - 'a' + 10;
+                if (r->remaining > (UINT64_MAX >> 4)) {
+                    r->state = RESP_ERROR;
+                    return i;
+                }
+                r->remaining = r->remaining * 16 + (uint64_t)digit;
+            } else if (ch == '\n') {
+                r->chunkState =
+                    r->remaining == 0 ? CHUNK_TRAILER : CHUNK_DATA;
+            } else if (ch != '\r') {
+                r->chunkState = CHUNK_EXT;
+            }
+            i++;
+            break;
+        case CHUNK_EXT:
+            if (ch == '\n') {
+                r->chunkState =
+                    r->remaining == 0 ? CHUNK_TRAILER : CHUNK_DATA;
+            }
+            i++;
+            break;
+        case CHUNK_DATA: {
+            size_t take = len - i;
+            if (take > r->remaining) {
+                take = (size_t)r->remaining;
+            }
+            r->remaining -= take;
+            i += take;
+            if (r->remaining == 0) {
+                r->chunkState = CHUNK_DATA_END;
+            }
+            break;
+        }
+        case CHUNK_DATA_END:
+            if (ch == '\n') {
+                r->chunkState = CHUNK_SIZE;
+            }
+            i++;
+            break;
+        case CHUNK_TRAILER:
+            if (ch == '\n') {
+                r->state = RESP_DONE;
+            } else if (ch != '\r') {
+                r->chunkState = CHUNK_TRAILER_LINE;
+            }
+            i++;
+            break;
+        case CHUNK_TRAILER_LINE:
+            if (ch == '\n') {
+                r->chunkState = CHUNK_TRAILER;
+            }
+            i++;
+            break;
+        }
+    }
+    return i;
+}
+
+size_t response_feed(http_response_t *r, const char *buf, size_t len) {
+    size_t i = 0;
+    if (r->state == RESP_HEADERS) {
+        while (i < len) {
+            if (r->hdrLen == HDR_MAX) {
+                r->state = RESP_ERROR;
+                return i;
+            }
+            char ch = buf[i++];
+            r->hdr[r->hdrLen++] = ch;
+            if (ch != '\n') {
+                continue;
+            }
+            // a blank line (LF LF or LF CR LF) ends the header block.
+            size_t n = r->hdrLen;
+            if ((n >= 2 && r->hdr[n - 2] == '\n') ||
+                (n >= 3 && r->hdr[n - 2] == '\r' && r->hdr[n - 3] == '\n')) {
+                r->hdr[n] = '\0';
+                parse_headers(r);
+                // interim 1xx responses are followed by the real one.
+                if (r->state != RESP_ERROR && r->status < 200 &&
+                    r->status != 101) {
+                    response_init(r);
+                    continue;
+                }
+                return i;
+            }
+        }
+        return i;
+    }
+    if (r->state != RESP_BODY) {
+        return 0;
+    }
+    switch (r->framing) {
+    case FRAMING_LENGTH: {
+        size_t take = len;
+        if (take > r->remaining) {
+            take = (size_t)r->remaining;
+        }
+        r->remaining -= take;
+        if (r->remaining == 0) {
+            r->state = RESP_DONE;
+        }
+        return take;
+    }
+    case FRAMING_CHUNKED:
+        return feed_chunked(r, buf, len);
+    case FRAMING_CLOSE:
+        return len;
+    case FRAMING_NONE:
+        break;
+    }
+    return 0;
+}
+
+void response_consumed(http_response_t *r, size_t len) {
+    if (r->state == RESP_BODY && r->framing != FRAMING_CHUNKED) {
+        response_feed(r, NULL, len);
+    }
+}
+
+void response_eof(http_response_t *r) {
+    if (r->state == RESP_BODY && r->framing == FRAMING_CLOSE) {
+        r->state = RESP_DONE;
+    } else if (r->state != RESP_DONE) {
+        r->state = RESP_ERROR;
+    }
+}
+
+/*a helper copying the status line and the headers not dropped to out, which
+ *may alias r->hdr as lines only ever move towards the start. The tail, if
+ *any, is added after the kept headers and before the blank line.
+ *
+ * @return the length of the header block, 0 if it doesn't fit.
+ */
+static size_t build_header(http_response_t *r, char *out, size_t size,
+                           bool dropFraming, const char *tail) {
+    const char *end = r->hdr + r->hdrLen;
+    const char *line = r->hdr;
+    size_t outLen = 0;
+    bool first = true;
+    while (line < end) {
+        size_t lineLen;
+        const char *next = next_line(line, end, &lineLen);
+        if (lineLen == 0) {
+            break; // the blank line
+        }
+        bool keep = first || (!is_hop_by_hop(line, lineLen) &&
+                              !(dropFraming &&
+                                (header_is(line, lineLen, "Content-Length") ||
+                                 header_is(line, lineLen,
+                                           "Transfer-Encoding"))));
+        if (keep) {
+            if (outLen + lineLen + 2 > size) {
+                return 0;
+            }
+            memmove(out + outLen, line, lineLen);
+            outLen += lineLen;
+            out[outLen++] = '\r';
+            out[outLen++] = '\n';
+        }
+        first = false;
+        line = next;
+    }
+    size_t tailLen = tail != NULL ? strlen(tail) : 0;
+    if (outLen + tailLen + 2 > size) {
+        return 0;
+    }
+    memcpy(out + outLen, tail, tailLen);
+    outLen += tailLen;
+    out[outLen++] = '\r';
+    out[outLen++] = '\n';
+    return outLen;
+}
+
+size_t response_client_header(http_response_t *r, char *out, size_t size,
+                              const char *connection) {
+    char tail[64];
+    snprintf(tail, sizeof(tail), "Connection: %s\r\n", connection);
+    return build_header(r, out, size, false, tail);
+}
+
+size_t response_stored_header(http_response_t *r, char *out, size_t size) {
+    // the value is filled in by response_finish_stored().
+    char tail[64];
+    snprintf(tail, sizeof(tail), "Content-Length:%*s\r\n", CL_WIDTH, "");
+    return build_header(r, out, size, true, tail);
+}
+
+/*a helper decoding a complete, already validated, chunked body in place.
+ *
+ * @return the length of the decoded body
+ */
+static size_t dechunk(char *body, size_t len) {
+    size_t in = 0;
+    size_t out = 0;
+    while (in < len) {
+        uint64_t size = 0;
+        while (in < len && isxdigit((unsigned char)body[in])) {
+            char ch = body[in++];
+            size = size * 16 + (uint64_t)(isdigit((unsigned char)ch)
+                                              ? ch - '0'
+                                              : tolower((unsigned char)ch) -
+                                                    'a' + 10);
+        }
+        // skipping any chunk extension and the line ending.
+        while (in < len && body[in] != '\n') {
+            in++;
+        }
+        in++;
+        if (size == 0 || in >= len) {
+            break;
+        }
+        if (size > len - in) {
+            size = len - in;
+        }
+        memmove(body + out, body + in, (size_t)size);
+        out += (size_t)size;
+        in += (size_t)size;
+        // the CRLF after the data.
+        while (in < len && body[in] != '\n') {
+            in++;
+        }
+        in++;
+    }
+    return out;
+}
+
+size_t response_finish_stored(http_response_t *r, char *obj, size_t hdrSize,
+                              size_t len) {
+    size_t bodyLen = len - hdrSize;
+    if (r->framing == FRAMING_CHUNKED) {
+        bodyLen = dechunk(obj + hdrSize, bodyLen);
+    }
+    // the placeholder value sits just before the final CRLF CRLF.
+    char value[CL_WIDTH + 1];
+    snprintf(value, sizeof(value), "%*zu", CL_WIDTH, bodyLen);
+    memcpy(obj + hdrSize - 4 - CL_WIDTH, value, CL_WIDTH);
+    return hdrSize + bodyLen;
+}
+
+uint64_t response_stored_length(const char *stored, size_t hdrSize) {
+    // the value sits just before the final CRLF CRLF, as patched in above.
+    char value[CL_WIDTH + 1];
+    memcpy(value, stored + hdrSize - 4 - CL_WIDTH, CL_WIDTH);
+    value[CL_WIDTH] = '\0';
+    return strtoull(value, NULL, 10);
+}
+
+size_t response_range_header(const char *stored, size_t hdrSize,
+                             uint64_t first, uint64_t last, char *out,
+                             size_t size) {
+    // the stored block isn't NUL-terminated, so the status line is matched
+    // in place: "HTTP/x.y 200".
+    if (hdrSize < 12 || strncmp(stored, "HTTP/", 5) != 0 ||
+        memcmp(stored + 8, " 200", 4) != 0) {
+        return 0;
+    }
+    // the headers between the status line and the stored Content-Length.
+    const char *headers = (const char *)memchr(stored, '\n', hdrSize);
+    size_t clLen = sizeof("Content-Length:") - 1 + CL_WIDTH + 2;
+    if (headers == NULL || (size_t)(++headers - stored) + clLen + 2 > hdrSize) {
+        return 0;
+    }
+    size_t headersLen = hdrSize - (size_t)(headers - stored) - clLen - 2;
+    int n = snprintf(out, size, "%.8s 206 Partial Content\r\n", stored);
+    if (n < 0 || (size_t)n + headersLen >= size) {
+        return 0;
+    }
+    size_t outLen = (size_t)n;
+    memcpy(out + outLen, headers, headersLen);
+    outLen += headersLen;
+    n = snprintf(out + outLen, size - outLen,
+                 "Content-Range: bytes %" PRIu64 "-%" PRIu64 "/%" PRIu64
+                 "\r\nContent-Length: %" PRIu64 "\r\n",
+                 first, last, response_stored_length(stored, hdrSize),
+                 last - first + 1);
+    if (n < 0 || (size_t)n >= size - outLen) {
+        return 0;
+    }
+    return outLen + (size_t)n;
+}
+
+// whether the server said how long the response is fresh for.
+static bool has_explicit_expiry(const http_response_t *r) {
+    return r->maxAge >= 0 || r->expires != 0;
+}
+
+/*a helper working out for how long a response is fresh from when the server
+ *generated it: max-age, the time from Date to Expires, or a tenth of the time
+ *since Last-Modified as suggested by RFC 9111, in that order.*/
+static long freshness_lifetime(const http_response_t *r, time_t now) {
+    time_t date = r->date != 0 ? r->date : now;
+    if (r->maxAge >= 0) {
+        return r->maxAge;
+    }
+    if (r->expires != 0) {
+        return r->expires > date ? (long)(r->expires - date) : 0;
+    }
+    if (r->lastModified != 0) {
+        long since = r->lastModified < date ? (long)(date - r->lastModified)
+                                            : 0;
+        return since / 10 < RESP_HEURISTIC_MAX ? since / 10
+                                               : RESP_HEURISTIC_MAX;
+    }
+    return RESP_HEURISTIC_DEFAULT;
+}
+
+bool response_validatable(const http_response_t *r) {
+    return r->hasEtag || r->lastModified != 0;
+}
+
+long response_stale_while(const http_response_t *r, long dflt) {
+    if (r->noCache || r->mustRevalidate) {
+        return 0;
+    }
+    return r->staleWhile >= 0 ? r->staleWhile : dflt;
+}
+
+time_t response_expires(const http_response_t *r, time_t now) {
+    if (r->noCache) {
+        return now;
+    }
+    // the age when received, from Date or from caches on the way.
+    long age = r->date != 0 && r->date < now ? (long)(now - r->date) : 0;
+    age = r->age > age ? r->age : age;
+    long lifetime = freshness_lifetime(r, now);
+    return lifetime > age ? now + (lifetime - age) : now;
+}
+
+bool response_storable(const http_response_t *r, time_t now) {
+    if (r->noStore || r->status < 200 || r->status == 206 ||
+        r->status == 304) {
+        return false;
+    }
+    // the statuses RFC 9110 makes cacheable by default.
+    static const int heuristic[] = {200, 203, 204, 300, 301, 308,
+                                    404, 405, 410, 414, 501};
+    bool byDefault = false;
+    for (size_t i = 0; i < sizeof(heuristic) / sizeof(heuristic[0]); i++) {
+        byDefault = byDefault || r->status == heuristic[i];
+    }
+    if (!byDefault && !has_explicit_expiry(r)) {
+        return false;
+    }
+    return response_expires(r, now) > now || response_validatable(r);
+}
+
+time_t response_revalidated(const http_response_t *r, const char *stored,
+                            size_t storedLen, time_t now) {
+    if (has_explicit_expiry(r) || r->noCache) {
+        return response_expires(r, now);
+    }
+    http_response_t storedResp;
+    response_init(&storedResp);
+    response_feed(&storedResp, stored, storedLen);
+    if (storedResp.state == RESP_HEADERS || storedResp.state == RESP_ERROR) {
+        return response_expires(r, now);
+    }
+    // the stored lifetime, aged as of the 304.
+    storedResp.date = r->date;
+    storedResp.age = r->age;
+    return response_expires(&storedResp, now);
+}
+
+size_t response_conditional(const char *stored, size_t storedLen, char *out,
+                            size_t size) {
+    const char *end = stored + storedLen;
+    const char *line = stored;
+    size_t outLen = 0;
+    while (line < end) {
+        size_t lineLen;
+        const char *next = next_line(line, end, &lineLen);
+        const char *name = NULL;
+        size_t nameLen = 0;
+        if (header_is(line, lineLen, "ETag")) {
+            name = "If-None-Match";
+            nameLen = 4;
+        } else if (header_is(line, lineLen, "Last-Modified")) {
+            name = "If-Modified-Since";
+            nameLen = 13;
+        }
+        if (name != NULL) {
+            size_t valueLen = lineLen - nameLen - 1;
+            const char *value = trim_value(line + nameLen + 1, &valueLen);
+            int n = snprintf(out + outLen, size - outLen, "%s: %.*s\r\n", name,
+                             (int)valueLen, value);
+            if (n < 0 || (size_t)n >= size - outLen) {
+                return 0;
+            }
+            outLen += (size_t)n;
+        }
+        line = next;
+    }
+    return outLen;
+}
+
+size_t response_if_range(const char *stored, size_t storedLen, char *out,
+                         size_t size) {
+    const char *end = stored + storedLen;
+    const char *line = stored;
+    const char *value = NULL;
+    size_t valueLen = 0;
+    while (line < end) {
+        size_t lineLen;
+        const char *next = next_line(line, end, &lineLen);
+        size_t nameLen = 0;
+        if (header_is(line, lineLen, "ETag")) {
+            nameLen = 4;
+        } else if (header_is(line, lineLen, "Last-Modified") &&
+                   value == NULL) {
+            nameLen = 13;
+        }
+        if (nameLen > 0) {
+            size_t len = lineLen - nameLen - 1;
+            const char *v = trim_value(line + nameLen + 1, &len);
+            // a weak ETag can't be used, but a Last-Modified still can.
+            if (nameLen == 13 || len < 2 || strncmp(v, "W/", 2) != 0) {
+                value = v;
+                valueLen = len;
+            }
+            if (nameLen == 4 && value == v) {
+                break;
+            }
+        }
+        line = next;
+    }
+    if (value == NULL) {
+        return 0;
+    }
+    int n = snprintf(out, size, "If-Range: %.*s\r\n", (int)valueLen, value);
+    return n < 0 || (size_t)n >= size ? 0 : (size_t)n;
+}
+
+// the media types worth compressing, matched against the start of a
+// Content-Type, besides any ending in "+json" or "+xml".
+static const char *const compressible_types[] = {
+    "text/",           "application/json", "application/javascript",
+    "application/xml", "image/svg+xml"};
+
+/*a helper telling whether a Content-Type value names a compressible media
+ *type, ignoring its parameters.*/
+static bool type_compressible(const char *value, size_t len) {
+    const char *semi = (const char *)memchr(value, ';', len);
+    if (semi != NULL) {
+        len = (size_t)(semi - value);
+    }
+    value = trim_value(value, &len);
+    size_t ntypes = sizeof(compressible_types) / sizeof(compressible_types[0]);
+    for (size_t i = 0; i < ntypes; i++) {
+        size_t n = strlen(compressible_types[i]);
+        if (len >= n && strncasecmp(value, compressible_types[i], n) == 0) {
+            return true;
+        }
+    }
+    return (len > 5 && strncasecmp(value + len - 5, "+json", 5) == 0) ||
+           (len > 4 && strncasecmp(value + len - 4, "+xml", 4) == 0);
+}
+
+bool response_compressible(const char *stored, size_t hdrSize) {
+    if (hdrSize < 12 || strncmp(stored, "HTTP/", 5) != 0 ||
+        memcmp(stored + 8, " 200", 4) != 0) {
+        return false;
+    }
+    const char *end = stored + hdrSize;
+    const char *line = stored;
+    bool typed = false;
+    while (line < end) {
+        size_t lineLen;
+        const char *next = next_line(line, end, &lineLen);
+        const char *colon = (const char *)memchr(line, ':', lineLen);
+        size_t valueLen =
+            colon != NULL ? lineLen - (size_t)(colon + 1 - line) : 0;
+        if (header_is(line, lineLen, "Content-Encoding")) {
+            return false;
+        }
+        if (header_is(line, lineLen, "Cache-Control") &&
+            has_token(colon + 1, valueLen, "no-transform")) {
+            return false;
+        }
+        if (header_is(line, lineLen, "Content-Type")) {
+            typed = type_compressible(colon + 1, valueLen);
+        }
+        line = next;
+    }
+    return typed;
+}
+
+size_t response_encoded_header(const char *stored, size_t hdrSize,
+                               const char *coding, uint64_t length, char *out,
+                               size_t size) {
+    const char *end = stored + hdrSize;
+    const char *line = stored;
+    size_t outLen = 0;
+    bool varied = false;
+    while (line < end) {
+        size_t lineLen;
+        const char *next = next_line(line, end, &lineLen);
+        if (lineLen == 0) {
+            break; // the blank line
+        }
+        const char *value = line;
+        size_t valueLen = lineLen;
+        const char *prefix = "";
+        const char *suffix = "";
+        if (header_is(line, lineLen, "Content-Length")) {
+            line = next;
+            continue; // the variant's own goes last
+        }
+        if (header_is(line, lineLen, "ETag")) {
+            valueLen = lineLen - 5;
+            value = trim_value(line + 5, &valueLen);
+            bool weak = valueLen >= 2 && strncmp(value, "W/", 2) == 0;
+            prefix = weak ? "ETag: " : "ETag: W/";
+        } else if (header_is(line, lineLen, "Vary")) {
+            varied = true;
+            if (!has_token(line + 5, lineLen - 5, "Accept-Encoding")) {
+                suffix = ", Accept-Encoding";
+            }
+        }
+        int n = snprintf(out + outLen, size - outLen, "%s%.*s%s\r\n", prefix,
+                         (int)valueLen, value, suffix);
+        if (n < 0 || (size_t)n >= size - outLen) {
+            return 0;
+        }
+        outLen += (size_t)n;
+        line = next;
+    }
+    int n = snprintf(out + outLen, size - outLen,
+                     "Content-Encoding: %s\r\n%sContent-Length:%*" PRIu64
+                     "\r\n\r\n",
+                     coding, varied ? "" : "Vary: Accept-Encoding\r\n",
+                     CL_WIDTH, length);
+    if (n < 0 || (size_t)n >= size - outLen) {
+        return 0;
+    }
+    return outLen + (size_t)n;
+}
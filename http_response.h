@@ -0,0 +1,296 @@
+/*
+ * @file: http_response.h
+ * @brief: an incremental parser for the HTTP responses the proxy relays from
+ * web servers. The proxy feeds it response bytes as they arrive from a
+ * non-blocking socket. The parser buffers the header block, works out how the
+ * body is framed (Content-Length, chunked or until close) and then tracks the
+ * body without buffering it. That is what lets the proxy tell where a response
+ * ends on a persistent server connection, so the connection can be reused.
+ *
+ * Once the header block is complete the parser can produce two rewritten
+ * versions of it: the one relayed to the client, with hop-by-hop headers
+ * replaced by the proxy's own Connection header, and the one stored in the
+ * cache, which is always framed by Content-Length.
+ *
+ * The parser also picks up what a shared cache needs to know about the
+ * response (RFC 9111): whether it may be stored at all (Cache-Control,
+ * Vary), for how long it is fresh (Cache-Control max-age, Expires, Date,
+ * Age, or heuristically from Last-Modified), and whether it has validators
+ * (ETag, Last-Modified) to revalidate it with once stale, and for how long
+ * after that it may still be served while it is (stale-while-revalidate,
+ * RFC 5861).
+ *
+ * @Author Sanah Imani <simani@unix.andrew.cmu.edu>
+ */
+
+#ifndef __HTTP_RESPONSE_H__
+#define __HTTP_RESPONSE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define RESP_HDRBUF (8192 + 64) // max header block, plus room to rewrite it
+#define RESP_HEURISTIC_DEFAULT 60 // seconds a response without any freshness
+                                  // information or Last-Modified is fresh for
+#define RESP_HEURISTIC_MAX 86400 // most seconds a response is heuristically
+                                 // fresh for, from its Last-Modified
+
+/* The parts of a response the parser moves through. */
+typedef enum resp_state {
+    RESP_HEADERS, // reading the status line and headers
+    RESP_BODY,    // tracking the body
+    RESP_DONE,    // the response is complete
+    RESP_ERROR    // the response is malformed
+} resp_state;
+
+/* How the end of the response body is found. */
+typedef enum resp_framing {
+    FRAMING_NONE,    // no body (204, 304)
+    FRAMING_LENGTH,  // Content-Length bytes
+    FRAMING_CHUNKED, // chunked transfer coding
+    FRAMING_CLOSE    // until the server closes the connection
+} resp_framing;
+
+typedef struct http_response {
+    resp_state state;
+    char hdr[RESP_HDRBUF]; // the header block as received
+    size_t hdrLen;         // bytes in hdr
+    int status;            // the status code
+    bool keepAlive;        // whether the server will keep the connection open
+    resp_framing framing;  // how the body is framed
+    uint64_t length;       // Content-Length, when framing is FRAMING_LENGTH
+    uint64_t remaining;    // body (or current chunk) bytes still to come
+    int chunkState;        // position within the chunked framing
+    long maxAge;           // s-maxage or max-age in seconds, -1 if neither
+    time_t expires;        // Expires, 0 if none, 1 if invalid (expired)
+    time_t date;           // Date, 0 if none
+    time_t lastModified;   // Last-Modified, 0 if none
+    long age;              // Age in seconds, 0 if none
+    bool noStore;          // Cache-Control no-store or private, or Vary: *
+    bool noCache;          // Cache-Control no-cache, revalidate every use
+    bool mustRevalidate;   // Cache-Control must-revalidate or proxy-revalidate
+    bool hasEtag;          // whether there is an ETag
+    long staleWhile;       // Cache-Control stale-while-revalidate in seconds,
+                           // -1 if none
+} http_response_t;
+
+/* resetting a parser for the next response.
+ *
+ * @params[out] r the parser
+ */
+void response_init(http_response_t *r);
+
+/* feeding the parser the next bytes read from the server.
+ *
+ * Header bytes are copied into r->hdr. Parsing stops right after the header
+ * block, so the caller can send the rewritten header before any body bytes,
+ * and at the end of the response, so the caller can spot a server sending
+ * more than it should have.
+ *
+ * @params[in] r the parser
+ * @params[in] buf the bytes read from the server
+ * @params[in] len the number of bytes in buf
+ *
+ * @return the number of bytes of buf that belong to the response
+ */
+size_t response_feed(http_response_t *r, const char *buf, size_t len);
+
+/* accounting for body bytes relayed without being fed to the parser, such as
+ * those spliced from socket to socket. Only for bodies framed by length or by
+ * the close, whose bytes the parser has no need to look at.
+ *
+ * @params[in] r the parser
+ * @params[in] len the number of body bytes relayed
+ */
+void response_consumed(http_response_t *r, size_t len);
+
+/* telling the parser the server closed the connection. This completes a
+ * response framed by the close and is an error for any other.
+ *
+ * @params[in] r the parser
+ */
+void response_eof(http_response_t *r);
+
+/* building the header block to relay to the client. The status line and end
+ * to end headers are kept as received, and hop-by-hop headers are replaced
+ * with "Connection: <connection>".
+ *
+ * @params[in] r a parser past RESP_HEADERS
+ * @params[out] out where the header block is written, may be r->hdr itself
+ * @params[in] size the size of out
+ * @params[in] connection the value of the Connection header to add
+ *
+ * @return the length of the header block, 0 if it doesn't fit in out.
+ */
+size_t response_client_header(http_response_t *r, char *out, size_t size,
+                              const char *connection);
+
+/* building the header block stored in the cache. It has no hop-by-hop
+ * headers and the framing headers are replaced by a Content-Length: whose
+ * space-padded value is filled in by response_finish_stored() once the body is
+ * complete. The header block can thus be written before the body arrives.
+ *
+ * @params[in] r a parser past RESP_HEADERS
+ * @params[out] out where the header block is written
+ * @params[in] size the size of out
+ *
+ * @return the length of the header block, 0 if it doesn't fit in out.
+ */
+size_t response_stored_header(http_response_t *r, char *out, size_t size);
+
+/* completing a response for the cache in place: obj holds the header block
+ * from response_stored_header() followed by the body as received. A chunked
+ * body is decoded, which only ever shrinks it, and the Content-Length value is
+ * filled in.
+ *
+ * @params[in] r the parser of the (complete) response
+ * @params[in,out] obj the stored header block and the body
+ * @params[in] hdrSize the length of the stored header block
+ * @params[in] len the total length of obj
+ *
+ * @return the length of the completed response
+ */
+size_t response_finish_stored(http_response_t *r, char *obj, size_t hdrSize,
+                              size_t len);
+
+/* reading the Content-Length of a stored header block, which is always its
+ * last header.
+ *
+ * @params[in] stored the stored header block
+ * @params[in] hdrSize its length
+ *
+ * @return the length of the body
+ */
+uint64_t response_stored_length(const char *stored, size_t hdrSize);
+
+/* building the header block of a 206 Partial Content answering a range
+ * request from a stored 200 response. Like the stored header block, it ends
+ * with its last header rather than the blank line, for the proxy to add its
+ * Connection header.
+ *
+ * @params[in] stored the stored header block
+ * @params[in] hdrSize its length
+ * @params[in] first the first byte of the body in the range
+ * @params[in] last the last byte of the body in the range
+ * @params[out] out where the header block is written
+ * @params[in] size the size of out
+ *
+ * @return the length of the header block, 0 if the stored response isn't a
+ * 200 or the header block doesn't fit in out.
+ */
+size_t response_range_header(const char *stored, size_t hdrSize,
+                             uint64_t first, uint64_t last, char *out,
+                             size_t size);
+
+/* whether a stored response is worth compressing on its way to clients: a
+ * 200 whose Content-Type is text, JSON, JavaScript, XML or SVG, which has no
+ * Content-Encoding already and doesn't forbid it with Cache-Control
+ * no-transform.
+ *
+ * @params[in] stored the stored header block
+ * @params[in] hdrSize its length
+ */
+bool response_compressible(const char *stored, size_t hdrSize);
+
+/* building the stored header block of a compressed variant of a stored
+ * response: its headers with "Content-Encoding: <coding>", Accept-Encoding
+ * added to Vary, an ETag made weak, as it names the other representation,
+ * and the variant's Content-Length, still as the last header.
+ *
+ * @params[in] stored the stored header block of the response
+ * @params[in] hdrSize its length
+ * @params[in] coding the content coding of the variant
+ * @params[in] length the length of the variant's body
+ * @params[out] out where the header block is written
+ * @params[in] size the size of out
+ *
+ * @return the length of the header block, 0 if it doesn't fit in out.
+ */
+size_t response_encoded_header(const char *stored, size_t hdrSize,
+                               const char *coding, uint64_t length, char *out,
+                               size_t size);
+
+/* whether a shared cache may store a response: its status is cacheable by
+ * default or it has explicit freshness, nothing forbids storing it, and it
+ * can be used at some point without going back to the server, or else be
+ * revalidated.
+ *
+ * @params[in] r a parser past RESP_HEADERS
+ * @params[in] now the current time
+ */
+bool response_storable(const http_response_t *r, time_t now);
+
+/* whether a response has an ETag or a Last-Modified to revalidate it with.
+ *
+ * @params[in] r a parser past RESP_HEADERS
+ */
+bool response_validatable(const http_response_t *r);
+
+/* working out for how long after going stale a response may still be served
+ * while it is revalidated in the background: stale-while-revalidate if the
+ * server gave it, or else dflt, unless the server wants every use revalidated.
+ *
+ * @params[in] r a parser past RESP_HEADERS
+ * @params[in] dflt the seconds for a response without stale-while-revalidate
+ *
+ * @return the seconds, 0 if it must not be served stale.
+ */
+long response_stale_while(const http_response_t *r, long dflt);
+
+/* working out when a response received now goes stale: its freshness
+ * lifetime less its current age.
+ *
+ * @params[in] r a parser past RESP_HEADERS
+ * @params[in] now the current time
+ *
+ * @return the time the response goes stale at, now or earlier if it must be
+ * revalidated before every use.
+ */
+time_t response_expires(const http_response_t *r, time_t now);
+
+/* working out when a stored response goes stale again once a 304 Not
+ * Modified has revalidated it. Freshness information in the 304 takes over
+ * from that of the stored header block.
+ *
+ * @params[in] r the parser of the 304 response
+ * @params[in] stored the stored header block of the response revalidated
+ * @params[in] storedLen the length of stored
+ * @params[in] now the current time
+ *
+ * @return the time the stored response goes stale at
+ */
+time_t response_revalidated(const http_response_t *r, const char *stored,
+                            size_t storedLen, time_t now);
+
+/* building the conditional request headers revalidating a stored response:
+ * If-None-Match for its ETag and If-Modified-Since for its Last-Modified.
+ *
+ * @params[in] stored the stored header block
+ * @params[in] storedLen the length of stored
+ * @params[out] out where the header lines are written, NUL-terminated
+ * @params[in] size the size of out
+ *
+ * @return the length of the header lines, 0 if there are none or they don't
+ * fit.
+ */
+size_t response_conditional(const char *stored, size_t storedLen, char *out,
+                            size_t size);
+
+/* building the If-Range header asking for a range of a stored response only
+ * if the server still has the same response: its ETag, unless a weak one, or
+ * else its Last-Modified.
+ *
+ * @params[in] stored the stored header block
+ * @params[in] storedLen the length of stored
+ * @params[out] out where the header line is written, NUL-terminated
+ * @params[in] size the size of out
+ *
+ * @return the length of the header line, 0 if the response has no validator
+ * usable in If-Range or the line doesn't fit.
+ */
+size_t response_if_range(const char *stored, size_t storedLen, char *out,
+                            size_t size);
+
+#endif /* __HTTP_RESPONSE_H__ */
@@ -0,0 +1,144 @@
+/*
+ * @file: inflight.c
+ * @brief: the table of keys being fetched, following the signature in
+ * inflight.h. Keys are chained into a hash table under a single mutex, which
+ * is only taken on cache misses and held for a table lookup.
+ *
+ * @Author Sanah Imani <simani@unix.andrew.cmu.edu>
+ */
+
+#include <inflight.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/* A key being fetched and the misses waiting for it. */
+typedef struct inflight_entry {
+    char *key;                    // the cache key
+    size_t keyLen;                // strlen(key)
+    uint64_t keyHash;             // its hash, as in cache_key_t
+    inflight_wait_t *waiters;     // misses waiting for the fetch to be over
+    struct inflight_entry *hnext; // next entry in the same hash bucket
+} inflight_entry_t;
+
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+static inflight_entry_t *buckets[INFLIGHT_BUCKETS];
+
+// the low bits of a key hash pick its bucket, as they do in a cache shard.
+static inflight_entry_t **bucket_of(const cache_key_t *key) {
+    return &buckets[key->hash & (INFLIGHT_BUCKETS - 1)];
+}
+
+// whether an entry is for a key, comparing the hashes and lengths first.
+static bool entry_is(const inflight_entry_t *e, const cache_key_t *key) {
+    return e->keyHash == key->hash && e->keyLen == key->len &&
+           memcmp(e->key, key->str, key->len) == 0;
+}
+
+int inflight_notify_init(inflight_notify_t *n) {
+    n->done = NULL;
+    pthread_mutex_init(&n->lock, NULL);
+    n->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return n->efd < 0 ? -1 : 0;
+}
+
+bool inflight_begin(const cache_key_t *key, inflight_wait_t *wait) {
+    inflight_entry_t **bucket = bucket_of(key);
+    pthread_mutex_lock(&table_lock);
+    for (inflight_entry_t *e = *bucket; e != NULL; e = e->hnext) {
+        if (entry_is(e, key)) {
+            if (wait != NULL) {
+                wait->next = e->waiters;
+                e->waiters = wait;
+            }
+            pthread_mutex_unlock(&table_lock);
+            return false;
+        }
+    }
+    inflight_entry_t *e = (inflight_entry_t *)malloc(sizeof(*e));
+    char *keyCopy = strdup(key->str);
+    if (e == NULL || keyCopy == NULL) {
+        // the miss is fetched all the same, just without company.
+        free(e);
+        free(keyCopy);
+        pthread_mutex_unlock(&table_lock);
+        return true;
+    }
+    e->key = keyCopy;
+    e->keyLen = key->len;
+    e->keyHash = key->hash;
+    e->waiters = NULL;
+    e->hnext = *bucket;
+    *bucket = e;
+    pthread_mutex_unlock(&table_lock);
+    return true;
+}
+
+// telling every waiter of a list that the fetch it waited for is over.
+static void notify_waiters(inflight_wait_t *wait) {
+    while (wait != NULL) {
+        inflight_wait_t *next = wait->next;
+        inflight_notify_t *n = wait->notify;
+        pthread_mutex_lock(&n->lock);
+        wait->next = n->done;
+        n->done = wait;
+        pthread_mutex_unlock(&n->lock);
+        uint64_t one = 1;
+        if (write(n->efd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            perror("write eventfd");
+        }
+        wait = next;
+    }
+}
+
+void inflight_end(const cache_key_t *key) {
+    inflight_entry_t **link = bucket_of(key);
+    pthread_mutex_lock(&table_lock);
+    while (*link != NULL && !entry_is(*link, key)) {
+        link = &(*link)->hnext;
+    }
+    inflight_entry_t *e = *link;
+    if (e == NULL) {
+        pthread_mutex_unlock(&table_lock);
+        return; // inflight_begin() had no memory for it
+    }
+    *link = e->hnext;
+    pthread_mutex_unlock(&table_lock);
+
+    notify_waiters(e->waiters);
+    free(e->key);
+    free(e);
+}
+
+void inflight_progress(const cache_key_t *key) {
+    inflight_entry_t **bucket = bucket_of(key);
+    pthread_mutex_lock(&table_lock);
+    inflight_entry_t *e = *bucket;
+    while (e != NULL && !entry_is(e, key)) {
+        e = e->hnext;
+    }
+    inflight_wait_t *waiters = NULL;
+    if (e != NULL) {
+        waiters = e->waiters;
+        e->waiters = NULL;
+    }
+    pthread_mutex_unlock(&table_lock);
+    notify_waiters(waiters);
+}
+
+inflight_wait_t *inflight_completed(inflight_notify_t *n) {
+    uint64_t count;
+    if (read(n->efd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("read eventfd");
+    }
+    pthread_mutex_lock(&n->lock);
+    inflight_wait_t *done = n->done;
+    n->done = NULL;
+    pthread_mutex_unlock(&n->lock);
+    return done;
+}
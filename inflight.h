@@ -0,0 +1,89 @@
+/*
+ * @file: inflight.h
+ * @brief: tracking of the cache misses currently being fetched from web
+ * servers, keyed by cache key. The first miss on a key fetches it, and later
+ * misses on the same key, from any worker, wait for that fetch to be over
+ * rather than each sending the server a request of their own. Once over, the
+ * response is usually in the cache, and the waiters are served from there.
+ * The waiters of a large object, cached in segments, are told as every
+ * segment is cached, so they are served while it is still being fetched.
+ * A thundering herd of clients after an eviction or a restart thus costs the
+ * server a single request.
+ *
+ * Waiters are told a fetch is over, as for host lookups, through the eventfd
+ * of their worker's inflight_notify_t.
+ *
+ * @Author Sanah Imani <simani@unix.andrew.cmu.edu>
+ */
+
+#ifndef __INFLIGHT_H__
+#define __INFLIGHT_H__
+
+#include <cache.h>
+#include <pthread.h>
+#include <stdbool.h>
+
+#define INFLIGHT_BUCKETS 256 // hash buckets of keys being fetched, power of 2
+
+struct inflight_wait;
+
+/* Where a worker is told about the fetches it waited for. */
+typedef struct inflight_notify {
+    int efd;                    // eventfd readable when done isn't empty
+    pthread_mutex_t lock;       // protects done
+    struct inflight_wait *done; // the waits that are over
+} inflight_notify_t;
+
+/* A miss waiting for another fetch of its key, usually in a connection. */
+typedef struct inflight_wait {
+    inflight_notify_t *notify;  // where to report the end of the fetch
+    void *owner;                // whoever is waiting
+    struct inflight_wait *next; // link in a waiter list or the done list
+} inflight_wait_t;
+
+/* setting up the notifications of one worker.
+ *
+ * @params[out] n the notifications, whose efd is registered with epoll
+ *
+ * @return -1 if the eventfd could not be created, 0 otherwise.
+ */
+int inflight_notify_init(inflight_notify_t *n);
+
+/* starting to fetch a key that missed in the cache, unless it is already
+ * being fetched, in which case wait is added to the fetch's waiters.
+ *
+ * @params[in] key the cache key
+ * @params[in,out] wait the wait, with notify and owner set, or NULL for a
+ * fetch that isn't worth waiting for, such as a background refresh, which is
+ * just not started if the key is already being fetched
+ *
+ * @return true if the caller is to fetch the key and then call
+ * inflight_end(), false if it is to wait.
+ */
+bool inflight_begin(const cache_key_t *key, inflight_wait_t *wait);
+
+/* ending the fetch of a key, whether its response was cached or not. Every
+ * waiter is told the fetch is over.
+ *
+ * @params[in] key the cache key passed to inflight_begin()
+ */
+void inflight_end(const cache_key_t *key);
+
+/* telling the waiters of a fetch still under way that more of its response
+ * has been cached, as the segments of a large object are while it is
+ * fetched. The waiters can be served that much, and wait again with
+ * inflight_begin() for the rest.
+ *
+ * @params[in] key the cache key passed to inflight_begin()
+ */
+void inflight_progress(const cache_key_t *key);
+
+/* taking the waits of a worker that are over, once its efd is readable.
+ *
+ * @params[in] n the notifications
+ *
+ * @return the waits that are over, linked by next.
+ */
+inflight_wait_t *inflight_completed(inflight_notify_t *n);
+
+#endif /* __INFLIGHT_H__ */
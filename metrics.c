@@ -0,0 +1,191 @@
+/*
+ * @file: metrics.c
+ * @brief: the per-worker counters and their Prometheus text rendering,
+ * following the signature in metrics.h. The sets of counters are chained in
+ * a list, only ever added to, which is walked when scraped.
+ *
+ * @Author Sanah Imani <simani@unix.andrew.cmu.edu>
+ */
+
+#include <metrics.h>
+
+#include <cache.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// the upper bounds of the finite buckets of the connect histogram, in
+// microseconds.
+static const uint64_t connect_bounds[METRICS_BUCKETS] = {
+    50,     100,    250,     500,     1000,    2500,    5000,    10000,
+    25000,  50000,  100000,  250000,  500000,  1000000, 2500000, 5000000};
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static metrics_t *registry = NULL; // every set of counters registered
+
+void metrics_register(metrics_t *m) {
+    for (int i = 0; i < METRICS; i++) {
+        atomic_init(&m->counters[i], 0);
+    }
+    for (int i = 0; i <= METRICS_BUCKETS; i++) {
+        atomic_init(&m->connectBuckets[i], 0);
+    }
+    atomic_init(&m->connectSum, 0);
+    pthread_mutex_lock(&registry_lock);
+    m->next = registry;
+    registry = m;
+    pthread_mutex_unlock(&registry_lock);
+}
+
+uint64_t metrics_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+// adding to a counter that isn't in counters[], as metrics_add() does.
+static void counter_add(atomic_uint_fast64_t *counter, uint64_t n) {
+    atomic_store_explicit(
+        counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+        memory_order_relaxed);
+}
+
+void metrics_observe_connect(metrics_t *m, uint64_t us) {
+    int bucket = 0;
+    while (bucket < METRICS_BUCKETS && us > connect_bounds[bucket]) {
+        bucket++;
+    }
+    counter_add(&m->connectBuckets[bucket], 1);
+    counter_add(&m->connectSum, us);
+}
+
+/* The text being rendered. */
+typedef struct render {
+    char *buf;   // where the text goes
+    size_t size; // the size of buf
+    size_t len;  // bytes written so far
+    bool full;   // whether some of it didn't fit
+} render_t;
+
+// adding a formatted line to the text.
+static void render_line(render_t *r, const char *fmt, ...) {
+    if (r->full) {
+        return;
+    }
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(r->buf + r->len, r->size - r->len, fmt, ap);
+    va_end(ap);
+    if (n < 0 || (size_t)n >= r->size - r->len) {
+        r->full = true;
+        return;
+    }
+    r->len += (size_t)n;
+}
+
+// a counter summed over every worker.
+static uint64_t metrics_sum(enum metric which) {
+    uint64_t sum = 0;
+    for (metrics_t *m = registry; m != NULL; m = m->next) {
+        sum += atomic_load_explicit(&m->counters[which], memory_order_relaxed);
+    }
+    return sum;
+}
+
+/* The counters rendered as they are, so many of them labelled. */
+typedef struct metric_info {
+    enum metric which; // the counter
+    const char *name;  // the name of the metric it is rendered as
+    const char *label; // its labels, NULL for none
+} metric_info_t;
+
+static const metric_info_t counter_info[] = {
+    {METRIC_ACCEPTED, "proxy_connections_accepted_total", NULL},
+    {METRIC_SHED, "proxy_connections_shed_total", NULL},
+    {METRIC_REQUESTS, "proxy_requests_total", NULL},
+    {METRIC_HITS, "proxy_cache_requests_total", "result=\"hit\""},
+    {METRIC_MISSES, "proxy_cache_requests_total", "result=\"miss\""},
+    {METRIC_COALESCED, "proxy_cache_requests_total", "result=\"coalesced\""},
+    {METRIC_BYPASSED, "proxy_cache_requests_total", "result=\"bypass\""},
+    {METRIC_REVALIDATED, "proxy_cache_revalidations_total", NULL},
+    {METRIC_COMPRESSED, "proxy_cache_compressed_hits_total", NULL},
+    {METRIC_CACHE_BYTES, "proxy_response_bytes_total", "source=\"cache\""},
+    {METRIC_ORIGIN_BYTES, "proxy_response_bytes_total", "source=\"origin\""},
+    {METRIC_CONNECTS, "proxy_upstream_connections_total", "result=\"new\""},
+    {METRIC_REUSED, "proxy_upstream_connections_total", "result=\"reused\""},
+    {METRIC_CONNECT_ERRORS, "proxy_upstream_connections_total",
+     "result=\"failed\""},
+};
+
+size_t metrics_render(char *buf, size_t size) {
+    render_t r = {buf, size, 0, false};
+    pthread_mutex_lock(&registry_lock);
+    size_t ninfo = sizeof(counter_info) / sizeof(counter_info[0]);
+    for (size_t i = 0; i < ninfo; i++) {
+        const metric_info_t *info = &counter_info[i];
+        // a name is typed once, ahead of the first of its series.
+        if (i == 0 || strcmp(counter_info[i - 1].name, info->name) != 0) {
+            render_line(&r, "# TYPE %s counter\n", info->name);
+        }
+        if (info->label != NULL) {
+            render_line(&r, "%s{%s} %" PRIu64 "\n", info->name, info->label,
+                        metrics_sum(info->which));
+        } else {
+            render_line(&r, "%s %" PRIu64 "\n", info->name,
+                        metrics_sum(info->which));
+        }
+    }
+    uint64_t accepted = metrics_sum(METRIC_ACCEPTED);
+    uint64_t closed = metrics_sum(METRIC_CLOSED);
+    render_line(&r, "# TYPE proxy_connections_active gauge\n"
+                    "proxy_connections_active %" PRIu64 "\n",
+                accepted > closed ? accepted - closed : 0);
+
+    // the histogram's buckets are cumulative.
+    render_line(&r, "# TYPE proxy_upstream_connect_seconds histogram\n");
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    for (int b = 0; b <= METRICS_BUCKETS; b++) {
+        for (metrics_t *m = registry; m != NULL; m = m->next) {
+            count += atomic_load_explicit(&m->connectBuckets[b],
+                                          memory_order_relaxed);
+        }
+        if (b < METRICS_BUCKETS) {
+            render_line(&r,
+                        "proxy_upstream_connect_seconds_bucket{le=\"%g\"} "
+                        "%" PRIu64 "\n",
+                        connect_bounds[b] / 1e6, count);
+        } else {
+            render_line(&r,
+                        "proxy_upstream_connect_seconds_bucket{le=\"+Inf\"} "
+                        "%" PRIu64 "\n",
+                        count);
+        }
+    }
+    for (metrics_t *m = registry; m != NULL; m = m->next) {
+        sum += atomic_load_explicit(&m->connectSum, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&registry_lock);
+    render_line(&r,
+                "proxy_upstream_connect_seconds_sum %.6f\n"
+                "proxy_upstream_connect_seconds_count %" PRIu64 "\n",
+                sum / 1e6, count);
+
+    cache_stats_t stats;
+    cache_stats(&stats);
+    render_line(&r,
+                "# TYPE proxy_cache_size_bytes gauge\n"
+                "proxy_cache_size_bytes %zu\n"
+                "# TYPE proxy_cache_capacity_bytes gauge\n"
+                "proxy_cache_capacity_bytes %zu\n"
+                "# TYPE proxy_cache_objects gauge\n"
+                "proxy_cache_objects %zu\n"
+                "# TYPE proxy_cache_evictions_total counter\n"
+                "proxy_cache_evictions_total %" PRIu64 "\n",
+                stats.size, stats.capacity, stats.objects, stats.evictions);
+    return r.full ? 0 : r.len;
+}
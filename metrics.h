@@ -0,0 +1,96 @@
+/*
+ * @file: metrics.h
+ * @brief: counters of what the proxy does, exposed in the Prometheus text
+ * format to a client asking the proxy itself for METRICS_PATH. Every worker
+ * has a set of counters of its own, on cache lines of its own, which only its
+ * thread ever adds to, so recording an event is a load and a store with no
+ * lock and no cache line bouncing between cores. The counters of every worker
+ * are only summed up when scraped, along with the size of the cache and the
+ * evictions of its shards.
+ *
+ * Host connection times go into a histogram with fixed buckets, kept the same
+ * way.
+ *
+ * @Author Sanah Imani <simani@unix.andrew.cmu.edu>
+ */
+
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define METRICS_PATH "/metrics" // the path a client scrapes the metrics from
+#define METRICS_BUCKETS 16      // finite buckets of the connect histogram
+
+/* The counters of a worker. */
+enum metric {
+    METRIC_ACCEPTED,      // client connections accepted
+    METRIC_CLOSED,        // client connections closed
+    METRIC_SHED,          // client connections turned away with a 503
+    METRIC_REQUESTS,      // client requests
+    METRIC_HITS,          // cacheable requests answered from the cache
+    METRIC_MISSES,        // cacheable requests fetched from the server
+    METRIC_COALESCED,     // cacheable requests that waited for another fetch
+    METRIC_BYPASSED,      // requests that can't be answered from the cache
+    METRIC_REVALIDATED,   // stale objects the server said are still good
+    METRIC_COMPRESSED,    // hits served a compressed variant
+    METRIC_CACHE_BYTES,   // body bytes served from the cache
+    METRIC_ORIGIN_BYTES,  // bytes read from servers
+    METRIC_CONNECTS,      // new connections to servers
+    METRIC_REUSED,        // requests sent over a pooled server connection
+    METRIC_CONNECT_ERRORS, // connections to servers that failed
+    METRICS
+};
+
+/* The counters of one worker, written by its thread alone. */
+typedef struct metrics {
+    atomic_uint_fast64_t counters[METRICS]; // by enum metric
+    // server connection times, by bucket, the last one having no upper bound
+    atomic_uint_fast64_t connectBuckets[METRICS_BUCKETS + 1];
+    atomic_uint_fast64_t connectSum; // the sum of the times, in microseconds
+    struct metrics *next;            // the next set of counters registered
+} __attribute__((aligned(64))) metrics_t;
+
+/* adding a set of counters to those scraped. The counters are zeroed.
+ *
+ * @params[out] m the counters, which must never go away
+ */
+void metrics_register(metrics_t *m);
+
+/* adding to a counter, from the thread owning it, with no atomic
+ * read-modify-write, as no other thread adds to it.
+ *
+ * @params[in] m the counters
+ * @params[in] which the counter
+ * @params[in] n how much to add
+ */
+static inline void metrics_add(metrics_t *m, enum metric which, uint64_t n) {
+    atomic_uint_fast64_t *counter = &m->counters[which];
+    atomic_store_explicit(
+        counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+        memory_order_relaxed);
+}
+
+/* the current time in microseconds, from the monotonic clock. */
+uint64_t metrics_clock(void);
+
+/* recording how long a connection to a server took, from the thread owning
+ * the counters.
+ *
+ * @params[in] m the counters
+ * @params[in] us the time it took in microseconds
+ */
+void metrics_observe_connect(metrics_t *m, uint64_t us);
+
+/* writing every metric out in the Prometheus text format.
+ *
+ * @params[out] buf where the metrics go
+ * @params[in] size the size of buf
+ *
+ * @return the length of the text, or 0 if it doesn't fit.
+ */
+size_t metrics_render(char *buf, size_t size);
+
+#endif /* __METRICS_H__ */
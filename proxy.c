@@ -8,71 +8,281 @@
  * server, reads the server's response, then forwards the response to the
  * client.
  *
+ * Concurrency comes from a fixed pool of worker threads, one per core. Each
+ * worker runs an epoll event loop over non-blocking sockets and moves every
+ * connection it accepted through a small state machine (read request, resolve,
+ * connect, send request, relay response / serve from cache), so memory and
+ * scheduling cost stay flat as the number of concurrent clients rises. Host
+ * lookups are handed to the resolver threads, so a slow DNS server never
+ * stalls an event loop. Once a response has outgrown the cache's object limit
+ * it can't be cached, so the rest of it is moved socket to pipe to socket with
+ * splice() and never enters user space.
+ *
+ * Server connections are persistent: responses are framed by their
+ * Content-Length or chunked coding rather than by the server closing the
+ * connection, and once one has been relayed in full the connection is parked
+ * in the worker's pool for the next miss on the same origin. Client
+ * connections are persistent too, and pipelined requests on them are answered
+ * in order.
+ *
+ * Cached responses go stale as their freshness headers say, and are then
+ * revalidated with the server. One that went stale only recently may still be
+ * served right away while a refresh, a connection of its own with no client,
+ * revalidates it in the background.
+ *
+ * Responses too large to be cached whole are cached in segments as they are
+ * relayed, and other clients asking for them are served each segment as soon
+ * as it is cached. A request for a single range of bytes of a cached response
+ * is answered from the cache with a 206, from whichever segments hold it.
+ *
+ * The number of open client connections may be capped. A worker holds on to
+ * clients accepted over the cap until others close, and sheds them with a 503
+ * once it holds ADMIT_QUEUE of them or one has waited ADMIT_WAIT_MS. Each
+ * worker may listen on a socket of its own, bound with SO_REUSEPORT.
+ *
+ * Cached text responses may be compressed once, in the background, and their
+ * gzip variants served to clients accepting gzip, see compress.h.
+ *
+ * The cache may be warmed up at startup from a snapshot another proxy wrote
+ * on SIGUSR1, see snapshot.h, and from a list of URLs fetched through the
+ * proxy itself.
+ *
+ * A client asking the proxy itself for METRICS_PATH is answered with the
+ * counters of every worker, see metrics.h.
+ *
  * @author: Sanah Imani <simani@unix.andrew.cmu.edu>
  */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // accept4()
+#endif
 #include "csapp.h"
 
 #include <assert.h>
 #include <cache.h>
+#include <compress.h>
 #include <ctype.h>
-#include <http_parser.h>
+#include <http_request.h>
+#include <http_response.h>
+#include <inflight.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <metrics.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <unistd.h>
+#include <upstream.h>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
+#include <resolver.h>
 #include <signal.h>
+#include <snapshot.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <trace.h>
 
-/*
- * Max cache and object sizes
- * You might want to move these to the file containing your cache implementation
- */
-#define MAX_CACHE_SIZE (1024 * 1024)
-#define MAX_OBJECT_SIZE (100 * 1024)
-#define HOSTLEN 256
-#define SERVLEN 8
+#define MAX_EVENTS 64 // epoll events handled per event loop iteration
+#define SPLICE_CHUNK (64 * 1024) // bytes moved per splice(), a pipe's capacity
+#define CACHEBUF_MIN (16 * 1024)  // initial capacity of a response accumulator
+#define REQ_IOVS 12 // max pieces of a request for the server
+#define REQ_IOVS_TAIL 4 // pieces kept for the headers added at its end
+#define OUT_IOVS (REQ_IOVS + 1) // max buffers of pending output written with
+                                // one writev(): a request and its body
+#define ADMIT_QUEUE 256    // clients over the limit a worker holds on to
+#define ADMIT_WAIT_MS 1000 // how long a held client waits before it is shed
+#define ADMIT_RETRY_MS 10  // how often a worker holding clients retries them
+#define WARMUP_TIMEOUT 30  // seconds the warmup waits on a response
+
+/* A request method the proxy forwards. */
+typedef struct method_info {
+    const char *name; // as in the request line
+    bool safe;        // whether it leaves the resource as it is (RFC 9110)
+    bool idempotent;  // whether sending it twice does what sending it once
+                      // does, so it may be retried
+} method_info_t;
+
+static const method_info_t methods[] = {
+    {"GET", true, true},      {"OPTIONS", true, true},
+    {"PUT", false, true},     {"DELETE", false, true},
+    {"POST", false, false},   {"PATCH", false, false},
+};
+
+// finding a method by name, NULL if it isn't forwarded.
+static const method_info_t *method_lookup(const char *name, size_t len) {
+    for (size_t i = 0; i < sizeof(methods) / sizeof(methods[0]); i++) {
+        if (strncmp(methods[i].name, name, len) == 0 &&
+            methods[i].name[len] == '\0') {
+            return &methods[i];
+        }
+    }
+    return NULL;
+}
+
+
+/* The states a proxied connection moves through in the event loop. */
+typedef enum conn_state {
+    CONN_READ_REQUEST, // buffering the client request until its blank line
+    CONN_COALESCE,     // waiting for another fetch of the same request
+    CONN_RESOLVE,      // waiting for a resolver thread to look the server up
+    CONN_CONNECT,      // non-blocking connect to the server in progress
+    CONN_SEND_REQUEST, // writing the modified request to the server
+    CONN_SEND_BODY,    // streaming the request body from client to server
+    CONN_RELAY,        // relaying the server response to the client
+    CONN_SPLICE,       // relaying an uncacheable response through a pipe
+    CONN_SERVE_CACHE,  // writing a cached response to the client
+    CONN_CLOSED        // torn down, freed at the end of the event batch
+} conn_state;
+
+struct conn;
 
-/* for convenience */
-typedef struct sockaddr SA;
-/* Information about a connected client. */
-typedef struct {
-    struct sockaddr_in addr; // Socket address
-    socklen_t addrlen;       // Socket address length
-    int connfd;              // Client connection file descriptor
-    char host[HOSTLEN];      // Client host
-    char serv[SERVLEN];      // Client service (port)
-} client_info;
+/* One socket of a connection, as registered with epoll. */
+typedef struct conn_end {
+    int fd;            // the socket, -1 when not open
+    uint32_t events;   // epoll events currently registered (0 = none)
+    struct conn *conn; // the connection the socket belongs to
+} conn_end_t;
+
+/* A worker thread and its event loop. */
+typedef struct worker {
+    pthread_t tid;     // the worker thread
+    int epfd;          // the epoll instance of the event loop
+    int listenfd;      // the listening socket, shared by all workers unless
+                       // each has its own with SO_REUSEPORT
+    struct conn *dead; // connections closed during the current event batch
+    upstream_pool_t pool; // idle persistent connections to servers
+    resolver_notify_t resolved; // lookups of server hosts that have finished
+    inflight_notify_t coalesced; // waits for fetches of the same key, over
+    metrics_t metrics;    // the counters of what the worker does
+    trace_ring_t *trace;  // where its traced requests go, NULL if not traced
+    int heldFds[ADMIT_QUEUE]; // clients accepted over the limit, a ring
+    uint64_t heldSince[ADMIT_QUEUE]; // when each was accepted, in
+                                     // metrics_clock() microseconds
+    int heldFirst;        // the oldest held client in the ring
+    int heldCnt;          // clients held
+} worker_t;
+
+/* The state of a single proxied client request. */
+typedef struct conn {
+    conn_state state;
+    worker_t *worker;  // the worker owning every socket of the connection
+    conn_end_t client; // connfd: the accepted client connection
+    conn_end_t server; // clientfd: our connection to the web server
+    rio_t rio;         // buffered bytes of the client request
+    http_request_t req; // the parsed client request
+    cache_key_t key;   // the cache key, the request URI normalized in the
+                       // rio buffer
+    const method_info_t *method; // the request method
+    bool useCache;     // whether the request is answered from the cache and
+                       // its response cached: a GET without a body
+    bool ranged;       // whether the request asks for a range of the body
+    bool rangeSuffix;  // whether the range is the last rangeFirst bytes
+    uint64_t rangeFirst; // the first byte of the range
+    uint64_t rangeLast;  // its last byte, UINT64_MAX for the end of the body
+    const char *host;  // the server host (in req)
+    const char *port;  // the server port (in req)
+    inflight_wait_t coalesce;  // the wait for another fetch of key
+    bool fetching;             // whether key is in flight for this request
+    resolve_req_t lookup;      // the lookup of the server host
+    resolver_entry_t *dns;     // resolved server addresses (reference held)
+    struct addrinfo *nextAddr; // next server address to try connecting to
+    uint64_t connectStart;     // when the connect in progress started, in
+                               // metrics_clock() microseconds
+    bool reused;               // whether server.fd was taken from the pool
+    bool keepServer;           // whether server.fd may go back to the pool
+    bool keepClient;           // whether client.fd outlives the response
+    struct iovec outv[OUT_IOVS]; // pending output (request, relay, response)
+    int outCnt;                // buffers in outv
+    int outIdx;                // first buffer in outv not yet fully written
+    int outFd;                 // file to sendfile() after the buffers, or -1
+    off_t fileOff;             // next byte of outFd to send
+    size_t fileLen;            // bytes of outFd still to send
+    char request[MAXBUF];      // the rewritten parts of the request for the
+                               // server, the first of its pieces
+    struct iovec reqv[REQ_IOVS]; // the pieces of the request for the server
+    int reqCnt;                // pieces in reqv
+    char cond[MAXLINE];        // headers the proxy adds to the request for
+                               // the server: conditions revalidating stale,
+                               // and the range asked for
+    size_t condLen;            // bytes in cond
+    struct iovec bodyv;        // the start of the request body, buffered with
+                               // its header block
+    uint64_t bodyRest;         // bytes of the body following from the socket
+    uint64_t bodyLeft;         // of those, bytes not read yet
+    http_response_t resp;      // framing of the server response
+    char relay[MAXBUF];        // chunk of the server response being relayed
+    web_object_t *hit;         // the cached object being served, if any
+    web_object_t *stale;       // the stale cached object being revalidated
+    web_object_t *seg;         // the segment of a large c->hit being sent
+    uint64_t sendPos;          // next byte of the body of c->hit to send
+    uint64_t sendEnd;          // the byte after the last one to send
+    uint64_t segGen;           // the generation of the large object being
+                               // served or cached
+    uint64_t segNext;          // the index of the next segment to cache
+    cache_freshness_t segFresh; // the freshness of the large object cached
+    bool segmented;            // whether the response is cached in segments
+    bool filling;              // whether the server is asked for the part of
+                               // a large c->hit missing from the cache
+    uint64_t fillEnd;          // the byte after the last one of that part
+    uint64_t fillSkip;         // bytes of the body of the fill to drop, as
+                               // they have been written already
+    char *cacheBuf;            // server response accumulated for the cache
+    size_t cacheHdrLen;        // bytes of cacheBuf holding the stored header
+    size_t cacheLen;           // bytes in cacheBuf
+    size_t cacheCap;           // allocated size of cacheBuf
+    size_t totalBytesR;        // bytes read from the server so far
+    bool is_cacheable;         // whether the response may still be cached
+    int pipefd[2];             // pipe for the splice() relay, -1 if unused
+    size_t pipeLen;            // response bytes sitting in the pipe
+    trace_span_t span;         // the stages the request reached, if traced
+    struct conn *nextDead;     // link in the worker's dead list
+} conn_t;
 
 /*
- * String to use for the User-Agent header.
- * Don't forget to terminate with \r\n
+ * The headers added to the end of every request for the server, in place of
+ * the client's own User-Agent and Connection headers.
  */
-static const char *header_user_agent = "Mozilla/5.0"
-                                       " (X11; Linux x86_64; rv:3.10.0)"
-                                       " Gecko/20210731 Firefox/63.0.1";
+static char header_user_agent[] = "User-Agent: Mozilla/5.0"
+                                  " (X11; Linux x86_64; rv:3.10.0)"
+                                  " Gecko/20210731 Firefox/63.0.1\r\n";
+static char header_connection[] = "Connection: keep-alive\r\n";
+static char header_end[] = "\r\n";
+
+// seconds a response without stale-while-revalidate may be served stale for
+// while it is refreshed, set from the config.
+static long default_stale_while = 0;
+
+// the query parameters left out of cache keys, see request_cache_key(), set
+// from the config.
+static const char *cache_key_ignore = NULL;
 
-// freeing the parsing and closing necessary file descriptors.
-static void cleanup(int fd, int fd2, parser_t *p) {
+// whether hits are served the compressed variants of their responses to
+// clients accepting them, set from the config.
+static bool compress_hits = false;
+
+// the max number of open client connections, 0 for no limit, set from the
+// config, and the number open. Only counted when there is a limit.
+static int max_clients = 0;
+static atomic_int active_clients;
+
+// closing necessary file descriptors.
+static void cleanup(int fd, int fd2) {
     if (fd2 != -1) {
         close(fd2);
     }
     if (fd != -1) {
         close(fd);
     }
-    if (p != NULL) {
-        parser_free(p);
-    }
 }
 
 // a formal way to handle errors by writing back to the client (modified from
@@ -84,6 +294,10 @@ static void clienterror(int fd, const char *errnum, const char *shortmsg,
     size_t buflen;
     size_t bodylen;
 
+    if (fd < 0) {
+        return; // a background refresh has no client to tell
+    }
+
     /* Build the HTTP response body */
     bodylen = snprintf(body, MAXBUF,
                        "<!DOCTYPE html>\r\n"
@@ -122,264 +336,2808 @@ static void clienterror(int fd, const char *errnum, const char *shortmsg,
 }
 
 /*
- * read_requestline - using the rio package to read the client requestline of
- * the entire request by client. Performs necessary bad request error handling.
+ * request_iov_add - adding a piece to the request for the server. Once the
+ * pieces run out, the ones after the first are copied onto the end of it, in
+ * fBuf, which makes room again.
  *
- * @params[in] connfd the file descriptor with the client request
- * @params[in] rp a pointer to the rio_t object required for buffered reading of
- * lines.
- * @params[out] pars a pointer to the parser that stores and interprets each
- * line of the HTTP request.
- * @params[out] fBuf a final buffer containing the entire prxy-modified request.
- *
- * @return -1 is error occured.
- */
-static int read_requestline(int connfd, rio_t *rp, parser_t *pars,
-                            char *buffer) {
-    // read the line
-    if (rio_readlineb(rp, buffer, MAXLINE) <= 0)
-        return -1;
-    // parse the line
-    parser_state mPs = parser_parse_line(pars, buffer);
-    if (mPs != REQUEST) {
-        return -1;
+ * @return false if fBuf is full.
+ */
+static bool request_iov_add(struct iovec *iov, int *iovCnt, char *fBuf,
+                            char *base, size_t len) {
+    if (len == 0) {
+        return true;
     }
-    // checking if request is well-formed
-    char method[MAXLINE];
-    char uri[MAXLINE];
-    char version;
-
-    if (sscanf(buffer, "%s %s HTTP/1.%c\r\n", method, uri, &version) != 3 ||
-        (version != '0' && version != '1')) {
-        return -1;
+    if (*iovCnt == REQ_IOVS - REQ_IOVS_TAIL) {
+        size_t fLen = iov[0].iov_len;
+        for (int i = 1; i < *iovCnt; i++) {
+            if (fLen + iov[i].iov_len > MAXBUF) {
+                return false;
+            }
+            memcpy(fBuf + fLen, iov[i].iov_base, iov[i].iov_len);
+            fLen += iov[i].iov_len;
+        }
+        iov[0].iov_len = fLen;
+        *iovCnt = 1;
     }
+    iov[*iovCnt].iov_base = base;
+    iov[*iovCnt].iov_len = len;
+    (*iovCnt)++;
+    return true;
+}
+
+/*
+ * write_requestline - writing the request line for the server of a request
+ * with a known method into fBuf, asking for the path alone.
+ *
+ * @return -1 if it doesn't fit in MAXLINE, its length otherwise.
+ */
+static int write_requestline(const http_request_t *r, char *fBuf) {
+    // asking the server for the client's version, so that a 1.0 client is
+    // never sent a chunked response.
+    const char *path = request_at(r, r->path);
+    int n = snprintf(fBuf, MAXLINE, "%.*s %s%.*s HTTP/1.%c\r\n",
+                     (int)r->method.len, request_at(r, r->method),
+                     r->path.len > 0 && *path == '/' ? "" : "/",
+                     (int)r->path.len, path, r->version);
+    return n < MAXLINE ? n : -1;
+}
 
-    // only GET requests implemented
-    if (strcmp(method, "GET") != 0) {
+/*
+ * read_requestline - rewriting the request line of the request by the client
+ * into fBuf for the server, asking for the path alone.
+ *
+ * @params[in] connfd the file descriptor with the client request
+ * @params[in] r the parsed request
+ * @params[out] fBuf where the request line for the server goes.
+ *
+ * @return -1 is error occured, the length of the new request line otherwise.
+ */
+static int read_requestline(int connfd, const http_request_t *r, char *fBuf) {
+    // HEAD responses can't be framed like others, and CONNECT is a tunnel.
+    if (method_lookup(request_at(r, r->method), r->method.len) == NULL) {
         clienterror(connfd, "501", "Not Implemented",
                     "Server couldn't find this file");
         return -1;
     }
+    return write_requestline(r, fBuf);
+}
 
-    // ensure that there is a resource path
-    const char *mPath;
-    if (parser_retrieve(pars, PATH, &mPath) != 0) {
-        return -1;
+/*
+ * write_host - appending a Host header naming the server to the len bytes of
+ * the request in fBuf, a MAXBUF buffer, if the client sent none.
+ *
+ * @return false if it doesn't fit.
+ */
+static bool write_host(const http_request_t *r, char *fBuf, size_t *len) {
+    if (request_header(r, REQ_HDR_HOST) != NULL) {
+        return true;
+    }
+    size_t room = MAXBUF - *len;
+    bool v6 = strchr(r->host, ':') != NULL;
+    int n = snprintf(fBuf + *len, room, "Host: %s%s%s:%s\r\n",
+                     v6 ? "[" : "", r->host, v6 ? "]" : "", r->port);
+    if (n < 0 || (size_t)n >= room) {
+        return false;
     }
-    // only doing HTTP 1.0
-    int n = snprintf(buffer, MAXLINE, "%s %s HTTP/1.0\r\n", method, mPath);
-    return n;
+    *len += (size_t)n;
+    return true;
 }
+
 /*
- * read_request - using the rio package to read the client request line by line
- * and adding them to a buffer to be written to the server. The details of the
- * modifications and conditioning done is as per the proxylab requirements.
+ * read_request - rewriting the parsed client request header block for the
+ * server in a single pass. The request for the server is a list of pieces
+ * written with one writev(): the new request line (and Host header, if the
+ * client sent none) in fBuf, the runs of client headers forwarded as they
+ * are, straight from the rio buffer, and the headers the proxy adds. The
+ * details of the modifications and conditioning done is as per the proxylab
+ * requirements.
+ *
+ * The pieces point into the header block, which is only consumed from the
+ * rio buffer, not overwritten, until the next request is read.
  *
  * @params[in] connfd the file descriptor with the client request
- * @params[in] rp a pointer to the rio_t object required for buffered reading of
- * lines.
- * @params[out] pars a pointer to the parser that stores and interprets each
- * line of the HTTP request.
- * @params[out] fBuf a final buffer containing the entire prxy-modified request.
+ * @params[in] r the parsed request, naming a server.
+ * @params[out] fBuf a MAXBUF buffer for the rewritten parts of the request.
+ * @params[out] iov the REQ_IOVS pieces of the proxy-modified request.
+ * @params[out] iovCnt set to the number of pieces.
  *
  * @return true if an error occurred, or false otherwise.
  */
-static bool read_request(int connfd, rio_t *rp, parser_t *pars, char *fBuf) {
-    char buf[MAXLINE];
-    header_t *header;
-    int n;
-    if ((n = read_requestline(connfd, rp, pars, fBuf)) <= 0) {
+static bool read_request(int connfd, const http_request_t *r, char *fBuf,
+                         struct iovec *iov, int *iovCnt) {
+    int n = read_requestline(connfd, r, fBuf);
+    if (n < 0) {
         return true;
     }
-    while (true) {
-        if ((n = rio_readlineb(rp, buf, sizeof(buf))) <= 0) {
+    iov[0].iov_base = fBuf;
+    iov[0].iov_len = (size_t)n;
+    *iovCnt = 1;
+
+    // the run of forwarded header lines not yet added to iov, which starts
+    // after the request line.
+    char *base = r->base;
+    size_t run = r->nheaders > 0 ? r->headers[0].name.off : 0;
+    for (int i = 0; i < r->nheaders; i++) {
+        const req_header_t *h = &r->headers[i];
+        switch (h->known) {
+        case REQ_HDR_PROXY_CONNECTION:
+        case REQ_HDR_CONNECTION:
+        case REQ_HDR_KEEP_ALIVE:
+        case REQ_HDR_USER_AGENT:
+        case REQ_HDR_EXPECT:
+        case REQ_HDR_RANGE:
+        case REQ_HDR_IF_RANGE:
+            if (!request_iov_add(iov, iovCnt, fBuf, base + run,
+                                 h->name.off - run)) {
+                return true;
+            }
+            run = h->end;
+            break;
+        default:
+            // forwarding the other headers as is.
+            break;
+        }
+    }
+    size_t end = r->nheaders > 0 ? r->headers[r->nheaders - 1].end : 0;
+    if (!request_iov_add(iov, iovCnt, fBuf, base + run, end - run)) {
+        return true;
+    }
+
+    // adding the required headers. Host goes at the end of the first piece,
+    // which is still among the headers.
+    if (!write_host(r, fBuf, &iov[0].iov_len)) {
+        return true;
+    }
+    // the server connection is pooled once the response is read.
+    iov[(*iovCnt)++] = (struct iovec){header_user_agent,
+                                      sizeof(header_user_agent) - 1};
+    iov[(*iovCnt)++] = (struct iovec){header_connection,
+                                      sizeof(header_connection) - 1};
+    iov[(*iovCnt)++] = (struct iovec){header_end, sizeof(header_end) - 1};
+    return false;
+}
+
+// taking one of the max_clients slots for a new client, if one is free.
+static bool admit_slot(void) {
+    if (max_clients == 0) {
+        return true;
+    }
+    int n = atomic_load_explicit(&active_clients, memory_order_relaxed);
+    while (n < max_clients) {
+        if (atomic_compare_exchange_weak_explicit(&active_clients, &n, n + 1,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed)) {
             return true;
         }
+    }
+    return false;
+}
 
-        /* Check for end of request headers */
-        if (strcmp(buf, "\r\n") == 0) {
-            // adding the four required headers
-            if ((header = parser_lookup_header(pars, "Host")) == NULL) {
-                const char *mHost;
-                const char *mPort;
-                if (parser_retrieve(pars, HOST, &mHost) != 0) {
-                    return true;
-                }
+// giving back the slot of a client connection being closed.
+static void admit_release(void) {
+    if (max_clients > 0) {
+        atomic_fetch_sub_explicit(&active_clients, 1, memory_order_relaxed);
+    }
+}
 
-                if (parser_retrieve(pars, PORT, &mPort) != 0) {
-                    return true;
-                }
-                sprintf(buf, "Host: %s:%s\r\n", mHost, mPort);
-                fBuf = strncat(fBuf, buf, MAXLINE);
+/*
+ * conn_new - allocating the state for a freshly accepted client connection.
+ * The connection starts out waiting for the client's request.
+ *
+ * @params[in] w the worker whose event loop will own the connection.
+ * @params[in] connfd the non-blocking client connection file descriptor.
+ *
+ * @return the new connection, or NULL if out of memory.
+ */
+static conn_t *conn_new(worker_t *w, int connfd) {
+    conn_t *c = (conn_t *)calloc(1, sizeof(conn_t));
+    if (c == NULL) {
+        return NULL;
+    }
+    request_init(&c->req);
+    c->state = CONN_READ_REQUEST;
+    c->worker = w;
+    c->client.fd = connfd;
+    c->client.conn = c;
+    c->server.fd = -1;
+    c->server.conn = c;
+    c->pipefd[0] = -1;
+    c->pipefd[1] = -1;
+    c->coalesce.notify = &w->coalesced;
+    c->coalesce.owner = c;
+    c->lookup.notify = &w->resolved;
+    c->lookup.owner = c;
+    rio_readinitb(&c->rio, connfd);
+    if (connfd >= 0) {
+        trace_begin(w->trace, &c->span);
+    }
+    return c;
+}
+
+// the outcome of the fetch is known, so the misses waiting on it can move on.
+static void conn_fetch_over(conn_t *c) {
+    if (c->fetching) {
+        c->fetching = false;
+        inflight_end(&c->key);
+    }
+}
+
+/*
+ * conn_close - tearing down a connection. The conn_t itself is only freed once
+ * the worker has finished the current batch of epoll events, as the batch may
+ * still hold events for the other socket of the connection.
+ */
+static void conn_close(conn_t *c) {
+    if (c->state == CONN_CLOSED) {
+        return;
+    }
+    trace_end(c->worker->trace, &c->span, c->key.str);
+    conn_fetch_over(c);
+    if (c->client.fd >= 0) {
+        metrics_add(&c->worker->metrics, METRIC_CLOSED, 1);
+        admit_release();
+    }
+    // closing the sockets also removes them from the epoll interest list.
+    cleanup(c->client.fd, c->server.fd);
+    if (c->dns != NULL) {
+        resolver_release(c->dns);
+    }
+    if (c->pipefd[0] != -1) {
+        close(c->pipefd[0]);
+        close(c->pipefd[1]);
+    }
+    if (c->hit != NULL) {
+        release_cache_obj(c->hit);
+    }
+    if (c->stale != NULL) {
+        release_cache_obj(c->stale);
+    }
+    if (c->seg != NULL) {
+        release_cache_obj(c->seg);
+    }
+    free(c->cacheBuf);
+    c->state = CONN_CLOSED;
+    c->nextDead = c->worker->dead;
+    c->worker->dead = c;
+}
+
+/*
+ * set_interest - changing the epoll events we wait for on one socket of a
+ * connection. Interest of 0 removes the socket from the epoll set altogether
+ * so that a hung up peer we are not currently servicing doesn't spin the loop.
+ *
+ * @return -1 if epoll_ctl failed, 0 otherwise.
+ */
+static int set_interest(conn_t *c, conn_end_t *end, uint32_t events) {
+    if (end->events == events) {
+        return 0;
+    }
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = end;
+    int op = EPOLL_CTL_MOD;
+    if (end->events == 0) {
+        op = EPOLL_CTL_ADD;
+    } else if (events == 0) {
+        op = EPOLL_CTL_DEL;
+    }
+    if (epoll_ctl(c->worker->epfd, op, end->fd, &ev) < 0) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    end->events = events;
+    return 0;
+}
+
+// adding another block of bytes to the pending output of the connection.
+static void conn_output_add(conn_t *c, char *buf, size_t len) {
+    assert(c->outCnt < OUT_IOVS);
+    if (len > 0) {
+        c->outv[c->outCnt].iov_base = buf;
+        c->outv[c->outCnt].iov_len = len;
+        c->outCnt++;
+    }
+}
+
+// pointing the pending output of the connection at a new block of bytes.
+static void conn_output(conn_t *c, char *buf, size_t len) {
+    c->outCnt = 0;
+    c->outIdx = 0;
+    c->outFd = -1;
+    c->fileLen = 0;
+    conn_output_add(c, buf, len);
+}
+
+// ending the pending output of the connection with len bytes of a file from
+// off, which are written with sendfile() instead of write().
+static void conn_output_fd(conn_t *c, int fd, off_t off, size_t len) {
+    c->outFd = fd;
+    c->fileOff = off;
+    c->fileLen = len;
+}
+
+// whether some of the pending output of the connection is still unwritten.
+static bool conn_output_pending(conn_t *c) {
+    return c->outIdx < c->outCnt || c->fileLen > 0;
+}
+
+/*
+ * conn_write - writing as much of the connection's pending output to one of
+ * its sockets as the socket will take without blocking. The buffers go out
+ * together with writev(), so a response header and its body don't cost a
+ * system call (or a packet) each.
+ *
+ * @return 1 once all of the pending output is written, 0 if the socket would
+ * block, and -1 on a write error.
+ */
+static int conn_write(conn_t *c, conn_end_t *end) {
+    while (c->outIdx < c->outCnt) {
+        ssize_t n = writev(end->fd, c->outv + c->outIdx, c->outCnt - c->outIdx);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
             }
-            sprintf(buf, "User-Agent: %s\r\n", header_user_agent);
-            fBuf = strncat(fBuf, buf, MAXLINE);
-            fBuf = strncat(fBuf, "Connection: close\r\n", MAXLINE);
-            fBuf = strncat(fBuf, "Proxy-Connection: close\r\n", MAXLINE);
-            fBuf = strncat(fBuf, "\r\n", MAXLINE);
-            return false;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
         }
-        parser_state ps = parser_parse_line(pars, buf);
-
-        // the request line has already be read. Only headers to be considered
-        // now.
-        if (ps == ERROR || ps == REQUEST) {
-            return true;
+        // skipping the buffers written in full, then into a partial one.
+        size_t left = (size_t)n;
+        while (c->outIdx < c->outCnt && left >= c->outv[c->outIdx].iov_len) {
+            left -= c->outv[c->outIdx].iov_len;
+            c->outIdx++;
         }
-        if (ps == HEADER) {
-            if ((header = parser_retrieve_next_header(pars)) != NULL) {
-                const char *name = header->name;
-                // forwarding the other headers as is.
-                if (strcmp(name, "Proxy-Connection") != 0 &&
-                    strcmp(name, "Connection") != 0 &&
-                    strcmp(name, "User-Agent") != 0) {
-                    fBuf = strncat(fBuf, buf, n);
-                }
+        if (left > 0) {
+            c->outv[c->outIdx].iov_base = (char *)c->outv[c->outIdx].iov_base +
+                                          left;
+            c->outv[c->outIdx].iov_len -= left;
+        }
+    }
+    while (c->fileLen > 0) {
+        ssize_t n = sendfile(end->fd, c->outFd, &c->fileOff, c->fileLen);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
             }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
         }
+        if (n == 0) {
+            return -1; // the file is shorter than it should be
+        }
+        c->fileLen -= (size_t)n;
     }
+    return 1;
 }
 
-void *threadRoutine(void *args) {
-    // detach each new thread, so that spare resources are automatically reaped
-    // upon thread exit.
-    pthread_detach(pthread_self());
-    // dereference
-    int connfd = *((int *)args);
-    free(args);
+static void conn_try_connect(conn_t *c);
+static void conn_send_request(conn_t *c);
+static void conn_send_body(conn_t *c);
+static void conn_await_response(conn_t *c);
+static void process_request(conn_t *c);
 
-    int clientfd;
-    char buffer[MAXBUF];
-    char cacheBuf[MAX_OBJECT_SIZE];
-    rio_t rio;
+// the stored header block of a cached response ends with our own Connection
+// header in place of its blank line.
+static char hit_keep_alive[] = "Connection: keep-alive\r\n\r\n";
+static char hit_close[] = "Connection: close\r\n\r\n";
 
-    // reading client request
-    rio_readinitb(&rio, connfd);
-    // http_parser creation
-    parser_t *mParser = parser_new();
+// the server connection is open, so start writing the request to it, with
+// the headers in cond ahead of the blank line ending it, its last piece.
+static void conn_start_request(conn_t *c) {
+    c->state = CONN_SEND_REQUEST;
+    conn_output(c, NULL, 0);
+    for (int i = 0; i < c->reqCnt - 1; i++) {
+        conn_output_add(c, c->reqv[i].iov_base, c->reqv[i].iov_len);
+    }
+    conn_output_add(c, c->cond, c->condLen);
+    conn_output_add(c, c->reqv[c->reqCnt - 1].iov_base,
+                    c->reqv[c->reqCnt - 1].iov_len);
+    conn_output_add(c, c->bodyv.iov_base, c->bodyv.iov_len);
+    c->bodyLeft = c->bodyRest;
+    conn_send_request(c);
+}
 
-    // parse through the whole request
-    if (read_request(connfd, &rio, mParser, buffer)) {
-        clienterror(connfd, "400", "Bad Request",
-                    "Received a malformed request");
-        cleanup(connfd, -1, mParser);
-        return NULL;
+// the lookup of the server has finished, so open a new connection to it.
+static void conn_resolved(conn_t *c) {
+    trace_mark(&c->span, TRACE_RESOLVED);
+    c->dns = c->lookup.entry;
+    c->lookup.entry = NULL;
+    if (c->dns == NULL || c->dns->error != 0) {
+        fprintf(stderr, "getaddrinfo failed (%s:%s): %s\n", c->host, c->port,
+                c->dns != NULL ? gai_strerror(c->dns->error) : "no lookup");
+        conn_close(c);
+        return;
     }
+    c->nextAddr = c->dns->addrs;
+    conn_try_connect(c);
+}
 
-    // host and port to open_clientfd and URI for the cache key
-    const char *mHost;
-    const char *mPort;
-    const char *mURI;
+// resolving the server, which only waits on a resolver thread if the
+// addresses aren't cached yet.
+static void conn_resolve(conn_t *c) {
+    c->state = CONN_RESOLVE;
+    if (resolver_lookup(c->host, c->port, &c->lookup)) {
+        conn_resolved(c);
+    }
+}
 
-    if (parser_retrieve(mParser, PORT, &mPort) != 0 ||
-        parser_retrieve(mParser, HOST, &mHost) != 0 ||
-        parser_retrieve(mParser, URI, &mURI) != 0) {
-        clienterror(connfd, "400", "Bad Request",
-                    "Received a malformed request");
-        cleanup(connfd, -1, mParser);
-        return NULL;
+/*
+ * conn_retry_fresh - a pooled connection may have been closed by the server
+ * just as we took it, which shows as a failed write or a response ending
+ * before its first byte. The request is then retried once over a new
+ * connection.
+ *
+ * @return true if the request is being retried, false if the failure stands.
+ */
+static bool conn_retry_fresh(conn_t *c) {
+    // a body already read from the client can't be sent again.
+    if (!c->reused || c->totalBytesR > 0 || c->bodyLeft < c->bodyRest) {
+        return false;
     }
+    set_interest(c, &c->server, 0);
+    close(c->server.fd);
+    c->server.fd = -1;
+    c->reused = false;
+    conn_resolve(c);
+    return true;
+}
 
-    // if possible we need to try and serve the client by looking through the
-    // cache and seeing if the request has already been cached.
-    if (serve_cache(connfd, mURI)) {
-        cleanup(connfd, -1, mParser);
-        return NULL;
+// whether the client asked for its connection to be kept open.
+static bool client_keep_alive(const http_request_t *r) {
+    bool http11 = r->version != '0';
+    const req_header_t *header = request_header(r, REQ_HDR_CONNECTION);
+    if (header == NULL) {
+        header = request_header(r, REQ_HDR_PROXY_CONNECTION);
     }
+    if (header == NULL) {
+        return http11;
+    }
+    if (request_value_is(r, header, "close")) {
+        return false;
+    }
+    return http11 || request_value_is(r, header, "keep-alive");
+}
 
-    // otherwise, open connection to server
-    clientfd = open_clientfd(mHost, mPort);
-    if (clientfd < 0) {
-        perror("connect");
-        cleanup(connfd, clientfd, mParser);
-        return NULL;
+/*
+ * conn_next_request - the response has been written in full and the client
+ * keeps its connection open, so get ready for its next request. The rio_t
+ * buffer is kept as it is, as it may already hold pipelined requests, which
+ * are answered one after the other in the order they were sent.
+ */
+static void conn_next_request(conn_t *c) {
+    trace_end(c->worker->trace, &c->span, c->key.str);
+    if (c->server.fd != -1) {
+        close(c->server.fd);
+        c->server.fd = -1;
+    }
+    c->server.events = 0;
+    if (c->hit != NULL) {
+        release_cache_obj(c->hit);
+        c->hit = NULL;
+    }
+    if (c->stale != NULL) {
+        release_cache_obj(c->stale);
+        c->stale = NULL;
     }
+    if (c->seg != NULL) {
+        release_cache_obj(c->seg);
+        c->seg = NULL;
+    }
+    c->sendPos = 0;
+    c->sendEnd = 0;
+    c->segmented = false;
+    free(c->cacheBuf);
+    c->cacheBuf = NULL;
+    c->cacheLen = 0;
+    c->cacheCap = 0;
+    c->cacheHdrLen = 0;
+    c->is_cacheable = false;
+    c->totalBytesR = 0;
+    c->reused = false;
+    c->keepServer = false;
+    c->key = (cache_key_t){NULL, 0, 0};
+    c->host = NULL;
+    c->port = NULL;
+    c->method = NULL;
+    c->useCache = false;
+    c->ranged = false;
+    c->filling = false;
+    c->condLen = 0;
+    c->bodyv = (struct iovec){NULL, 0};
+    c->bodyRest = 0;
+    c->bodyLeft = 0;
+    conn_output(c, NULL, 0);
+    request_init(&c->req);
+    c->state = CONN_READ_REQUEST;
+    trace_begin(c->worker->trace, &c->span);
+    if (request_feed(&c->req, c->rio.rio_bufptr, (size_t)c->rio.rio_cnt) >=
+        REQ_DONE) {
+        process_request(c);
+    } else if (set_interest(c, &c->client, EPOLLIN) < 0) {
+        conn_close(c);
+    }
+}
 
-    // writing to server with modified client request
-    if (rio_writen(clientfd, buffer, MAXBUF) < 0) {
-        clienterror(connfd, "500", "Server Error", "Cannot write to server");
-        cleanup(connfd, clientfd, mParser);
-        return NULL;
+// whether a cached object is the header block of a large object, whose body
+// is cached in segments.
+static bool cache_obj_large(web_object_t *obj) {
+    return obj->objSize == obj->hdrSize &&
+           response_stored_length(obj->object, obj->hdrSize) > 0;
+}
+
+/*
+ * conn_next_segment - adding the next segment of the large object in c->hit
+ * to the pending output, from sendPos up to sendEnd at most. The segment is
+ * held in c->seg until it has been written.
+ *
+ * @return false if the segment isn't cached.
+ */
+static bool conn_next_segment(conn_t *c) {
+    if (c->seg != NULL) {
+        release_cache_obj(c->seg);
+        c->seg = NULL;
+    }
+    uint64_t index = c->sendPos / CACHE_SEGMENT_SIZE;
+    size_t off = (size_t)(c->sendPos % CACHE_SEGMENT_SIZE);
+    web_object_t *seg = serve_cache_segment(&c->key, c->segGen, index);
+    if (seg == NULL) {
+        return false;
+    }
+    if (seg->objSize <= off) {
+        release_cache_obj(seg); // a last segment shorter than the header says
+        return false;
+    }
+    size_t len = seg->objSize - off;
+    if (len > c->sendEnd - c->sendPos) {
+        len = (size_t)(c->sendEnd - c->sendPos);
     }
+    if (!conn_output_pending(c)) {
+        conn_output(c, NULL, 0);
+    }
+    if (seg->bodyFd >= 0) {
+        conn_output_fd(c, seg->bodyFd, (off_t)off, len);
+    } else {
+        conn_output_add(c, seg->object + off, len);
+    }
+    c->seg = seg;
+    c->sendPos += len;
+    return true;
+}
 
-    rio_t rio2;
-    rio_readinitb(&rio2, clientfd);
-    int bytesR = 0;
-    int totalBytesR = 0;
-    bool is_cacheable = true;
-    int iter = 0;
+static void conn_fetch(conn_t *c);
 
-    // server responsed and bytes need to be sent to the client via connfd.
-    while ((bytesR = rio_readnb(&rio2, cacheBuf, MAX_OBJECT_SIZE)) > 0) {
-        if (rio_writen(connfd, cacheBuf, bytesR) <= 0) {
-            fprintf(stderr, "Could not write response to client");
+/*
+ * conn_segment_missing - the next segment of a large object being served
+ * isn't cached. While the object is being fetched, the segment is on its way,
+ * so the client waits for it. Otherwise it was evicted. If none of the object
+ * has been written to the client yet, the request is fetched as a miss would
+ * be. If some has, the server is asked for the bytes of the missing segment
+ * alone, provided it can be asked for them only if the object hasn't changed
+ * since, and other clients fetching the same key wait for this fill. The
+ * client has to be closed if it can't.
+ */
+static void conn_segment_missing(conn_t *c) {
+    if (!inflight_begin(&c->key, &c->coalesce)) {
+        c->state = CONN_COALESCE;
+        if (set_interest(c, &c->client, 0) < 0) {
+            conn_close(c);
         }
-        totalBytesR += bytesR;
-        // if too big we won't cache
-        if (totalBytesR > MAX_OBJECT_SIZE) {
-            is_cacheable = false;
+        return;
+    }
+    c->fetching = true;
+    if (c->seg != NULL) {
+        release_cache_obj(c->seg);
+        c->seg = NULL;
+    }
+    if (conn_output_pending(c)) {
+        release_cache_obj(c->hit);
+        c->hit = NULL;
+        conn_output(c, NULL, 0);
+        // a range is fetched for this client alone, see process_request().
+        if (c->ranged) {
+            conn_fetch_over(c);
         }
-        iter += 1;
+        conn_fetch(c);
+        return;
+    }
+    if (response_if_range(c->hit->object, c->hit->hdrSize, c->cond,
+                          sizeof(c->cond)) == 0) {
+        fprintf(stderr, "Segment of %s evicted while being served\n",
+                c->key.str);
+        conn_close(c);
+        return;
     }
+    uint64_t segEnd = (c->sendPos / CACHE_SEGMENT_SIZE + 1) *
+                      CACHE_SEGMENT_SIZE;
+    c->filling = true;
+    c->fillEnd = segEnd < c->sendEnd ? segEnd : c->sendEnd;
+    c->totalBytesR = 0;
+    c->reused = false;
+    conn_fetch(c);
+}
 
-    // if object is cacheable then add to cache.
-    if (is_cacheable) {
-        if (add_to_cache(mURI, cacheBuf, totalBytesR)) {
-            fprintf(stderr, "Could not cache web object\n");
+// writing a cached response back to the client, a segment at a time for a
+// large object.
+static void conn_serve_cache(conn_t *c) {
+    int rc;
+    while ((rc = conn_write(c, &c->client)) > 0 && c->sendPos < c->sendEnd) {
+        if (!conn_next_segment(c)) {
+            conn_segment_missing(c);
+            return;
+        }
+    }
+    if (rc < 0) {
+        fprintf(stderr, "Could not write response to client\n");
+    }
+    if (rc > 0) {
+        trace_mark(&c->span, TRACE_LAST_BYTE);
+    }
+    if (rc > 0 && c->keepClient) {
+        conn_next_request(c);
+        return;
+    }
+    if (rc != 0 || set_interest(c, &c->client, EPOLLOUT) < 0) {
+        conn_close(c);
+    }
+}
+
+/*
+ * conn_hit_range - working out the bytes of a body of total bytes that the
+ * range asked for covers. A range the body can't satisfy is ignored, as the
+ * Range header may be, and the whole body is sent instead.
+ *
+ * @return false if the whole body is to be sent.
+ */
+static bool conn_hit_range(conn_t *c, uint64_t total, uint64_t *first,
+                           uint64_t *last) {
+    if (!c->ranged || total == 0) {
+        return false;
+    }
+    if (c->rangeSuffix) {
+        if (c->rangeFirst == 0) {
+            return false;
         }
+        *first = c->rangeFirst >= total ? 0 : total - c->rangeFirst;
+        *last = total - 1;
+        return true;
+    }
+    if (c->rangeFirst >= total) {
+        return false;
     }
+    *first = c->rangeFirst;
+    *last = c->rangeLast < total ? c->rangeLast : total - 1;
+    return true;
+}
 
-    // error handling (no response)
-    if (iter == 0 && bytesR <= 0) {
-        fprintf(stderr, "Could not read response from server\n");
+/*
+ * conn_compressed_hit - swapping the cached object in c->hit for its
+ * compressed variant, if there is one, as the client accepts it. One without
+ * a variant is offered for compression, so that later clients get one.
+ */
+static void conn_compressed_hit(conn_t *c) {
+    web_object_t *variant = serve_cache_variant(c->hit);
+    if (variant == NULL) {
+        compress_offer(c->hit);
+        return;
     }
+    metrics_add(&c->worker->metrics, METRIC_COMPRESSED, 1);
+    release_cache_obj(c->hit);
+    c->hit = variant;
+}
 
-    // need to cleanup resources
-    cleanup(connfd, clientfd, mParser);
-    return NULL;
+// answering the request with the cached object in c->hit, or with the range
+// of its body asked for. A range is always of the response as it is.
+static void conn_serve_hit(conn_t *c) {
+    if (compress_hits && !c->ranged && !cache_obj_large(c->hit) &&
+        request_accepts(&c->req, CACHE_VARIANT_CODING)) {
+        conn_compressed_hit(c);
+    }
+    web_object_t *hit = c->hit;
+    bool large = cache_obj_large(hit);
+    uint64_t total = hit->objSize - hit->hdrSize;
+    if (large) {
+        total = response_stored_length(hit->object, hit->hdrSize);
+    }
+    uint64_t first;
+    uint64_t last;
+    size_t rangeLen = 0;
+    if (conn_hit_range(c, total, &first, &last)) {
+        rangeLen = response_range_header(hit->object, hit->hdrSize, first,
+                                         last, c->relay, sizeof(c->relay));
+    }
+    c->state = CONN_SERVE_CACHE;
+    if (rangeLen > 0) {
+        conn_output(c, c->relay, rangeLen);
+        c->sendPos = first;
+        c->sendEnd = last + 1;
+    } else {
+        conn_output(c, hit->object, hit->hdrSize - 2);
+        c->sendPos = 0;
+        c->sendEnd = total;
+    }
+    metrics_add(&c->worker->metrics, METRIC_CACHE_BYTES,
+                c->sendEnd - c->sendPos);
+    if (c->keepClient) {
+        conn_output_add(c, hit_keep_alive, sizeof(hit_keep_alive) - 1);
+    } else {
+        conn_output_add(c, hit_close, sizeof(hit_close) - 1);
+    }
+    if (large) {
+        c->segGen = cache_segment_gen(hit->object, hit->hdrSize);
+        if (!conn_next_segment(c)) {
+            conn_segment_missing(c);
+            return;
+        }
+        conn_serve_cache(c);
+        return;
+    }
+    size_t bodyLen = (size_t)(c->sendEnd - c->sendPos);
+    if (hit->bodyFd >= 0) {
+        // zero-copy straight from the page cache.
+        conn_output_fd(c, hit->bodyFd, (off_t)(hit->hdrSize + c->sendPos),
+                       bodyLen);
+    } else {
+        conn_output_add(c, hit->object + hit->hdrSize + c->sendPos, bodyLen);
+    }
+    c->sendPos = c->sendEnd;
+    conn_serve_cache(c);
 }
-int main(int argc, char **argv) {
-    int listenfd;
-    // ignoring sigpipe signals
-    signal(SIGPIPE, SIG_IGN);
-    pthread_t mProxyT;
-    /* Check command line args */
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
-        exit(1);
+
+/*
+ * refresh_request - writing the request line and headers of the request for a
+ * background refresh into fBuf, a MAXBUF buffer, from those of the client's
+ * request, which are gone with its next request. Its fetch is shared by every
+ * client, so it leaves out the client's own conditions, for the proxy's to go
+ * in their place, and its credentials, besides the headers read_request()
+ * never forwards.
+ *
+ * @params[in] line the refresh's own parse of its request line, for the path
+ * @params[in] r the client's request, for its headers
+ * @params[out] fBuf where the request goes
+ * @params[out] len set to its length
+ *
+ * @return false if they don't fit.
+ */
+static bool refresh_request(const http_request_t *line,
+                            const http_request_t *r, char *fBuf,
+                            size_t *len) {
+    // request_cache_key() wrote the key over the client's URI, so r->path is
+    // no longer good to use, unlike its headers and its host and port.
+    int n = write_requestline(line, fBuf);
+    if (n < 0) {
+        return false;
     }
-    // initialising the proxy cache
-    init_web_cache();
-    // initialsing the lock for the proxy.
-    init_cache_lock();
-    // listening to incoming requests from client
-    listenfd = open_listenfd(argv[1]);
-    // make sure its a valid file descriptor
-    if (listenfd < 0) {
-        fprintf(stderr, "Failed to listen on port: %s\n", argv[1]);
-        exit(1);
+    *len = (size_t)n;
+    for (int i = 0; i < r->nheaders; i++) {
+        const req_header_t *h = &r->headers[i];
+        switch (h->known) {
+        case REQ_HDR_PROXY_CONNECTION:
+        case REQ_HDR_CONNECTION:
+        case REQ_HDR_KEEP_ALIVE:
+        case REQ_HDR_USER_AGENT:
+        case REQ_HDR_EXPECT:
+        case REQ_HDR_RANGE:
+        case REQ_HDR_IF_RANGE:
+        case REQ_HDR_IF_NONE_MATCH:
+        case REQ_HDR_IF_MODIFIED_SINCE:
+        case REQ_HDR_AUTHORIZATION:
+        case REQ_HDR_COOKIE:
+            break;
+        default:
+            if (*len + (h->end - h->name.off) > MAXBUF) {
+                return false;
+            }
+            memcpy(fBuf + *len, r->base + h->name.off, h->end - h->name.off);
+            *len += h->end - h->name.off;
+            break;
+        }
     }
-    // continously running and attending client requests
-    while (true) {
-        client_info client_data;
-        client_info *client = &client_data;
-        client->addrlen = sizeof(client->addr);
-        // accepting request and getting the connection file descriptor
-        int connfd = accept(listenfd, (SA *)&client->addr, &client->addrlen);
-        client->connfd = connfd;
-        if (client->connfd < 0) {
-            perror("accept");
-            close(client->connfd);
-            continue;
+    return write_host(r, fBuf, len);
+}
+
+/*
+ * conn_refresh - refreshing a cached object that went stale only recently in
+ * the background, while the client is served the stale object. The refresh is
+ * a connection of its own, with no client, which fetches the request like a
+ * miss would, revalidating the object if it can. Only one fetch of a key runs
+ * at a time, so there is no refresh if one is already under way.
+ *
+ * @params[in] c the connection of the request served stale
+ * @params[in] obj the stale object
+ */
+static void conn_refresh(conn_t *c, web_object_t *obj) {
+    if (!inflight_begin(&c->key, NULL)) {
+        return;
+    }
+    // the refresh parses a request line of its own, in its rio buffer, to
+    // own its key, host and port.
+    conn_t *r = conn_new(c->worker, -1);
+    char *line = r != NULL ? r->rio.rio_buf : NULL;
+    int n = r != NULL ? snprintf(line, sizeof(r->rio.rio_buf),
+                                 "GET %s HTTP/1.1\r\n\r\n", c->key.str)
+                      : -1;
+    if (n < 0 || (size_t)n >= sizeof(r->rio.rio_buf) ||
+        request_feed(&r->req, line, (size_t)n) != REQ_DONE ||
+        r->req.host[0] == '\0') {
+        inflight_end(&c->key);
+        if (r != NULL) {
+            conn_close(r);
         }
-        // get extra info
-        getnameinfo((SA *)&client->addr, client->addrlen, client->host, HOSTLEN,
-                    client->serv, SERVLEN, 0);
+        return;
+    }
+    // the key is normalized already, and hashed.
+    r->key = (cache_key_t){request_at(&r->req, r->req.uri), c->key.len,
+                           c->key.hash};
+    r->host = r->req.host;
+    r->port = r->req.port;
+    r->fetching = true;
+    r->method = c->method;
+    r->useCache = true;
+    size_t len = 0;
+    if (!refresh_request(&r->req, &c->req, r->request, &len)) {
+        conn_close(r);
+        return;
+    }
+    r->reqv[0] = (struct iovec){r->request, len};
+    r->reqv[1] = (struct iovec){header_user_agent,
+                                sizeof(header_user_agent) - 1};
+    r->reqv[2] = (struct iovec){header_connection,
+                                sizeof(header_connection) - 1};
+    r->reqv[3] = (struct iovec){header_end, sizeof(header_end) - 1};
+    r->reqCnt = 4;
+    if (obj->validatable) {
+        r->stale = retain_cache_obj(obj);
+    }
+    conn_fetch(r);
+}
 
-        int *connfdP = malloc(sizeof(int));
-        *connfdP = client->connfd;
-        // spawn a pthread to handle every request till its termination.
-        pthread_create(&mProxyT, NULL, threadRoutine, (void *)connfdP);
+/*
+ * conn_lookup - looking the request up in the cache. A fresh object is
+ * returned for the client to be served from, as is a stale one that may still
+ * be served while it is refreshed. Any other stale one with a validator is
+ * kept in c->stale instead, for the fetch to revalidate, unless the client
+ * made its request conditional itself, as the server must then see its
+ * conditions rather than ours.
+ *
+ * @return the fresh cached object with a reference held, or NULL.
+ */
+static web_object_t *conn_lookup(conn_t *c) {
+    time_t now = time(NULL);
+    web_object_t *obj = serve_cache(&c->key);
+    if (obj == NULL || cache_obj_fresh(obj, now)) {
+        return obj;
+    }
+    if (cache_obj_stale_usable(obj, now)) {
+        conn_refresh(c, obj);
+        return obj;
+    }
+    if (c->stale != NULL) {
+        release_cache_obj(c->stale);
+        c->stale = NULL;
+    }
+    if (obj->validatable &&
+        request_header(&c->req, REQ_HDR_IF_NONE_MATCH) == NULL &&
+        request_header(&c->req, REQ_HDR_IF_MODIFIED_SINCE) == NULL) {
+        c->stale = obj;
+    } else {
+        release_cache_obj(obj);
+    }
+    return NULL;
+}
+
+/*
+ * conn_add_headers - building the headers the proxy adds to the request for
+ * the server in cond. The request is made conditional on the validators of
+ * c->stale, if any, and asks for the missing part of c->hit for a fill, or
+ * for the range the client asked for, if any. A range whose headers don't
+ * fit is left out, and the server sends the whole response.
+ */
+static void conn_add_headers(conn_t *c) {
+    size_t size = sizeof(c->cond);
+    c->condLen = 0;
+    if (c->stale != NULL &&
+        (c->condLen = response_conditional(c->stale->object,
+                                           c->stale->hdrSize, c->cond,
+                                           size)) == 0) {
+        // fetching the object in full instead.
+        release_cache_obj(c->stale);
+        c->stale = NULL;
+    }
+    size_t len = c->condLen;
+    int n;
+    if (c->filling) {
+        n = snprintf(c->cond + len, size - len,
+                     "Range: bytes=%" PRIu64 "-%" PRIu64 "\r\n", c->sendPos,
+                     c->fillEnd - 1);
+        if (n > 0 && (size_t)n < size - len) {
+            len += (size_t)n;
+            len += response_if_range(c->hit->object, c->hit->hdrSize,
+                                     c->cond + len, size - len);
+        }
+        c->condLen = len;
+        return;
+    }
+    const req_header_t *range = request_header(&c->req, REQ_HDR_RANGE);
+    const req_header_t *ifRange = request_header(&c->req, REQ_HDR_IF_RANGE);
+    if (range == NULL) {
+        return;
+    }
+    n = snprintf(c->cond + len, size - len, "Range: %.*s\r\n",
+                 (int)range->value.len, request_at(&c->req, range->value));
+    if (n < 0 || (size_t)n >= size - len) {
+        return;
+    }
+    len += (size_t)n;
+    if (ifRange != NULL) {
+        n = snprintf(c->cond + len, size - len, "If-Range: %.*s\r\n",
+                     (int)ifRange->value.len,
+                     request_at(&c->req, ifRange->value));
+        if (n < 0 || (size_t)n >= size - len) {
+            return;
+        }
+        len += (size_t)n;
+    }
+    c->condLen = len;
+}
+
+// fetching the request from the server. A pooled connection to it saves
+// resolving it and a handshake, but may turn out to be closed, so only
+// requests that may be retried over a new one get it.
+static void conn_fetch(conn_t *c) {
+    conn_add_headers(c);
+    int fd = -1;
+    if (c->method->idempotent) {
+        fd = upstream_get(&c->worker->pool, c->host, c->port);
+    }
+    if (fd >= 0) {
+        metrics_add(&c->worker->metrics, METRIC_REUSED, 1);
+        trace_mark(&c->span, TRACE_CONNECTED);
+        c->reused = true;
+        c->server.fd = fd;
+        c->server.events = 0;
+        conn_start_request(c);
+        return;
+    }
+    conn_resolve(c);
+}
+
+// the fetch of the same key that the request waited for is over, which
+// usually left the response in the cache.
+static void conn_coalesced(conn_t *c) {
+    if (c->hit != NULL) {
+        // more of the large object the client is being served is cached.
+        c->state = CONN_SERVE_CACHE;
+        if (conn_next_segment(c)) {
+            conn_serve_cache(c);
+        } else {
+            conn_segment_missing(c);
+        }
+        return;
+    }
+    if ((c->hit = conn_lookup(c)) != NULL) {
+        conn_serve_hit(c);
+        return;
+    }
+    // the response couldn't be cached, so fetch it for this client alone.
+    conn_fetch(c);
+}
+
+/*
+ * request_body_length - working out how long the body of a request is. Only
+ * a body framed by Content-Length is forwarded, as a chunked one would have
+ * to be parsed on its way through.
+ *
+ * @params[in] r the parsed request
+ * @params[out] len the length of the body, 0 if there is none
+ *
+ * @return 0, or the status to reject the request with: 411 for a chunked
+ * body, 400 for an invalid Content-Length.
+ */
+static int request_body_length(const http_request_t *r, uint64_t *len) {
+    if (request_header(r, REQ_HDR_TRANSFER_ENCODING) != NULL) {
+        return 411;
+    }
+    const req_header_t *header = request_header(r, REQ_HDR_CONTENT_LENGTH);
+    if (header == NULL) {
+        *len = 0;
+        return 0;
+    }
+    // the value is followed by the end of its line, which stops strtoull().
+    const char *value = request_at(r, header->value);
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(value, &end, 10);
+    if (!isdigit((unsigned char)*value) || end != value + header->value.len ||
+        errno != 0) {
+        return 400;
+    }
+    *len = n;
+    return 0;
+}
+
+/*
+ * conn_body_start - setting up the forwarding of a request body of len bytes.
+ * What the client sent of it along with the header block goes out with the
+ * request, straight from the rio buffer, and the rest is read from the client
+ * socket as the request is sent. Whatever follows the body in the buffer is
+ * the next request, which stays there.
+ */
+static void conn_body_start(conn_t *c, uint64_t len) {
+    size_t buffered = (size_t)c->rio.rio_cnt;
+    if (len < buffered) {
+        buffered = (size_t)len;
+    }
+    c->bodyv = (struct iovec){c->rio.rio_bufptr, buffered};
+    c->rio.rio_bufptr += buffered;
+    c->rio.rio_cnt -= (ssize_t)buffered;
+    c->bodyRest = len - buffered;
+    c->bodyLeft = c->bodyRest;
+    // the client waits for the go ahead on a body it hasn't sent yet.
+    const req_header_t *expect = request_header(&c->req, REQ_HDR_EXPECT);
+    if (c->bodyRest > 0 && request_value_is(&c->req, expect, "100-continue")) {
+        static const char cont[] = "HTTP/1.1 100 Continue\r\n\r\n";
+        if (write(c->client.fd, cont, sizeof(cont) - 1) < 0) {
+            perror("write 100 Continue");
+        }
+    }
+}
+
+/*
+ * conn_parse_range - reading the Range header of a request that may be
+ * answered from the cache. A single range of bytes is answered from there,
+ * whether from a first byte to a last one or to the end of the body, or the
+ * last bytes of the body. Other ranges, several of them or one only sent if
+ * the response hasn't changed (If-Range), are left to the server.
+ *
+ * @return false if the request is to go to the server.
+ */
+static bool conn_parse_range(conn_t *c) {
+    const req_header_t *header = request_header(&c->req, REQ_HDR_RANGE);
+    c->ranged = false;
+    if (header == NULL) {
+        return true;
+    }
+    // the value is followed by the end of its line, which stops strtoull().
+    const char *spec = request_at(&c->req, header->value);
+    const char *specEnd = spec + header->value.len;
+    if (request_header(&c->req, REQ_HDR_IF_RANGE) != NULL ||
+        header->value.len < 6 || strncasecmp(spec, "bytes=", 6) != 0) {
+        return false;
+    }
+    spec += 6;
+    c->rangeSuffix = *spec == '-';
+    if (c->rangeSuffix) {
+        spec++;
+    }
+    char *end;
+    errno = 0;
+    if (!isdigit((unsigned char)*spec)) {
+        return false;
+    }
+    c->rangeFirst = strtoull(spec, &end, 10);
+    c->rangeLast = UINT64_MAX;
+    if (!c->rangeSuffix) {
+        if (*end++ != '-') {
+            return false;
+        }
+        if (isdigit((unsigned char)*end)) {
+            c->rangeLast = strtoull(end, &end, 10);
+            if (c->rangeLast < c->rangeFirst) {
+                return false;
+            }
+        }
+    }
+    while (end < specEnd && (*end == ' ' || *end == '\t')) {
+        end++;
+    }
+    c->ranged = end == specEnd && errno == 0;
+    return c->ranged;
+}
+
+/*
+ * conn_serve_metrics - answering a request for METRICS_PATH, which is for the
+ * proxy itself rather than a server, with the metrics of every worker.
+ *
+ * @return false if the request is for a server instead.
+ */
+static bool conn_serve_metrics(conn_t *c) {
+    const http_request_t *r = &c->req;
+    if (r->host[0] != '\0' || r->method.len != 3 ||
+        memcmp(request_at(r, r->method), "GET", 3) != 0 ||
+        strcmp(request_at(r, r->uri), METRICS_PATH) != 0) {
+        return false;
+    }
+    c->keepClient = client_keep_alive(r);
+    size_t bodyLen = metrics_render(c->relay, sizeof(c->relay));
+    int n = snprintf(c->cond, sizeof(c->cond),
+                     "HTTP/1.1 200 OK\r\n"
+                     "Content-Type: text/plain; version=0.0.4\r\n"
+                     "Content-Length: %zu\r\n"
+                     "Connection: %s\r\n\r\n",
+                     bodyLen, c->keepClient ? "keep-alive" : "close");
+    if (bodyLen == 0 || n < 0 || (size_t)n >= sizeof(c->cond)) {
+        clienterror(c->client.fd, "500", "Internal Server Error",
+                    "The metrics don't fit in a response");
+        conn_close(c);
+        return true;
+    }
+    c->state = CONN_SERVE_CACHE;
+    conn_output(c, c->cond, (size_t)n);
+    conn_output_add(c, c->relay, bodyLen);
+    conn_serve_cache(c);
+    return true;
+}
+
+/*
+ * process_request - the request header block has been parsed, or found to be
+ * malformed, as it was buffered in c->rio, so either serve the client from
+ * the cache or start connecting to the server.
+ */
+static void process_request(conn_t *c) {
+    int connfd = c->client.fd;
+    http_request_t *r = &c->req;
+    // the request is complete, so stop listening to the client for now.
+    set_interest(c, &c->client, 0);
+    if (r->state == REQ_ERROR) {
+        clienterror(connfd, "400", "Bad Request",
+                    "Received a malformed request");
+        conn_close(c);
+        return;
+    }
+    // the block is consumed whatever happens to it.
+    c->rio.rio_bufptr += r->len;
+    c->rio.rio_cnt -= (ssize_t)r->len;
+    if (conn_serve_metrics(c)) {
+        return;
+    }
+    metrics_t *metrics = &c->worker->metrics;
+    metrics_add(metrics, METRIC_REQUESTS, 1);
+
+    // host and port to connect to and URI for the cache key, which is only
+    // normalized once the request for the server no longer needs the URI.
+    const char *key = NULL;
+    if (r->host[0] == '\0' ||
+        read_request(connfd, r, c->request, c->reqv, &c->reqCnt) ||
+        (key = request_cache_key(r, cache_key_ignore)) == NULL) {
+        clienterror(connfd, "400", "Bad Request",
+                    "Received a malformed request");
+        conn_close(c);
+        return;
+    }
+    cache_key_init(&c->key, key);
+    c->host = r->host;
+    c->port = r->port;
+    c->keepClient = client_keep_alive(r);
+    trace_mark(&c->span, TRACE_PARSED);
+
+    uint64_t bodyLen = 0;
+    int status;
+    c->method = method_lookup(request_at(r, r->method), r->method.len);
+    if ((status = request_body_length(r, &bodyLen)) != 0) {
+        clienterror(connfd, status == 411 ? "411" : "400",
+                    status == 411 ? "Length Required" : "Bad Request",
+                    "Request bodies must be sent with a Content-Length");
+        conn_close(c);
+        return;
+    }
+    conn_body_start(c, bodyLen);
+    // other requests go straight to the server, and any of its responses to
+    // one that may change the resource invalidates what is cached for it.
+    // Responses to authorized requests are the client's alone, and a shared
+    // cache mustn't store them (RFC 9111, section 3.5).
+    c->useCache = strcmp(c->method->name, "GET") == 0 && bodyLen == 0 &&
+                  request_header(r, REQ_HDR_AUTHORIZATION) == NULL &&
+                  conn_parse_range(c);
+    if (!c->useCache) {
+        metrics_add(metrics, METRIC_BYPASSED, 1);
+        conn_fetch(c);
+        return;
+    }
+
+    // if possible we need to try and serve the client by looking through the
+    // cache and seeing if the request has already been cached.
+    c->hit = conn_lookup(c);
+    trace_mark(&c->span, TRACE_LOOKUP);
+    if (c->hit != NULL) {
+        metrics_add(metrics, METRIC_HITS, 1);
+        conn_serve_hit(c);
+        return;
+    }
+    // the server answers a range with a 206, which isn't cached, so a range
+    // is fetched for this client alone.
+    if (c->ranged) {
+        metrics_add(metrics, METRIC_MISSES, 1);
+        conn_fetch(c);
+        return;
+    }
+    // the first miss on a key fetches it, and later ones wait for the
+    // response to land in the cache.
+    if (!inflight_begin(&c->key, &c->coalesce)) {
+        metrics_add(metrics, METRIC_COALESCED, 1);
+        c->state = CONN_COALESCE;
+        return;
+    }
+    c->fetching = true;
+    // another fetch may have ended between the lookup and inflight_begin().
+    if ((c->hit = conn_lookup(c)) != NULL) {
+        metrics_add(metrics, METRIC_HITS, 1);
+        conn_fetch_over(c);
+        conn_serve_hit(c);
+        return;
+    }
+    metrics_add(metrics, METRIC_MISSES, 1);
+    conn_fetch(c);
+}
+
+// reading more of the client request until the blank line ending it arrives.
+static void conn_read_request(conn_t *c) {
+    ssize_t n = rio_fillb(&c->rio);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+    }
+    if (n < 0 && errno == ENOBUFS) {
+        // the header block doesn't fit in the rio buffer.
+        clienterror(c->client.fd, "400", "Bad Request",
+                    "Received a malformed request");
+    }
+    if (n <= 0) {
+        conn_close(c);
+        return;
+    }
+    if (request_feed(&c->req, c->rio.rio_bufptr, (size_t)c->rio.rio_cnt) >=
+        REQ_DONE) {
+        process_request(c);
+    }
+}
+
+/*
+ * conn_try_connect - starting a non-blocking connect to the next resolved
+ * address of the server. Completion is signalled by the socket becoming
+ * writable.
+ */
+static void conn_try_connect(conn_t *c) {
+    while (c->nextAddr != NULL) {
+        struct addrinfo *p = c->nextAddr;
+        c->nextAddr = p->ai_next;
+        int clientfd = socket(p->ai_family,
+                              p->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                              p->ai_protocol);
+        if (clientfd < 0) {
+            continue; /* Socket failed, try the next */
+        }
+        int one = 1;
+        setsockopt(clientfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        c->connectStart = metrics_clock();
+        if (connect(clientfd, p->ai_addr, p->ai_addrlen) == 0 ||
+            errno == EINPROGRESS) {
+            c->state = CONN_CONNECT;
+            c->server.fd = clientfd;
+            c->server.events = 0;
+            if (set_interest(c, &c->server, EPOLLOUT) < 0) {
+                conn_close(c);
+            }
+            return;
+        }
+        metrics_add(&c->worker->metrics, METRIC_CONNECT_ERRORS, 1);
+        close(clientfd); /* Connect failed, try another */
+    }
+    perror("connect");
+    conn_close(c);
+}
+
+// writing the modified client request to the server.
+static void conn_send_request(conn_t *c) {
+    int rc = conn_write(c, &c->server);
+    if (rc < 0 && conn_retry_fresh(c)) {
+        return;
+    }
+    if (rc < 0) {
+        clienterror(c->client.fd, "500", "Server Error",
+                    "Cannot write to server");
+        conn_close(c);
+        return;
+    }
+    if (rc == 0) {
+        if (set_interest(c, &c->server, EPOLLOUT) < 0) {
+            conn_close(c);
+        }
+        return;
+    }
+    if (c->bodyLeft > 0) {
+        c->state = CONN_SEND_BODY;
+        conn_send_body(c);
+        return;
+    }
+    conn_await_response(c);
+}
+
+// the request has been sent in full, so read the response.
+static void conn_await_response(conn_t *c) {
+    // server will respond and bytes need to be sent to the client via connfd.
+    c->state = CONN_RELAY;
+    c->is_cacheable = c->useCache;
+    c->keepServer = true;
+    response_init(&c->resp);
+    if (set_interest(c, &c->client, 0) < 0 ||
+        set_interest(c, &c->server, EPOLLIN) < 0) {
+        conn_close(c);
+    }
+}
+
+/*
+ * conn_send_body - streaming the rest of the request body from the client to
+ * the server, a chunk at a time through c->relay. While the server can't
+ * keep up we stop reading from the client, and the other way round.
+ */
+static void conn_send_body(conn_t *c) {
+    while (true) {
+        int rc = conn_write(c, &c->server);
+        if (rc < 0) {
+            fprintf(stderr, "Could not write request body to server\n");
+            conn_close(c);
+            return;
+        }
+        if (rc == 0) {
+            if (set_interest(c, &c->client, 0) < 0 ||
+                set_interest(c, &c->server, EPOLLOUT) < 0) {
+                conn_close(c);
+            }
+            return;
+        }
+        if (c->bodyLeft == 0) {
+            conn_await_response(c);
+            return;
+        }
+        size_t len = MAXBUF;
+        if (c->bodyLeft < len) {
+            len = (size_t)c->bodyLeft;
+        }
+        ssize_t n;
+        do {
+            n = read(c->client.fd, c->relay, len);
+        } while (n < 0 && errno == EINTR);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (set_interest(c, &c->server, 0) < 0 ||
+                set_interest(c, &c->client, EPOLLIN) < 0) {
+                conn_close(c);
+            }
+            return;
+        }
+        if (n <= 0) {
+            conn_close(c); // the client went away halfway through
+            return;
+        }
+        c->bodyLeft -= (uint64_t)n;
+        conn_output(c, c->relay, (size_t)n);
+    }
+}
+
+// the server socket became writable, so the pending connect has finished.
+static void conn_connected(conn_t *c) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(c->server.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 ||
+        err != 0) {
+        // connect failed, try another
+        metrics_add(&c->worker->metrics, METRIC_CONNECT_ERRORS, 1);
+        set_interest(c, &c->server, 0);
+        close(c->server.fd);
+        c->server.fd = -1;
+        conn_try_connect(c);
+        return;
+    }
+    metrics_add(&c->worker->metrics, METRIC_CONNECTS, 1);
+    metrics_observe_connect(&c->worker->metrics,
+                            metrics_clock() - c->connectStart);
+    trace_mark(&c->span, TRACE_CONNECTED);
+    resolver_release(c->dns);
+    c->dns = NULL;
+    conn_start_request(c);
+}
+
+static void conn_relay_done(conn_t *c);
+static void conn_fill_done(conn_t *c);
+static void conn_segments_flush(conn_t *c, bool last);
+static void conn_cachebuf_drop(conn_t *c);
+
+/*
+ * conn_relay_flush - writing the current chunk of the server response to the
+ * client. While the client can't keep up we stop reading from the server, so
+ * at most one chunk per connection is ever buffered. Once the last chunk of
+ * the response is written the relay is done.
+ */
+static void conn_relay_flush(conn_t *c) {
+    int rc = 1;
+    if (c->client.fd >= 0) {
+        rc = conn_write(c, &c->client);
+    } else {
+        conn_output(c, NULL, 0); // a background refresh only feeds the cache
+    }
+    if (rc < 0) {
+        fprintf(stderr, "Could not write response to client\n");
+        conn_close(c);
+        return;
+    }
+    if (rc == 0) {
+        if (set_interest(c, &c->server, 0) < 0 ||
+            set_interest(c, &c->client, EPOLLOUT) < 0) {
+            conn_close(c);
+        }
+        return;
+    }
+    if (c->resp.state != RESP_BODY) {
+        conn_relay_done(c);
+        return;
+    }
+    if (set_interest(c, &c->client, 0) < 0 ||
+        set_interest(c, &c->server, EPOLLIN) < 0) {
+        conn_close(c);
+    }
+}
+
+// handing the server connection back to the worker's pool, if the server
+// keeps it open and sent nothing beyond the response.
+static void conn_pool_server(conn_t *c) {
+    if (c->keepServer && c->resp.keepAlive && c->server.fd >= 0 &&
+        set_interest(c, &c->server, 0) == 0) {
+        upstream_put(&c->worker->pool, c->host, c->port, c->server.fd);
+        c->server.fd = -1;
+    }
+}
+
+/*
+ * conn_relay_done - the response has been relayed, whether in full or not. A
+ * complete cacheable response is added to the cache, and the server
+ * connection goes back to the worker's pool.
+ */
+static void conn_relay_done(conn_t *c) {
+    trace_mark(&c->span, TRACE_LAST_BYTE);
+    // error handling (no response)
+    if (c->totalBytesR == 0) {
+        fprintf(stderr, "Could not read response from server\n");
+    }
+    // a truncated response must not end up in the cache.
+    if (c->resp.state != RESP_DONE) {
+        c->is_cacheable = false;
+        c->keepServer = false;
+    }
+    if (c->filling) {
+        conn_fill_done(c);
+        return;
+    }
+    // if object is cacheable then add to cache, which copies cacheBuf.
+    if (c->segmented && c->is_cacheable) {
+        conn_segments_flush(c, true);
+        trace_mark(&c->span, TRACE_CACHED);
+    } else if (c->segmented) {
+        conn_cachebuf_drop(c);
+    } else if (c->is_cacheable && c->cacheLen > 0) {
+        size_t size = response_finish_stored(&c->resp, c->cacheBuf,
+                                             c->cacheHdrLen, c->cacheLen);
+        cache_freshness_t fresh = {
+            response_expires(&c->resp, time(NULL)),
+            response_stale_while(&c->resp, default_stale_while),
+            response_validatable(&c->resp)};
+        if (add_to_cache(&c->key, c->cacheBuf, size, c->cacheHdrLen,
+                         &fresh)) {
+            fprintf(stderr, "Could not cache web object\n");
+        }
+        trace_mark(&c->span, TRACE_CACHED);
+    }
+    conn_fetch_over(c);
+    conn_pool_server(c);
+    if (c->keepClient && c->resp.state == RESP_DONE) {
+        conn_next_request(c);
+    } else {
+        conn_close(c);
+    }
+}
+
+/*
+ * conn_cachebuf_reserve - making sure the response accumulator has room for
+ * another need bytes. Capacity doubles from CACHEBUF_MIN so a response is
+ * moved at most O(log n) times on its way to the cache, and never goes beyond
+ * what the largest cacheable response plus one chunk needs.
+ *
+ * @return false if out of memory.
+ */
+static bool conn_cachebuf_reserve(conn_t *c, size_t need) {
+    size_t maxCap = web_cache->maxObject + MAXBUF;
+    size_t cap = c->cacheCap == 0 ? CACHEBUF_MIN : c->cacheCap;
+    while (cap - c->cacheLen < need && cap < maxCap) {
+        cap *= 2;
+    }
+    if (cap > maxCap) {
+        cap = maxCap;
+    }
+    if (cap - c->cacheLen < need) {
+        return false;
+    }
+    if (cap == c->cacheCap) {
+        return true;
+    }
+    char *grown = (char *)realloc(c->cacheBuf, cap);
+    if (grown == NULL) {
+        return false;
+    }
+    c->cacheBuf = grown;
+    c->cacheCap = cap;
+    return true;
+}
+
+// stop accumulating the response for the cache. The segments of a large
+// response already cached would leave the rest of it missing, so its header
+// block is dropped from the cache.
+static void conn_cachebuf_drop(conn_t *c) {
+    if (c->segmented) {
+        cache_invalidate(&c->key);
+        c->segmented = false;
+    }
+    conn_fetch_over(c);
+    c->is_cacheable = false;
+    free(c->cacheBuf);
+    c->cacheBuf = NULL;
+    c->cacheLen = 0;
+    c->cacheCap = 0;
+}
+
+// nothing needs to see the rest of an uncacheable response, so the relay can
+// carry on in the kernel, unless its end can only be found by parsing chunks.
+static void conn_start_splice(conn_t *c) {
+    if (c->resp.state != RESP_BODY || c->resp.framing == FRAMING_CHUNKED ||
+        c->client.fd < 0) {
+        return;
+    }
+    if (pipe2(c->pipefd, O_NONBLOCK | O_CLOEXEC) == 0) {
+        c->state = CONN_SPLICE;
+    } else {
+        c->pipefd[0] = -1;
+        c->pipefd[1] = -1;
+    }
+}
+
+/*
+ * conn_segments_start - the response is larger than the cache takes whole,
+ * so it is cached in segments. Its header block goes into the cache right
+ * away, with the length of the whole body, and the body bytes read with it
+ * move to the start of the accumulator, which from then on holds the segment
+ * being read.
+ */
+static void conn_segments_start(conn_t *c) {
+    size_t hdrLen = c->cacheHdrLen;
+    response_finish_stored(&c->resp, c->cacheBuf, hdrLen,
+                           hdrLen + (size_t)c->resp.length);
+    c->segFresh = (cache_freshness_t){
+        response_expires(&c->resp, time(NULL)),
+        response_stale_while(&c->resp, default_stale_while),
+        response_validatable(&c->resp)};
+    if (add_to_cache(&c->key, c->cacheBuf, hdrLen, hdrLen, &c->segFresh)) {
+        conn_cachebuf_drop(c);
+        return;
+    }
+    c->segmented = true;
+    c->segGen = cache_segment_gen(c->cacheBuf, hdrLen);
+    c->segNext = 0;
+    c->cacheLen -= hdrLen;
+    c->cacheHdrLen = 0;
+    memmove(c->cacheBuf, c->cacheBuf + hdrLen, c->cacheLen);
+    // clients waiting for the response can be sent its header block.
+    inflight_progress(&c->key);
+}
+
+/*
+ * conn_segments_flush - caching every full segment of a large response in the
+ * accumulator, only once it has been written to the client, as it is written
+ * from there. With last, the response is complete and the rest of the
+ * accumulator is its last segment.
+ */
+static void conn_segments_flush(conn_t *c, bool last) {
+    size_t off = 0;
+    while (c->cacheLen - off >= CACHE_SEGMENT_SIZE ||
+           (last && off < c->cacheLen)) {
+        size_t len = c->cacheLen - off;
+        if (len > CACHE_SEGMENT_SIZE) {
+            len = CACHE_SEGMENT_SIZE;
+        }
+        if (add_segment_to_cache(&c->key, c->segGen, c->segNext,
+                                 c->cacheBuf + off, len, &c->segFresh)) {
+            conn_cachebuf_drop(c);
+            return;
+        }
+        c->segNext++;
+        off += len;
+    }
+    if (off > 0) {
+        c->cacheLen -= off;
+        memmove(c->cacheBuf, c->cacheBuf + off, c->cacheLen);
+        inflight_progress(&c->key);
+    }
+}
+
+// relaying the next chunk of the body of a fill to the client, but for the
+// bytes it has been written already and any beyond the end it asked for.
+static void conn_fill_output(conn_t *c, char *chunk, size_t len) {
+    size_t skip = c->fillSkip < len ? (size_t)c->fillSkip : len;
+    c->fillSkip -= skip;
+    len -= skip;
+    if (len > c->fillEnd - c->sendPos) {
+        len = (size_t)(c->fillEnd - c->sendPos);
+    }
+    conn_output(c, chunk + skip, len);
+    c->sendPos += len;
+}
+
+/*
+ * conn_fill_headers - the server answered a fill. The bytes asked for are
+ * relayed to the client after the part of the object already written, and
+ * accumulated to be cached as the missing segment if they are all of it. A
+ * server ignoring the range sends the whole object again instead, which is
+ * relayed from where the client is up to the end it asked for, provided the
+ * object is still the one being served.
+ */
+static void conn_fill_headers(conn_t *c, char *body, size_t bodyLen) {
+    web_object_t *hit = c->hit;
+    uint64_t total = response_stored_length(hit->object, hit->hdrSize);
+    char was[MAXLINE];
+    char now[MAXLINE];
+    size_t wasLen = response_if_range(hit->object, hit->hdrSize, was,
+                                      sizeof(was));
+    bool whole = c->resp.status == 200 && c->resp.framing == FRAMING_LENGTH &&
+                 c->resp.length == total &&
+                 response_if_range(c->resp.hdr, c->resp.hdrLen, now,
+                                   sizeof(now)) == wasLen &&
+                 memcmp(was, now, wasLen) == 0;
+    if (!whole && (c->resp.status != 206 ||
+                   c->resp.framing != FRAMING_LENGTH ||
+                   c->resp.length != c->fillEnd - c->sendPos)) {
+        fprintf(stderr, "Could not fetch the rest of %s\n", c->key.str);
+        conn_close(c);
+        return;
+    }
+    c->fillSkip = 0;
+    c->is_cacheable = false;
+    if (whole) {
+        c->fillSkip = c->sendPos;
+        c->fillEnd = c->sendEnd;
+    } else if (c->sendPos % CACHE_SEGMENT_SIZE == 0 &&
+               (c->fillEnd % CACHE_SEGMENT_SIZE == 0 || c->fillEnd == total)) {
+        c->is_cacheable = conn_cachebuf_reserve(c, bodyLen);
+        if (c->is_cacheable) {
+            memcpy(c->cacheBuf, body, bodyLen);
+            c->cacheLen = bodyLen;
+        }
+    }
+    conn_fill_output(c, body, bodyLen);
+    conn_relay_flush(c);
+}
+
+/*
+ * conn_fill_done - the server has sent what a fill asked for, which is cached
+ * as the segment if it is all of it, and the client is served the rest of the
+ * object from the cache again.
+ */
+static void conn_fill_done(conn_t *c) {
+    if (c->resp.state != RESP_DONE) {
+        fprintf(stderr, "Could not fetch the rest of %s\n", c->key.str);
+        conn_close(c);
+        return;
+    }
+    web_object_t *hit = c->hit;
+    if (c->is_cacheable) {
+        cache_freshness_t fresh = {
+            (time_t)atomic_load_explicit(&hit->expires, memory_order_relaxed),
+            hit->staleWhile, hit->validatable};
+        if (add_segment_to_cache(&c->key, c->segGen,
+                                 (c->fillEnd - 1) / CACHE_SEGMENT_SIZE,
+                                 c->cacheBuf, c->cacheLen, &fresh)) {
+            fprintf(stderr, "Could not cache web object\n");
+        }
+    }
+    conn_fetch_over(c);
+    conn_pool_server(c);
+    if (c->server.fd >= 0) {
+        set_interest(c, &c->server, 0);
+        close(c->server.fd);
+        c->server.fd = -1;
+    }
+    free(c->cacheBuf);
+    c->cacheBuf = NULL;
+    c->cacheLen = 0;
+    c->cacheCap = 0;
+    c->is_cacheable = false;
+    c->filling = false;
+    c->state = CONN_SERVE_CACHE;
+    if (c->sendPos < c->sendEnd && !conn_next_segment(c)) {
+        conn_segment_missing(c);
+        return;
+    }
+    conn_serve_cache(c);
+}
+
+/*
+ * conn_revalidated - the server answered the conditional request for c->stale
+ * with a 304, so the object is still good. It is fresh again for as long as
+ * the 304 says, and the client is served from it.
+ */
+static void conn_revalidated(conn_t *c) {
+    metrics_add(&c->worker->metrics, METRIC_REVALIDATED, 1);
+    cache_refresh(c->stale,
+                  response_revalidated(&c->resp, c->stale->object,
+                                       c->stale->hdrSize, time(NULL)));
+    conn_cachebuf_drop(c);
+    conn_pool_server(c);
+    if (c->client.fd < 0) {
+        conn_close(c); // a background refresh, which is done
+        return;
+    }
+    if (c->server.fd >= 0) {
+        set_interest(c, &c->server, 0);
+        close(c->server.fd);
+        c->server.fd = -1;
+    }
+    c->hit = c->stale;
+    c->stale = NULL;
+    conn_serve_hit(c);
+}
+
+/*
+ * conn_relay_headers - feeding the first bytes of the server response to the
+ * response parser. Once the header block is complete, the version stored in
+ * the cache goes at the start of the accumulator, and the version relayed to
+ * the client is written along with any body bytes read with it.
+ */
+static void conn_relay_headers(conn_t *c, size_t bytesR) {
+    size_t used = response_feed(&c->resp, c->relay, bytesR);
+    if (c->resp.state == RESP_HEADERS) {
+        return;
+    }
+    if (c->resp.state == RESP_ERROR) {
+        clienterror(c->client.fd, "502", "Bad Gateway",
+                    "Received a malformed response");
+        conn_close(c);
+        return;
+    }
+    char *body = c->relay + used;
+    size_t bodyLen = response_feed(&c->resp, body, bytesR - used);
+    if (used + bodyLen < bytesR || c->resp.state == RESP_ERROR) {
+        c->keepServer = false; // the server sent more than the response
+    }
+    if (c->stale != NULL && c->resp.status == 304) {
+        conn_revalidated(c);
+        return;
+    }
+    if (c->filling) {
+        conn_fill_headers(c, body, bodyLen);
+        return;
+    }
+    // the resource may have changed, so the cached response is out of date.
+    if (!c->method->safe && c->resp.status < 400) {
+        cache_invalidate(&c->key);
+    }
+
+    // a response announcing more than the cache takes, even in segments, or
+    // one that may not be stored, is never accumulated.
+    bool large = c->resp.framing == FRAMING_LENGTH &&
+                 c->resp.length > web_cache->maxObject;
+    if ((large && c->resp.length > web_cache->maxLarge) ||
+        !response_storable(&c->resp, time(NULL))) {
+        conn_cachebuf_drop(c);
+    }
+    if (c->is_cacheable) {
+        if (!conn_cachebuf_reserve(c, RESP_HDRBUF + bodyLen) ||
+            (c->cacheHdrLen = response_stored_header(
+                 &c->resp, c->cacheBuf, c->cacheCap)) == 0) {
+            conn_cachebuf_drop(c);
+        } else {
+            memcpy(c->cacheBuf + c->cacheHdrLen, body, bodyLen);
+            c->cacheLen = c->cacheHdrLen + bodyLen;
+            if (large) {
+                conn_segments_start(c);
+            }
+        }
+    }
+
+    // the stored header has been built, so the one for the client can be
+    // built over the parser's copy. Only a response that ends before the
+    // server closes its connection lets the client keep its own.
+    c->keepClient = c->keepClient && c->resp.framing != FRAMING_CLOSE;
+    size_t hdrLen = response_client_header(&c->resp, c->resp.hdr, RESP_HDRBUF,
+                                           c->keepClient ? "keep-alive"
+                                                         : "close");
+    if (hdrLen == 0) {
+        clienterror(c->client.fd, "502", "Bad Gateway",
+                    "Received a malformed response");
+        conn_close(c);
+        return;
+    }
+    conn_output(c, c->resp.hdr, hdrLen);
+    conn_output_add(c, body, bodyLen);
+    if (!c->is_cacheable) {
+        conn_start_splice(c);
+    }
+    conn_relay_flush(c);
+}
+
+/*
+ * conn_relay_read - reading the next chunk of the server response and
+ * relaying it. While the response may still be cached the chunk is read
+ * straight into the accumulator and written to the client from there, so
+ * the bytes are never copied on their way to the cache.
+ */
+static void conn_relay_read(conn_t *c) {
+    bool headers = c->resp.state == RESP_HEADERS;
+    // the last chunk has been written, so the segments it completed can go.
+    if (c->segmented) {
+        conn_segments_flush(c, false);
+    }
+    if (!headers && c->is_cacheable && !conn_cachebuf_reserve(c, MAXBUF)) {
+        conn_cachebuf_drop(c);
+    }
+    char *chunk = c->relay;
+    if (!headers && c->is_cacheable) {
+        chunk = c->cacheBuf + c->cacheLen;
+    }
+
+    ssize_t bytesR;
+    do {
+        bytesR = read(c->server.fd, chunk, MAXBUF);
+    } while (bytesR < 0 && errno == EINTR);
+
+    if (bytesR < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+    }
+    if (bytesR <= 0) {
+        if (conn_retry_fresh(c)) {
+            return;
+        }
+        if (bytesR == 0) {
+            response_eof(&c->resp);
+        } else {
+            c->resp.state = RESP_ERROR;
+        }
+        conn_relay_done(c);
+        return;
+    }
+    if (c->totalBytesR == 0) {
+        trace_mark(&c->span, TRACE_FIRST_BYTE);
+    }
+    c->totalBytesR += (size_t)bytesR;
+    metrics_add(&c->worker->metrics, METRIC_ORIGIN_BYTES, (uint64_t)bytesR);
+    if (headers) {
+        conn_relay_headers(c, (size_t)bytesR);
+        return;
+    }
+
+    size_t used = response_feed(&c->resp, chunk, (size_t)bytesR);
+    if (used < (size_t)bytesR || c->resp.state == RESP_ERROR) {
+        c->keepServer = false; // the server sent more than the response
+    }
+    if (c->is_cacheable) {
+        c->cacheLen += used;
+        // if too big we won't cache
+        if (c->cacheLen > web_cache->maxObject && !c->segmented) {
+            memcpy(c->relay, chunk, used);
+            chunk = c->relay;
+            conn_cachebuf_drop(c);
+            conn_start_splice(c);
+        }
+    }
+
+    if (c->filling) {
+        conn_fill_output(c, chunk, used);
+    } else {
+        conn_output(c, chunk, used);
+    }
+    conn_relay_flush(c);
+}
+
+/*
+ * conn_splice_flush - moving the response bytes in the pipe on to the client.
+ * As with conn_relay_flush(), we stop reading from the server while the
+ * client can't keep up.
+ */
+static void conn_splice_flush(conn_t *c) {
+    while (c->pipeLen > 0) {
+        ssize_t n = splice(c->pipefd[0], NULL, c->client.fd, NULL, c->pipeLen,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (set_interest(c, &c->server, 0) < 0 ||
+                set_interest(c, &c->client, EPOLLOUT) < 0) {
+                conn_close(c);
+            }
+            return;
+        }
+        if (n <= 0) {
+            fprintf(stderr, "Could not write response to client\n");
+            conn_close(c);
+            return;
+        }
+        c->pipeLen -= (size_t)n;
+    }
+    if (c->resp.state != RESP_BODY) {
+        conn_relay_done(c);
+        return;
+    }
+    if (set_interest(c, &c->client, 0) < 0 ||
+        set_interest(c, &c->server, EPOLLIN) < 0) {
+        conn_close(c);
+    }
+}
+
+// moving the next chunk of an uncacheable response from the server into the
+// pipe without copying it through user space. A response framed by its
+// length is moved no further than its end, so the server connection can be
+// reused.
+static void conn_splice_read(conn_t *c) {
+    size_t len = SPLICE_CHUNK;
+    if (c->resp.framing == FRAMING_LENGTH && c->resp.remaining < len) {
+        len = (size_t)c->resp.remaining;
+    }
+    ssize_t bytesR;
+    do {
+        bytesR = splice(c->server.fd, NULL, c->pipefd[1], NULL, len,
+                        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    } while (bytesR < 0 && errno == EINTR);
+
+    if (bytesR < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+    }
+    if (bytesR <= 0) {
+        if (bytesR == 0) {
+            response_eof(&c->resp);
+        } else {
+            c->resp.state = RESP_ERROR;
+        }
+        conn_relay_done(c);
+        return;
+    }
+    c->totalBytesR += (size_t)bytesR;
+    metrics_add(&c->worker->metrics, METRIC_ORIGIN_BYTES, (uint64_t)bytesR);
+    c->pipeLen += (size_t)bytesR;
+    response_consumed(&c->resp, (size_t)bytesR);
+    conn_splice_flush(c);
+}
+
+// dispatching an epoll event on one socket of a connection by its state.
+static void conn_event(conn_t *c, conn_end_t *end) {
+    // a kept-alive connection may have moved on to its next request while
+    // events for the previous one were still pending in the batch.
+    if (end->events == 0) {
+        return;
+    }
+    switch (c->state) {
+    case CONN_READ_REQUEST:
+        conn_read_request(c);
+        break;
+    case CONN_COALESCE: // only left by conn_coalesced()
+    case CONN_RESOLVE:  // only left by conn_resolved()
+        break;
+    case CONN_CONNECT:
+        conn_connected(c);
+        break;
+    case CONN_SEND_REQUEST:
+        conn_send_request(c);
+        break;
+    case CONN_SEND_BODY:
+        conn_send_body(c);
+        break;
+    case CONN_RELAY:
+        if (end == &c->server) {
+            conn_relay_read(c);
+        } else {
+            conn_relay_flush(c);
+        }
+        break;
+    case CONN_SPLICE:
+        if (end == &c->server) {
+            conn_splice_read(c);
+        } else if (conn_output_pending(c)) {
+            // the last chunk relayed through user space is still pending.
+            conn_relay_flush(c);
+        } else {
+            conn_splice_flush(c);
+        }
+        break;
+    case CONN_SERVE_CACHE:
+        conn_serve_cache(c);
+        break;
+    case CONN_CLOSED:
+        break;
+    }
+}
+
+static const char shed_response[] = "HTTP/1.1 503 Service Unavailable\r\n"
+                                    "Retry-After: 1\r\n"
+                                    "Content-Length: 0\r\n"
+                                    "Connection: close\r\n\r\n";
+
+/*
+ * shed_client - turning a client away with a 503, as the proxy has no room
+ * for it. Whatever the client has sent is read first, so that closing the
+ * socket doesn't reset the connection before the 503 gets to it.
+ */
+static void shed_client(worker_t *w, int connfd) {
+    char buf[MAXLINE];
+    for (int i = 0; i < 4 && read(connfd, buf, sizeof(buf)) > 0; i++) {
+    }
+    // a fresh socket takes the few bytes, and there is nothing to do if not.
+    ssize_t n = write(connfd, shed_response, sizeof(shed_response) - 1);
+    (void)n;
+    close(connfd);
+    metrics_add(&w->metrics, METRIC_SHED, 1);
+}
+
+// serving a client admitted under max_clients on a connection of its own.
+static void start_client(worker_t *w, int connfd) {
+    // responses go out in as few writes as possible already, so waiting to
+    // coalesce their last segment with more only stalls the client.
+    int one = 1;
+    setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    conn_t *c = conn_new(w, connfd);
+    if (c == NULL) {
+        close(connfd);
+        admit_release();
+        return;
+    }
+    metrics_add(&w->metrics, METRIC_ACCEPTED, 1);
+    if (set_interest(c, &c->client, EPOLLIN) < 0) {
+        conn_close(c);
+    }
+}
+
+// holding on to a client accepted over the limit until a slot frees up, or
+// shedding it if the worker already holds as many as it can.
+static void hold_client(worker_t *w, int connfd) {
+    if (w->heldCnt == ADMIT_QUEUE) {
+        shed_client(w, connfd);
+        return;
+    }
+    int i = (w->heldFirst + w->heldCnt) % ADMIT_QUEUE;
+    w->heldFds[i] = connfd;
+    w->heldSince[i] = metrics_clock();
+    w->heldCnt++;
+}
+
+// admitting the clients held by the worker, oldest first, while there are
+// slots for them, and shedding the ones that have waited too long.
+static void admit_held(worker_t *w) {
+    uint64_t now = metrics_clock();
+    while (w->heldCnt > 0) {
+        int connfd = w->heldFds[w->heldFirst];
+        bool expired = now - w->heldSince[w->heldFirst] >
+                       (uint64_t)ADMIT_WAIT_MS * 1000;
+        if (!expired && !admit_slot()) {
+            return;
+        }
+        w->heldFirst = (w->heldFirst + 1) % ADMIT_QUEUE;
+        w->heldCnt--;
+        if (expired) {
+            shed_client(w, connfd);
+        } else {
+            start_client(w, connfd);
+        }
+    }
+}
+
+/*
+ * accept_clients - accepting every pending client connection on the worker's
+ * listening socket. Clients beyond max_clients are held, rather than left in
+ * the listen backlog, so the worker isn't woken for them over and over, and
+ * new clients queue up behind the held ones.
+ */
+static void accept_clients(worker_t *w) {
+    while (true) {
+        int connfd = accept4(w->listenfd, NULL, NULL,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (connfd < 0) {
+            // another worker may have beaten us to it.
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("accept");
+            }
+            return;
+        }
+        if (w->heldCnt > 0 || !admit_slot()) {
+            hold_client(w, connfd);
+            continue;
+        }
+        start_client(w, connfd);
+    }
+}
+
+/*
+ * worker_routine - the event loop of a single worker thread. Every worker
+ * accepts from the shared listening socket and then drives the connections it
+ * accepted through their states until they are closed.
+ */
+static void *worker_routine(void *args) {
+    worker_t *w = (worker_t *)args;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (true) {
+        // waking up now and then to drop idle server connections, and more
+        // often to admit held clients.
+        int timeout = w->pool.nidle > 0 ? 1000 : -1;
+        if (w->heldCnt > 0) {
+            timeout = ADMIT_RETRY_MS;
+        }
+        int n = epoll_wait(w->epfd, events, MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            return NULL;
+        }
+        for (int i = 0; i < n; i++) {
+            // the listening socket and the eventfds are the only ones
+            // registered without a conn_end_t.
+            if (events[i].data.ptr == NULL) {
+                accept_clients(w);
+                continue;
+            }
+            if (events[i].data.ptr == &w->resolved) {
+                resolve_req_t *req = resolver_completed(&w->resolved);
+                while (req != NULL) {
+                    // the connection may start a new lookup with req.
+                    resolve_req_t *next = req->next;
+                    conn_resolved((conn_t *)req->owner);
+                    req = next;
+                }
+                continue;
+            }
+            if (events[i].data.ptr == &w->coalesced) {
+                inflight_wait_t *wait = inflight_completed(&w->coalesced);
+                while (wait != NULL) {
+                    inflight_wait_t *next = wait->next;
+                    conn_coalesced((conn_t *)wait->owner);
+                    wait = next;
+                }
+                continue;
+            }
+            conn_end_t *end = (conn_end_t *)events[i].data.ptr;
+            conn_event(end->conn, end);
+        }
+        // freeing the connections closed during this batch.
+        while (w->dead != NULL) {
+            conn_t *c = w->dead;
+            w->dead = c->nextDead;
+            free(c);
+        }
+        upstream_sweep(&w->pool);
+        if (w->heldCnt > 0) {
+            admit_held(w);
+        }
+    }
+}
+
+/*
+ * warmup_fetch - fetching a URL through the proxy over the connection in *fd,
+ * opening a new one first if there's none, and reading the response to the
+ * end. The connection is closed if the proxy won't keep it open.
+ *
+ * @params[in,out] fd the connection to the proxy, -1 if there is none
+ * @params[in] port the port the proxy listens on
+ * @params[in] url the URL
+ * @params[out] resp the parser the response is read with
+ *
+ * @return the status of the response, or -1 if there wasn't a whole one.
+ */
+static int warmup_fetch(int *fd, const char *port, const char *url,
+                        http_response_t *resp) {
+    char req[MAXLINE + 32];
+    int n = snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\n\r\n", url);
+    if (n < 0 || (size_t)n >= sizeof(req)) {
+        return -1;
+    }
+    if (*fd < 0) {
+        struct timeval timeout = {WARMUP_TIMEOUT, 0};
+        if ((*fd = open_clientfd("127.0.0.1", port)) < 0) {
+            return -1;
+        }
+        setsockopt(*fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    }
+    response_init(resp);
+    if (rio_writen(*fd, req, (size_t)n) != n) {
+        resp->state = RESP_ERROR;
+    }
+    char buf[MAXBUF];
+    while (resp->state == RESP_HEADERS || resp->state == RESP_BODY) {
+        ssize_t got = read(*fd, buf, sizeof(buf));
+        if (got <= 0) {
+            response_eof(resp);
+            break;
+        }
+        // the parser stops after the header block, so it is fed the rest.
+        size_t off = 0;
+        size_t used = 1;
+        while (off < (size_t)got && used > 0) {
+            used = response_feed(resp, buf + off, (size_t)got - off);
+            off += used;
+        }
+    }
+    if (resp->state != RESP_DONE || !resp->keepAlive) {
+        close(*fd);
+        *fd = -1;
+    }
+    return resp->state == RESP_DONE ? resp->status : -1;
+}
+
+/* The list of URLs the warmup thread fetches, and where from. */
+typedef struct warmup {
+    const char *path; // the file listing the URLs, one per line
+    const char *port; // the port the proxy listens on
+} warmup_t;
+
+/*
+ * warmup_routine - warming up the cache by fetching every URL listed in a
+ * file through the proxy itself, as a client would, so the responses are
+ * cached as any miss would be. URLs are fetched one at a time, over one
+ * connection, to spare the servers. Blank lines and lines starting with '#'
+ * are skipped.
+ */
+static void *warmup_routine(void *args) {
+    warmup_t *warmup = (warmup_t *)args;
+    FILE *file = fopen(warmup->path, "r");
+    http_response_t *resp = (http_response_t *)malloc(sizeof(http_response_t));
+    if (file == NULL || resp == NULL) {
+        perror(warmup->path);
+        if (file != NULL) {
+            fclose(file);
+        }
+        free(resp);
+        return NULL;
+    }
+    char line[MAXLINE];
+    int fd = -1;
+    long listed = 0;
+    long fetched = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        char *url = line + strspn(line, " \t");
+        if (*url == '\0' || *url == '#') {
+            continue;
+        }
+        listed++;
+        if (warmup_fetch(&fd, warmup->port, url, resp) == 200) {
+            fetched++;
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    fclose(file);
+    free(resp);
+    fprintf(stderr, "Warmed up the cache with %ld of %ld URLs from %s\n",
+            fetched, listed, warmup->path);
+    return NULL;
+}
+
+/*
+ * snapshot_routine - writing a snapshot of the cache every time the proxy is
+ * sent SIGUSR1, which every other thread blocks, so that a proxy about to be
+ * replaced can hand its hot set over to the next one.
+ */
+static void *snapshot_routine(void *args) {
+    const char *path = (const char *)args;
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    while (true) {
+        int sig;
+        if (sigwait(&set, &sig) == 0) {
+            snapshot_dump(path);
+        }
+    }
+    return NULL;
+}
+
+/* The settings of the proxy, from a config file and the command line. */
+typedef struct proxy_config {
+    size_t cacheSize; // max size of the cache in bytes
+    size_t maxObject; // max size of a cached response in bytes
+    int shards;       // number of cache shards, 0 to pick it from the sizes
+    bool useMemfd;    // zero-copy cache hits from memfd-backed objects
+    char policy[16];  // name of the cache eviction and admission policy
+    char diskPath[MAXLINE]; // file of the disk cache tier, "" for none
+    size_t diskSize;        // max size of the disk cache tier in bytes
+    size_t staleWhile; // seconds a response without stale-while-revalidate
+                       // may be served stale for while refreshed
+    char tracePath[MAXLINE]; // file traced requests go to, "" for none
+    size_t traceRate;        // one request in traceRate is traced
+    char keyIgnore[MAXLINE]; // query parameters left out of cache keys
+    size_t maxClients; // max open client connections, 0 for no limit
+    bool reusePort;    // a listening socket per worker, with SO_REUSEPORT
+    size_t compressLevel; // zlib level of compressed variants, 0 for none
+    char snapshotPath[MAXLINE]; // snapshot loaded at startup and written on
+                                // SIGUSR1, "" for none
+    char warmupPath[MAXLINE]; // URLs fetched at startup, "" for none
+} proxy_config_t;
+
+// parsing a size in bytes, optionally suffixed with K, M or G (powers of 1024).
+static bool parse_size(const char *str, size_t *size) {
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(str, &end, 10);
+    if (end == str || errno != 0 || *str == '-') {
+        return false;
+    }
+    int shift = 0;
+    switch (toupper((unsigned char)*end)) {
+    case 'K':
+        shift = 10;
+        break;
+    case 'M':
+        shift = 20;
+        break;
+    case 'G':
+        shift = 30;
+        break;
+    case '\0':
+        break;
+    default:
+        return false;
+    }
+    if (shift != 0 && *++end != '\0') {
+        return false;
+    }
+    if (value > (SIZE_MAX >> shift)) {
+        return false;
+    }
+    *size = (size_t)value << shift;
+    return true;
+}
+
+// parsing a plain number of seconds, with no suffix.
+static bool parse_seconds(const char *str, size_t *seconds) {
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(str, &end, 10);
+    if (end == str || *end != '\0' || errno != 0 || *str == '-' ||
+        value > SIZE_MAX) {
+        return false;
+    }
+    *seconds = (size_t)value;
+    return true;
+}
+
+// parsing a yes/no setting.
+static bool parse_bool(const char *str, bool *value) {
+    if (strcmp(str, "yes") == 0 || strcmp(str, "true") == 0 ||
+        strcmp(str, "1") == 0) {
+        *value = true;
+        return true;
+    }
+    if (strcmp(str, "no") == 0 || strcmp(str, "false") == 0 ||
+        strcmp(str, "0") == 0) {
+        *value = false;
+        return true;
+    }
+    return false;
+}
+
+/*
+ * config_set - setting one of the settings by its name in a config file.
+ *
+ * @return false if the name or the value is invalid.
+ */
+static bool config_set(proxy_config_t *config, const char *name,
+                       const char *value) {
+    if (strcmp(name, "cache_size") == 0) {
+        return parse_size(value, &config->cacheSize);
+    }
+    if (strcmp(name, "max_object_size") == 0) {
+        return parse_size(value, &config->maxObject);
+    }
+    if (strcmp(name, "shards") == 0) {
+        size_t shards;
+        if (!parse_size(value, &shards) || shards > CACHE_SHARDS_MAX) {
+            return false;
+        }
+        config->shards = (int)shards;
+        return true;
+    }
+    if (strcmp(name, "policy") == 0) {
+        // the name itself is checked when the cache is set up.
+        if (strlen(value) >= sizeof(config->policy)) {
+            return false;
+        }
+        strcpy(config->policy, value);
+        return true;
+    }
+    if (strcmp(name, "disk_path") == 0) {
+        if (strlen(value) >= sizeof(config->diskPath)) {
+            return false;
+        }
+        strcpy(config->diskPath, value);
+        return true;
+    }
+    if (strcmp(name, "disk_size") == 0) {
+        return parse_size(value, &config->diskSize);
+    }
+    if (strcmp(name, "stale_while_revalidate") == 0) {
+        return parse_seconds(value, &config->staleWhile) &&
+               config->staleWhile <= RESP_HEURISTIC_MAX;
+    }
+    if (strcmp(name, "trace_path") == 0) {
+        if (strlen(value) >= sizeof(config->tracePath)) {
+            return false;
+        }
+        strcpy(config->tracePath, value);
+        return true;
+    }
+    if (strcmp(name, "trace_rate") == 0) {
+        return parse_size(value, &config->traceRate) &&
+               config->traceRate > 0 && config->traceRate <= UINT_MAX;
+    }
+    if (strcmp(name, "cache_key_ignore") == 0) {
+        if (strlen(value) >= sizeof(config->keyIgnore)) {
+            return false;
+        }
+        strcpy(config->keyIgnore, value);
+        return true;
+    }
+    if (strcmp(name, "max_connections") == 0) {
+        return parse_size(value, &config->maxClients) &&
+               config->maxClients <= INT_MAX;
+    }
+    if (strcmp(name, "reuse_port") == 0) {
+        return parse_bool(value, &config->reusePort);
+    }
+    if (strcmp(name, "compress_level") == 0) {
+        return parse_size(value, &config->compressLevel) &&
+               config->compressLevel <= 9;
+    }
+    if (strcmp(name, "snapshot_path") == 0) {
+        if (strlen(value) >= sizeof(config->snapshotPath)) {
+            return false;
+        }
+        strcpy(config->snapshotPath, value);
+        return true;
+    }
+    if (strcmp(name, "warmup_path") == 0) {
+        if (strlen(value) >= sizeof(config->warmupPath)) {
+            return false;
+        }
+        strcpy(config->warmupPath, value);
+        return true;
+    }
+    if (strcmp(name, "memfd") == 0) {
+        return parse_bool(value, &config->useMemfd);
+    }
+    return false;
+}
+
+/*
+ * load_config - reading settings from a config file. Every line is either
+ * blank, a comment starting with '#', or a "name = value" pair, where the
+ * names are those of config_set().
+ *
+ * @return false if the file can't be read or has an invalid line.
+ */
+static bool load_config(proxy_config_t *config, const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return false;
+    }
+    char line[MAXLINE];
+    int lineno = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), file) != NULL) {
+        lineno++;
+        char *hash = strchr(line, '#');
+        if (hash != NULL) {
+            *hash = '\0';
+        }
+        if (line[strspn(line, " \t\r\n")] == '\0') {
+            continue; // blank line
+        }
+        char name[MAXLINE];
+        char value[MAXLINE];
+        char extra;
+        if (sscanf(line, " %[^= \t\r\n] = %s %c", name, value, &extra) != 2 ||
+            !config_set(config, name, value)) {
+            fprintf(stderr, "%s:%d: invalid setting\n", path, lineno);
+            ok = false;
+        }
+    }
+    fclose(file);
+    return ok;
+}
+
+// printing how to run the proxy, and exiting.
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-z] [-c cache_size] [-o max_object_size] [-s shards]"
+            " [-p tinylfu|slru|lru] [-d disk_path] [-D disk_size]"
+            " [-w stale_while_revalidate] [-t trace_path] [-r trace_rate]"
+            " [-q cache_key_ignore] [-m max_connections] [-R]"
+            " [-g compress_level] [-S snapshot_path] [-W warmup_path]"
+            " [-f config] <port>\n",
+            prog);
+    exit(1);
+}
+
+/*
+ * open_worker_listenfd - opening a listening socket of a worker's own on
+ * port. Every worker binds the port with SO_REUSEPORT, and the kernel spreads
+ * incoming connections across their sockets, so the workers don't all wait
+ * on one accept queue.
+ *
+ * @return the non-blocking socket, or -1 on error.
+ */
+static int open_worker_listenfd(const char *port) {
+    struct addrinfo hints, *listp, *p;
+    int listenfd = -1, rc, optval = 1;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+    if ((rc = getaddrinfo(NULL, port, &hints, &listp)) != 0) {
+        fprintf(stderr, "getaddrinfo failed (port %s): %s\n", port,
+                gai_strerror(rc));
+        return -1;
+    }
+    for (p = listp; p; p = p->ai_next) {
+        listenfd = socket(p->ai_family,
+                          p->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                          p->ai_protocol);
+        if (listenfd < 0) {
+            continue; /* Socket failed, try the next */
+        }
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval,
+                   sizeof(optval));
+        if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &optval,
+                       sizeof(optval)) == 0 &&
+            bind(listenfd, p->ai_addr, p->ai_addrlen) == 0) {
+            break; /* Success */
+        }
+        close(listenfd);
+    }
+    freeaddrinfo(listp);
+    if (!p) { /* No address worked */
+        return -1;
+    }
+    if (listen(listenfd, LISTENQ) < 0) {
+        close(listenfd);
+        return -1;
+    }
+    return listenfd;
+}
+
+int main(int argc, char **argv) {
+    int listenfd = -1;
+    proxy_config_t config = {MAX_CACHE_SIZE, MAX_OBJECT_SIZE, 0, false,
+                             "tinylfu", "", DISK_DEFAULT_SIZE, 0,
+                             "", TRACE_DEFAULT_RATE, "", 0, false, 0, "", ""};
+    int opt;
+    // ignoring sigpipe signals
+    signal(SIGPIPE, SIG_IGN);
+    /* Check command line args, later ones override a config file before */
+    const char *opts = "zc:o:s:p:d:D:w:t:r:q:m:Rg:S:W:f:";
+    while ((opt = getopt(argc, argv, opts)) != -1) {
+        bool ok = true;
+        switch (opt) {
+        case 'z': // zero-copy cache hits from memfd-backed objects
+            config.useMemfd = true;
+            break;
+        case 'c': // cache capacity
+            ok = config_set(&config, "cache_size", optarg);
+            break;
+        case 'o': // object size limit
+            ok = config_set(&config, "max_object_size", optarg);
+            break;
+        case 's': // cache shards
+            ok = config_set(&config, "shards", optarg);
+            break;
+        case 'p': // cache policy
+            ok = config_set(&config, "policy", optarg);
+            break;
+        case 'd': // disk cache tier
+            ok = config_set(&config, "disk_path", optarg);
+            break;
+        case 'D': // disk cache tier size
+            ok = config_set(&config, "disk_size", optarg);
+            break;
+        case 'w': // serving stale while refreshing
+            ok = config_set(&config, "stale_while_revalidate", optarg);
+            break;
+        case 't': // request tracing
+            ok = config_set(&config, "trace_path", optarg);
+            break;
+        case 'r': // requests per traced request
+            ok = config_set(&config, "trace_rate", optarg);
+            break;
+        case 'q': // query parameters left out of cache keys
+            ok = config_set(&config, "cache_key_ignore", optarg);
+            break;
+        case 'm': // admission control
+            ok = config_set(&config, "max_connections", optarg);
+            break;
+        case 'R': // a listening socket per worker
+            config.reusePort = true;
+            break;
+        case 'g': // compressed variants of cached responses
+            ok = config_set(&config, "compress_level", optarg);
+            break;
+        case 'S': // cache snapshots
+            ok = config_set(&config, "snapshot_path", optarg);
+            break;
+        case 'W': // cache warmup
+            ok = config_set(&config, "warmup_path", optarg);
+            break;
+        case 'f': // config file
+            if (!load_config(&config, optarg)) {
+                exit(1);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+        if (!ok) {
+            fprintf(stderr, "invalid value for -%c: %s\n", opt, optarg);
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+    }
+    const char *port = argv[optind];
+    // SIGUSR1 is left to the snapshot thread, so it is blocked before any
+    // other thread is started, which they all inherit.
+    sigset_t snapshotSignal;
+    sigemptyset(&snapshotSignal);
+    sigaddset(&snapshotSignal, SIGUSR1);
+    if (config.snapshotPath[0] != '\0') {
+        pthread_sigmask(SIG_BLOCK, &snapshotSignal, NULL);
+    }
+    // initialising the proxy cache
+    init_web_cache(config.cacheSize, config.maxObject, config.shards,
+                   config.policy);
+    if (web_cache == NULL) {
+        exit(1);
+    }
+    web_cache->useMemfd = config.useMemfd;
+    default_stale_while = (long)config.staleWhile;
+    if (config.keyIgnore[0] != '\0') {
+        cache_key_ignore = config.keyIgnore;
+    }
+    max_clients = (int)config.maxClients;
+    atomic_init(&active_clients, 0);
+    // the disk tier is warmed up with whatever an earlier run left in it.
+    if (config.diskPath[0] != '\0' &&
+        (web_cache->disk = disk_open(config.diskPath, config.diskSize)) ==
+            NULL) {
+        exit(1);
+    }
+    // initialsing the lock for the proxy.
+    init_cache_lock();
+    // a snapshot that can't be loaded only means starting out cold.
+    if (config.snapshotPath[0] != '\0') {
+        long loaded = snapshot_load(config.snapshotPath);
+        if (loaded > 0) {
+            fprintf(stderr, "Loaded %ld objects from %s\n", loaded,
+                    config.snapshotPath);
+        }
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, snapshot_routine,
+                           config.snapshotPath) != 0) {
+            fprintf(stderr, "Failed to start snapshot thread\n");
+            exit(1);
+        }
+        pthread_detach(tid);
+    }
+    if (config.tracePath[0] != '\0' &&
+        !trace_init(config.tracePath, (unsigned)config.traceRate)) {
+        exit(1);
+    }
+    if (config.compressLevel > 0) {
+        if (!compress_init((int)config.compressLevel)) {
+            fprintf(stderr, "Failed to start compression thread\n");
+            exit(1);
+        }
+        compress_hits = true;
+    }
+    // server hosts are resolved off the event loops.
+    if (resolver_init() < 0) {
+        fprintf(stderr, "Failed to start resolver threads\n");
+        exit(1);
+    }
+    // listening to incoming requests from client, on a socket shared by the
+    // workers unless each opens its own.
+    if (!config.reusePort) {
+        listenfd = open_listenfd(port);
+        // make sure its a valid file descriptor
+        if (listenfd < 0) {
+            fprintf(stderr, "Failed to listen on port: %s\n", port);
+            exit(1);
+        }
+        // workers accept concurrently, so accept must never block.
+        if (fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK) <
+            0) {
+            perror("fcntl");
+            exit(1);
+        }
+    }
+
+    // one event loop worker per core
+    long nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nworkers < 1) {
+        nworkers = 1;
+    }
+    // aligned, as the counters of a worker take cache lines of their own.
+    void *mem = NULL;
+    if (posix_memalign(&mem, 64, (size_t)nworkers * sizeof(worker_t)) != 0) {
+        fprintf(stderr, "Failed to allocate workers\n");
+        exit(1);
+    }
+    worker_t *workers = (worker_t *)memset(mem, 0,
+                                           (size_t)nworkers * sizeof(worker_t));
+    for (long i = 0; i < nworkers; i++) {
+        worker_t *w = &workers[i];
+        w->listenfd = listenfd;
+        if (config.reusePort &&
+            (w->listenfd = open_worker_listenfd(port)) < 0) {
+            fprintf(stderr, "Failed to listen on port: %s\n", port);
+            exit(1);
+        }
+        metrics_register(&w->metrics);
+        if (config.tracePath[0] != '\0' &&
+            (w->trace = trace_ring_new()) == NULL) {
+            fprintf(stderr, "Failed to allocate trace ring\n");
+            exit(1);
+        }
+        upstream_init(&w->pool);
+        if ((w->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+            perror("epoll_create1");
+            exit(1);
+        }
+        // EPOLLEXCLUSIVE wakes a single worker per incoming connection on a
+        // shared socket.
+        struct epoll_event ev;
+        ev.events = config.reusePort ? EPOLLIN : EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->listenfd, &ev) < 0) {
+            perror("epoll_ctl");
+            exit(1);
+        }
+        if (resolver_notify_init(&w->resolved) < 0) {
+            perror("eventfd");
+            exit(1);
+        }
+        ev.events = EPOLLIN;
+        ev.data.ptr = &w->resolved;
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->resolved.efd, &ev) < 0) {
+            perror("epoll_ctl");
+            exit(1);
+        }
+        if (inflight_notify_init(&w->coalesced) < 0) {
+            perror("eventfd");
+            exit(1);
+        }
+        ev.data.ptr = &w->coalesced;
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->coalesced.efd, &ev) < 0) {
+            perror("epoll_ctl");
+            exit(1);
+        }
+        if (pthread_create(&w->tid, NULL, worker_routine, w) != 0) {
+            fprintf(stderr, "Failed to start worker thread\n");
+            exit(1);
+        }
+    }
+    // the workers are listening, so the warmup can go through them.
+    static warmup_t warmup;
+    if (config.warmupPath[0] != '\0') {
+        warmup = (warmup_t){config.warmupPath, port};
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, warmup_routine, &warmup) != 0) {
+            fprintf(stderr, "Failed to start warmup thread\n");
+            exit(1);
+        }
+        pthread_detach(tid);
+    }
+    // continously running and attending client requests
+    for (long i = 0; i < nworkers; i++) {
+        pthread_join(workers[i].tid, NULL);
     }
     return 0;
 }
@@ -0,0 +1,251 @@
+/*
+ * @file: resolver.c
+ * @brief: the resolver threads and the cache of resolved hosts, following the
+ * signature in resolver.h. Cached entries are chained into a hash table on
+ * "host:port" under a single mutex, which is only held for the table lookup
+ * itself. Entries still being resolved sit on a queue that the resolver
+ * threads take them from.
+ *
+ * @Author Sanah Imani <simani@unix.andrew.cmu.edu>
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // AI_ADDRCONFIG
+#endif
+
+#include <resolver.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static resolver_entry_t *buckets[RESOLVER_BUCKETS]; // the cached hosts
+static resolver_entry_t *queue_head; // entries waiting for a resolver thread
+static resolver_entry_t *queue_tail;
+
+// the monotonic clock in seconds, unaffected by changes to the wall clock.
+static time_t now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+// FNV-1a, as for cache keys.
+static size_t bucket_of(const char *key) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char *p = key; *p != '\0'; p++) {
+        hash = (hash ^ (unsigned char)*p) * 1099511628211ULL;
+    }
+    return (size_t)(hash & (RESOLVER_BUCKETS - 1));
+}
+
+void resolver_release(resolver_entry_t *entry) {
+    if (atomic_fetch_sub(&entry->refcnt, 1) == 1) {
+        if (entry->addrs != NULL) {
+            freeaddrinfo(entry->addrs);
+        }
+        free(entry);
+    }
+}
+
+/*a helper removing an entry from the hash table and dropping the table's
+ *reference to it. The caller holds table_lock.
+ */
+static void table_remove(resolver_entry_t **link) {
+    resolver_entry_t *entry = *link;
+    *link = entry->hnext;
+    entry->hnext = NULL;
+    resolver_release(entry);
+}
+
+/*a helper telling a worker that one of its lookups has finished.*/
+static void notify_done(resolve_req_t *req) {
+    resolver_notify_t *n = req->notify;
+    pthread_mutex_lock(&n->lock);
+    req->next = n->done;
+    n->done = req;
+    pthread_mutex_unlock(&n->lock);
+    uint64_t one = 1;
+    if (write(n->efd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("write eventfd");
+    }
+}
+
+/*
+ * resolver_routine - a resolver thread, calling getaddrinfo() for the entries
+ * on the queue one at a time and handing each result to every lookup that
+ * waited for it.
+ */
+static void *resolver_routine(void *args) {
+    (void)args;
+    while (true) {
+        pthread_mutex_lock(&table_lock);
+        while (queue_head == NULL) {
+            pthread_cond_wait(&queue_cond, &table_lock);
+        }
+        resolver_entry_t *entry = queue_head;
+        queue_head = entry->qnext;
+        if (queue_head == NULL) {
+            queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&table_lock);
+
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(struct addrinfo));
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+        struct addrinfo *addrs = NULL;
+        int rc = getaddrinfo(entry->host, entry->port, &hints, &addrs);
+
+        pthread_mutex_lock(&table_lock);
+        entry->addrs = rc == 0 ? addrs : NULL;
+        entry->error = rc;
+        entry->ready = true;
+        entry->expires =
+            now_sec() + (rc == 0 ? RESOLVER_TTL : RESOLVER_NEG_TTL);
+        resolve_req_t *waiters = entry->waiters;
+        entry->waiters = NULL;
+        pthread_mutex_unlock(&table_lock);
+
+        // the queue's reference to the entry is passed on to the first
+        // waiter, which every entry on the queue has.
+        bool first = true;
+        while (waiters != NULL) {
+            resolve_req_t *req = waiters;
+            waiters = req->next;
+            if (!first) {
+                atomic_fetch_add(&entry->refcnt, 1);
+            }
+            first = false;
+            req->entry = entry;
+            notify_done(req);
+        }
+    }
+    return NULL;
+}
+
+int resolver_init(void) {
+    for (int i = 0; i < RESOLVER_THREADS; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, resolver_routine, NULL) != 0) {
+            return -1;
+        }
+        pthread_detach(tid);
+    }
+    return 0;
+}
+
+int resolver_notify_init(resolver_notify_t *n) {
+    n->done = NULL;
+    pthread_mutex_init(&n->lock, NULL);
+    n->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return n->efd < 0 ? -1 : 0;
+}
+
+/*a helper allocating the entry of a host and port not in the table yet, with
+ *its strings in the same block.
+ */
+static resolver_entry_t *entry_new(const char *host, const char *port,
+                                   const char *key, size_t keyLen) {
+    size_t hostLen = strlen(host);
+    size_t portLen = strlen(port);
+    resolver_entry_t *entry = (resolver_entry_t *)malloc(
+        sizeof(resolver_entry_t) + keyLen + hostLen + portLen + 3);
+    if (entry == NULL) {
+        return NULL;
+    }
+    entry->key = (char *)(entry + 1);
+    entry->host = entry->key + keyLen + 1;
+    entry->port = entry->host + hostLen + 1;
+    memcpy(entry->key, key, keyLen + 1);
+    memcpy(entry->host, host, hostLen + 1);
+    memcpy(entry->port, port, portLen + 1);
+    entry->addrs = NULL;
+    entry->error = 0;
+    entry->ready = false;
+    entry->expires = 0;
+    entry->waiters = NULL;
+    // one reference for the table, one for the resolver thread to pass on.
+    atomic_init(&entry->refcnt, 2);
+    entry->hnext = NULL;
+    entry->qnext = NULL;
+    return entry;
+}
+
+bool resolver_lookup(const char *host, const char *port, resolve_req_t *req) {
+    req->entry = NULL;
+    char key[RESOLVER_KEYLEN];
+    int len = snprintf(key, sizeof(key), "%s:%s", host, port);
+    if (len < 0 || (size_t)len >= sizeof(key)) {
+        return true; // too long for a host name, so there is no entry
+    }
+    time_t now = now_sec();
+
+    pthread_mutex_lock(&table_lock);
+    resolver_entry_t **bucket = &buckets[bucket_of(key)];
+    resolver_entry_t **link = bucket;
+    resolver_entry_t *entry = NULL;
+    while (*link != NULL) {
+        resolver_entry_t *e = *link;
+        // dropping stale results on the way, so the table never fills up
+        // with hosts no longer asked for.
+        if (e->ready && e->expires <= now) {
+            table_remove(link);
+            continue;
+        }
+        if (strcmp(e->key, key) == 0) {
+            entry = e;
+            break;
+        }
+        link = &e->hnext;
+    }
+    if (entry != NULL && entry->ready) {
+        atomic_fetch_add(&entry->refcnt, 1);
+        pthread_mutex_unlock(&table_lock);
+        req->entry = entry;
+        return true;
+    }
+    if (entry != NULL) {
+        // a lookup of the same host is already in progress, so share it.
+        req->next = entry->waiters;
+        entry->waiters = req;
+        pthread_mutex_unlock(&table_lock);
+        return false;
+    }
+
+    if ((entry = entry_new(host, port, key, (size_t)len)) == NULL) {
+        pthread_mutex_unlock(&table_lock);
+        return true;
+    }
+    entry->waiters = req;
+    req->next = NULL;
+    entry->hnext = *bucket;
+    *bucket = entry;
+    if (queue_tail != NULL) {
+        queue_tail->qnext = entry;
+    } else {
+        queue_head = entry;
+    }
+    queue_tail = entry;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&table_lock);
+    return false;
+}
+
+resolve_req_t *resolver_completed(resolver_notify_t *n) {
+    uint64_t count;
+    if (read(n->efd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("read eventfd");
+    }
+    pthread_mutex_lock(&n->lock);
+    resolve_req_t *done = n->done;
+    n->done = NULL;
+    pthread_mutex_unlock(&n->lock);
+    return done;
+}
@@ -0,0 +1,110 @@
+/*
+ * @file: resolver.h
+ * @brief: a non-blocking resolver for the server hosts the proxy connects to,
+ * with a cache of the results keyed by host and port. getaddrinfo() blocks
+ * for as long as the DNS server takes to answer, so it is only ever called on
+ * a few resolver threads of its own, never on an event loop. A worker asking
+ * for a host gets the cached addresses straight away if there are any, and
+ * is otherwise told once a resolver thread has looked the host up, through
+ * the eventfd of its resolver_notify_t.
+ *
+ * Concurrent lookups of the same host and port, from any worker, share a
+ * single getaddrinfo() call. Results are cached for RESOLVER_TTL seconds and
+ * failures for RESOLVER_NEG_TTL, as getaddrinfo() doesn't tell us how long
+ * the DNS records are valid for.
+ *
+ * @Author Sanah Imani <simani@unix.andrew.cmu.edu>
+ */
+
+#ifndef __RESOLVER_H__
+#define __RESOLVER_H__
+
+#include <netdb.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <time.h>
+
+#define RESOLVER_THREADS 4        // threads calling getaddrinfo()
+#define RESOLVER_TTL 60           // seconds a resolved host is cached for
+#define RESOLVER_NEG_TTL 5        // seconds a failed lookup is cached for
+#define RESOLVER_BUCKETS 256      // hash buckets of cached hosts, a power of 2
+#define RESOLVER_KEYLEN (256 + 8) // max length of "host:port"
+
+struct resolve_req;
+
+/* The addresses of a host and port, shared by everyone who looked it up. */
+typedef struct resolver_entry {
+    char *key;                 // "host:port"
+    char *host;                // the host part of key
+    char *port;                // the port part of key
+    struct addrinfo *addrs;    // the resolved addresses, NULL on failure
+    int error;                 // the getaddrinfo() error, 0 on success
+    bool ready;                // whether the lookup has finished
+    time_t expires;            // when the result goes stale
+    struct resolve_req *waiters; // lookups waiting for the result
+    atomic_int refcnt;           // one held by the cache while the entry is
+                                 // in it, plus one per resolve_req holding it
+    struct resolver_entry *hnext; // next entry in the same hash bucket
+    struct resolver_entry *qnext; // next entry waiting for a resolver thread
+} resolver_entry_t;
+
+/* Where a worker is told about its finished lookups. */
+typedef struct resolver_notify {
+    int efd;                  // eventfd readable when done isn't empty
+    pthread_mutex_t lock;     // protects done
+    struct resolve_req *done; // the finished lookups
+} resolver_notify_t;
+
+/* A single lookup, which usually lives in the state of a connection. */
+typedef struct resolve_req {
+    resolver_notify_t *notify;  // where to report the lookup once finished
+    void *owner;                // whoever made the lookup
+    resolver_entry_t *entry;    // the result, see resolver_lookup()
+    struct resolve_req *next;   // link in a waiter list or the done list
+} resolve_req_t;
+
+/* starting the resolver threads.
+ *
+ * @return -1 if the threads could not be started, 0 otherwise.
+ */
+int resolver_init(void);
+
+/* setting up the notifications of one worker.
+ *
+ * @params[out] n the notifications, whose efd is registered with epoll
+ *
+ * @return -1 if the eventfd could not be created, 0 otherwise.
+ */
+int resolver_notify_init(resolver_notify_t *n);
+
+/* looking up a host and port. If a fresh result is cached, req->entry is set
+ * to it straight away. Otherwise the lookup finishes later, and req shows up
+ * on the done list of req->notify with req->entry set. Either way, the entry
+ * holds a reference for req that is dropped with resolver_release(), and its
+ * error is 0 if there are addrs to connect to. A lookup that could not even
+ * be started (a name too long or no memory) is finished with a NULL entry.
+ *
+ * @params[in] host the host to resolve
+ * @params[in] port the port, numeric
+ * @params[in,out] req the lookup, with notify and owner set
+ *
+ * @return true if the lookup is finished, false if it is pending.
+ */
+bool resolver_lookup(const char *host, const char *port, resolve_req_t *req);
+
+/* taking the finished lookups of a worker, once its efd is readable.
+ *
+ * @params[in] n the notifications
+ *
+ * @return the finished lookups, linked by next.
+ */
+resolve_req_t *resolver_completed(resolver_notify_t *n);
+
+/* dropping a reference to the result of a lookup.
+ *
+ * @params[in] entry the result
+ */
+void resolver_release(resolver_entry_t *entry);
+
+#endif /* __RESOLVER_H__ */
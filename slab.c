@@ -0,0 +1,219 @@
+/*
+ * @file: slab.c
+ * @brief: the slab allocator, following the signature in slab.h. A page
+ * starts with a small header, so the page of any chunk is found by rounding
+ * its address down to the page size of its class, which pages are aligned to
+ * and which the chunk size the caller hands back picks. Free chunks
+ * are linked through their first word, and a new page is carved into chunks
+ * lazily, as they are handed out, so its memory is only touched once used.
+ *
+ * @Author Sanah Imani <simani@unix.andrew.cmu.edu>
+ */
+
+#include <slab.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#define SLAB_PAGE_HEADER 64 // bytes ahead of the first chunk of a page
+#define SLAB_ALIGN 64       // class sizes are multiples of a cache line
+#define SLAB_MAP_ALIGN 4096 // chunks mapped alone are rounded up to this
+
+/* The header of a page, which holds the chunks of a single class. */
+typedef struct slab_page {
+    struct slab_page *prev; // links in the pages of its class with free
+    struct slab_page *next; // chunks
+    void *free;             // chunks freed since they were carved
+    char *unused;           // where the chunks never handed out start
+    size_t used;            // chunks handed out
+    bool listed;            // whether it is linked into its class' pages
+} slab_page_t;
+
+void slab_init(slab_t *slab, size_t capacity, size_t largest) {
+    pthread_mutex_init(&slab->lock, NULL);
+    slab->pageSize = SLAB_MAX_PAGE;
+    while (slab->pageSize > SLAB_MIN_PAGE &&
+           slab->pageSize * SLAB_PAGES > capacity) {
+        slab->pageSize /= 2;
+    }
+    size_t maxChunk = (largest + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
+    size_t maxPaged = ((SLAB_MAX_PAGE - SLAB_PAGE_HEADER) /
+                       SLAB_MIN_PAGE_CHUNKS) & ~(size_t)(SLAB_ALIGN - 1);
+    if (maxChunk < slab->pageSize / SLAB_PAGE_CHUNKS) {
+        maxChunk = slab->pageSize / SLAB_PAGE_CHUNKS;
+    }
+    if (maxChunk > maxPaged) {
+        maxChunk = maxPaged;
+    }
+    size_t size = SLAB_MIN_CHUNK;
+    int n = 0;
+    while (n < SLAB_CLASSES - 1 && size < maxChunk) {
+        slab->classes[n].chunkSize = size;
+        n++;
+        size = (size + size / 4 + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
+    }
+    // the last class takes everything up to maxChunk.
+    slab->classes[n++].chunkSize = maxChunk;
+    slab->maxChunk = maxChunk;
+    // the larger classes get larger pages, for as many chunks as the smaller
+    // ones get.
+    for (int i = 0; i < n; i++) {
+        slab_class_t *cls = &slab->classes[i];
+        cls->pageSize = slab->pageSize;
+        while (cls->pageSize < SLAB_MAX_PAGE &&
+               (cls->pageSize - SLAB_PAGE_HEADER) / cls->chunkSize <
+                   SLAB_PAGE_CHUNKS) {
+            cls->pageSize *= 2;
+        }
+        cls->pages = NULL;
+    }
+    slab->nclasses = n;
+    slab->mapped = 0;
+}
+
+// the smallest class with chunks of at least size bytes, up to maxChunk.
+static int class_of(const slab_t *slab, size_t size) {
+    int lo = 0;
+    int hi = slab->nclasses - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (slab->classes[mid].chunkSize < size) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/*a helper mapping a page aligned to its own size, by mapping twice as much
+ *and unmapping whatever lies outside of the aligned page.*/
+static void *map_page(size_t pageSize) {
+    size_t len = 2 * pageSize;
+    char *map = (char *)mmap(NULL, len, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    uintptr_t addr = (uintptr_t)map;
+    uintptr_t mask = (uintptr_t)pageSize - 1;
+    uintptr_t page = (addr + mask) & ~mask;
+    if (page > addr) {
+        munmap(map, page - addr);
+    }
+    size_t tail = (addr + len) - (page + pageSize);
+    if (tail > 0) {
+        munmap((char *)(page + pageSize), tail);
+    }
+    return (void *)page;
+}
+
+// linking a page into the pages of its class with free chunks.
+static void page_link(slab_class_t *cls, slab_page_t *page) {
+    page->prev = NULL;
+    page->next = cls->pages;
+    if (cls->pages != NULL) {
+        cls->pages->prev = page;
+    }
+    cls->pages = page;
+    page->listed = true;
+}
+
+static void page_unlink(slab_class_t *cls, slab_page_t *page) {
+    if (page->prev != NULL) {
+        page->prev->next = page->next;
+    } else {
+        cls->pages = page->next;
+    }
+    if (page->next != NULL) {
+        page->next->prev = page->prev;
+    }
+    page->prev = NULL;
+    page->next = NULL;
+    page->listed = false;
+}
+
+// whether a page has no free chunks left, freed or never handed out.
+static bool page_full(slab_class_t *cls, slab_page_t *page) {
+    return page->free == NULL &&
+           (size_t)((char *)page + cls->pageSize - page->unused) <
+               cls->chunkSize;
+}
+
+void *slab_alloc(slab_t *slab, size_t size, size_t *chunkSize) {
+    if (size > slab->maxChunk) {
+        size_t mask = SLAB_MAP_ALIGN - 1;
+        size_t len = (size + mask) & ~mask;
+        void *map = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED) {
+            return NULL;
+        }
+        pthread_mutex_lock(&slab->lock);
+        slab->mapped += len;
+        pthread_mutex_unlock(&slab->lock);
+        *chunkSize = len;
+        return map;
+    }
+    slab_class_t *cls = &slab->classes[class_of(slab, size)];
+
+    pthread_mutex_lock(&slab->lock);
+    slab_page_t *page = cls->pages;
+    if (page == NULL) {
+        if ((page = (slab_page_t *)map_page(cls->pageSize)) == NULL) {
+            pthread_mutex_unlock(&slab->lock);
+            return NULL;
+        }
+        page->free = NULL;
+        page->unused = (char *)page + SLAB_PAGE_HEADER;
+        page->used = 0;
+        page_link(cls, page);
+        slab->mapped += cls->pageSize;
+    }
+    void *chunk;
+    if (page->free != NULL) {
+        chunk = page->free;
+        page->free = *(void **)chunk;
+    } else {
+        chunk = page->unused;
+        page->unused += cls->chunkSize;
+    }
+    page->used++;
+    if (page_full(cls, page)) {
+        page_unlink(cls, page);
+    }
+    pthread_mutex_unlock(&slab->lock);
+    *chunkSize = cls->chunkSize;
+    return chunk;
+}
+
+void slab_free(slab_t *slab, void *chunk, size_t chunkSize) {
+    if (chunkSize > slab->maxChunk) {
+        munmap(chunk, chunkSize);
+        pthread_mutex_lock(&slab->lock);
+        slab->mapped -= chunkSize;
+        pthread_mutex_unlock(&slab->lock);
+        return;
+    }
+    // the chunk size is that of its class, which gives the page size.
+    slab_class_t *cls = &slab->classes[class_of(slab, chunkSize)];
+    slab_page_t *page =
+        (slab_page_t *)((uintptr_t)chunk & ~(uintptr_t)(cls->pageSize - 1));
+    pthread_mutex_lock(&slab->lock);
+    *(void **)chunk = page->free;
+    page->free = chunk;
+    page->used--;
+    if (!page->listed) {
+        page_link(cls, page);
+    }
+    // an empty page is unmapped, unless it is the only one left with free
+    // chunks, so a class going back and forth by one object doesn't map and
+    // unmap a page every time.
+    if (page->used == 0 && (page->prev != NULL || page->next != NULL)) {
+        page_unlink(cls, page);
+        munmap(page, cls->pageSize);
+        slab->mapped -= cls->pageSize;
+    }
+    pthread_mutex_unlock(&slab->lock);
+}
@@ -0,0 +1,92 @@
+/*
+ * @file: slab.h
+ * @brief: a size-classed slab allocator for the objects of a cache shard. A
+ * cached object lives in one chunk holding its web_object_t, its key and its
+ * response, so inserting and evicting it costs one allocation and one free
+ * from here, and never goes to the global malloc heap.
+ *
+ * Chunks of a size class are carved from pages mapped for that class alone,
+ * so the pieces left between objects are always the size of another object
+ * of the class. Class sizes grow by a quarter, which bounds the space wasted
+ * by rounding up, up to the largest chunk the slab is told to expect, so even
+ * the largest objects come from pages. A page holds SLAB_PAGE_CHUNKS chunks,
+ * or at least SLAB_MIN_PAGE_CHUNKS in the largest classes, which bounds what
+ * is left at its end; only chunks larger still get a mapping of their own.
+ * Pages are unmapped once all of their chunks are free again, bar one per
+ * class, so the memory mapped follows what the shard holds. Small shards get
+ * smaller pages for their small classes, so the pages of a few classes don't
+ * dwarf the shard, and chunks are only touched once handed out, so the larger
+ * pages of the larger classes take up no more than their chunks in use.
+ *
+ * Each shard has a slab of its own with its own lock, which is only taken for
+ * the allocation or free itself.
+ *
+ * @Author Sanah Imani <simani@unix.andrew.cmu.edu>
+ */
+
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include <pthread.h>
+#include <stddef.h>
+
+#define SLAB_MAX_PAGE (1024 * 1024) // bytes in a page of a large slab
+#define SLAB_MIN_PAGE (64 * 1024)   // bytes in a page of a small slab
+#define SLAB_PAGE_CHUNKS 16 // chunks per page, unless that takes pages
+                            // larger than SLAB_MAX_PAGE
+#define SLAB_MIN_PAGE_CHUNKS 4 // min chunks per page, chunks too large for
+                               // that are mapped alone
+#define SLAB_PAGES 16       // a slab of capacity bytes gets the largest pages
+                            // that it would take this many of
+#define SLAB_MIN_CHUNK 128  // the smallest size class
+#define SLAB_CLASSES 48     // max number of size classes
+
+struct slab_page;
+
+/* The chunks of one size, and the pages they are carved from. */
+typedef struct slab_class {
+    size_t chunkSize;         // bytes in every chunk of the class
+    size_t pageSize;          // bytes in a page of the class, a power of 2
+    struct slab_page *pages;  // the pages that have free chunks left
+} slab_class_t;
+
+typedef struct slab {
+    pthread_mutex_t lock;                // protects everything below
+    slab_class_t classes[SLAB_CLASSES];  // the size classes, smallest first
+    int nclasses;                        // number of classes in use
+    size_t pageSize;                     // bytes in a page of the smallest
+                                         // classes, a power of 2
+    size_t maxChunk;                     // the size of the largest class
+    size_t mapped;                       // bytes currently mapped
+} slab_t;
+
+/* setting up an empty slab, which maps nothing until the first allocation.
+ *
+ * @params[out] slab the slab
+ * @params[in] capacity about how many bytes the slab is going to hold, which
+ * its page size is picked by
+ * @params[in] largest the largest chunk commonly asked for, which the size
+ * classes go up to as far as pages of SLAB_MAX_PAGE allow
+ */
+void slab_init(slab_t *slab, size_t capacity, size_t largest);
+
+/* allocating a chunk of at least size bytes, aligned to 16 bytes.
+ *
+ * @params[in] slab the slab
+ * @params[in] size the bytes needed
+ * @params[out] chunkSize set to the size of the chunk, which is what
+ * slab_free() needs and what the chunk really takes up
+ *
+ * @return the chunk, or NULL if no memory could be mapped for it.
+ */
+void *slab_alloc(slab_t *slab, size_t size, size_t *chunkSize);
+
+/* freeing a chunk from slab_alloc().
+ *
+ * @params[in] slab the slab it was allocated from
+ * @params[in] chunk the chunk
+ * @params[in] chunkSize its size, as set by slab_alloc()
+ */
+void slab_free(slab_t *slab, void *chunk, size_t chunkSize);
+
+#endif /* __SLAB_H__ */
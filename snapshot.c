@@ -0,0 +1,217 @@
+/*
+ * @file: snapshot.c
+ * @brief: cache snapshots, following the signature in snapshot.h. The header
+ * of a snapshot is written last, once the number of records and the length of
+ * the file are known, so a snapshot cut short is found out by its length.
+ *
+ * @Author Sanah Imani <simani@unix.andrew.cmu.edu>
+ */
+
+#include <snapshot.h>
+
+#include <cache.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SNAPSHOT_MAGIC 0x50525853u // "PRXS", the start of a snapshot
+#define SNAPSHOT_VERSION 1u
+#define SNAPSHOT_VALIDATABLE 1u // in flags, the object can be revalidated
+
+/* The header of a snapshot. */
+typedef struct snapshot_header {
+    uint32_t magic;   // SNAPSHOT_MAGIC
+    uint32_t version; // SNAPSHOT_VERSION
+    uint64_t count;   // the number of records following the header
+    uint64_t size;    // the length of the snapshot, the header included
+} snapshot_header_t;
+
+/* The start of the record of an object, ahead of its key and response. */
+typedef struct snapshot_record {
+    uint32_t keyLen;    // the length of the key, which is NUL-terminated
+    uint32_t flags;     // SNAPSHOT_VALIDATABLE, or 0
+    uint64_t objSize;   // the length of the response following the key
+    uint64_t hdrSize;   // the length of its header block
+    int64_t expires;    // when the object goes stale
+    int64_t staleWhile; // for how long it may be served stale after that
+} snapshot_record_t;
+
+// the length of a record, padded so the next one is aligned.
+static size_t record_len(size_t keyLen, size_t objSize) {
+    size_t len = sizeof(snapshot_record_t) + keyLen + 1 + objSize;
+    return (len + 7) & ~(size_t)7;
+}
+
+/*a helper taking a reference to every object of a shard, coldest first, so
+ *that they can be written out without the lock.
+ *
+ * @return the objects, NULL if there is no memory for the list of them.
+ */
+static web_object_t **shard_objects(cache_shard_t *shard, size_t *n) {
+    *n = 0;
+    pthread_rwlock_rdlock(&shard->lock);
+    // every object linked into a list is in the hash table too.
+    web_object_t **objs =
+        (web_object_t **)malloc((shard->count + 1) * sizeof(web_object_t *));
+    for (int seg = 0; objs != NULL && seg < CACHE_SEGMENTS; seg++) {
+        for (web_object_t *obj = shard->lists[seg].end; obj != NULL;
+             obj = obj->prev) {
+            objs[(*n)++] = retain_cache_obj(obj);
+        }
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    return objs;
+}
+
+/*a helper appending the record of an object to the snapshot.
+ *
+ * @return the length of the record, 0 if it could not be written.
+ */
+static size_t write_record(int fd, web_object_t *obj) {
+    static const char pad[8] = {0};
+    snapshot_record_t rec = {
+        (uint32_t)obj->keyLen,
+        obj->validatable ? SNAPSHOT_VALIDATABLE : 0,
+        obj->objSize,
+        obj->hdrSize,
+        atomic_load_explicit(&obj->expires, memory_order_relaxed),
+        obj->staleWhile};
+    size_t len = record_len(obj->keyLen, obj->objSize);
+    size_t unpadded = sizeof(rec) + obj->keyLen + 1 + obj->objSize;
+    struct iovec iov[4] = {{&rec, sizeof(rec)},
+                           {obj->urlKey, obj->keyLen + 1},
+                           {obj->object, obj->objSize},
+                           {(void *)pad, len - unpadded}};
+    return writev(fd, iov, 4) == (ssize_t)len ? len : 0;
+}
+
+bool snapshot_dump(const char *path) {
+    char tmp[4096];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+        return false;
+    }
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        perror(tmp);
+        return false;
+    }
+    snapshot_header_t hdr = {SNAPSHOT_MAGIC, SNAPSHOT_VERSION, 0,
+                             sizeof(snapshot_header_t)};
+    bool ok = lseek(fd, (off_t)sizeof(hdr), SEEK_SET) == (off_t)sizeof(hdr);
+    for (int i = 0; ok && i < web_cache->nshards; i++) {
+        size_t n;
+        web_object_t **objs = shard_objects(&web_cache->shards[i], &n);
+        ok = objs != NULL;
+        for (size_t j = 0; j < n; j++) {
+            size_t len = ok ? write_record(fd, objs[j]) : 0;
+            ok = len > 0;
+            hdr.count += ok ? 1 : 0;
+            hdr.size += len;
+            release_cache_obj(objs[j]);
+        }
+        free(objs);
+    }
+    ok = ok && pwrite(fd, &hdr, sizeof(hdr), 0) == (ssize_t)sizeof(hdr);
+    if (close(fd) < 0 || !ok || rename(tmp, path) < 0) {
+        perror(path);
+        unlink(tmp);
+        return false;
+    }
+    fprintf(stderr, "Wrote a snapshot of %llu objects to %s\n",
+            (unsigned long long)hdr.count, path);
+    return true;
+}
+
+/*a helper adding the object of the record at off of a snapshot of size
+ *bytes to the cache, unless it is of no more use.
+ *
+ * @return the length of the record, 0 if it is invalid.
+ */
+static size_t load_record(const char *map, size_t size, size_t off,
+                          time_t now, long *loaded) {
+    snapshot_record_t rec;
+    if (size - off < sizeof(rec)) {
+        return 0;
+    }
+    memcpy(&rec, map + off, sizeof(rec));
+    if (rec.objSize > size || rec.hdrSize > rec.objSize ||
+        record_len(rec.keyLen, rec.objSize) > size - off) {
+        return 0;
+    }
+    const char *key = map + off + sizeof(rec);
+    if (key[rec.keyLen] != '\0') {
+        return 0;
+    }
+    cache_key_t cacheKey;
+    cache_key_init(&cacheKey, key);
+    if (cacheKey.len != rec.keyLen) {
+        return 0;
+    }
+    cache_freshness_t fresh = {(time_t)rec.expires, (long)rec.staleWhile,
+                               (rec.flags & SNAPSHOT_VALIDATABLE) != 0};
+    if (fresh.validatable || (int64_t)now < rec.expires + rec.staleWhile) {
+        const char *response = key + rec.keyLen + 1;
+        if (!add_to_cache(&cacheKey, response, rec.objSize, rec.hdrSize,
+                          &fresh)) {
+            (*loaded)++;
+        }
+    }
+    return record_len(rec.keyLen, rec.objSize);
+}
+
+long snapshot_load(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 && errno == ENOENT) {
+        return 0;
+    }
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+    snapshot_header_t hdr;
+    const char *map = MAP_FAILED;
+    if (size >= sizeof(hdr)) {
+        map = (const char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (map != MAP_FAILED) {
+        memcpy(&hdr, map, sizeof(hdr));
+    }
+    if (map == MAP_FAILED || hdr.magic != SNAPSHOT_MAGIC ||
+        hdr.version != SNAPSHOT_VERSION || hdr.size != size) {
+        fprintf(stderr, "%s: not a complete cache snapshot\n", path);
+        if (map != MAP_FAILED) {
+            munmap((void *)map, size);
+        }
+        return -1;
+    }
+    // the records are read once, front to back.
+    madvise((void *)map, size, MADV_SEQUENTIAL);
+    time_t now = time(NULL);
+    long loaded = 0;
+    size_t off = sizeof(hdr);
+    for (uint64_t i = 0; i < hdr.count; i++) {
+        size_t len = load_record(map, size, off, now, &loaded);
+        if (len == 0) {
+            fprintf(stderr, "%s: invalid record %llu\n", path,
+                    (unsigned long long)i);
+            break;
+        }
+        off += len;
+    }
+    munmap((void *)map, size);
+    return loaded;
+}
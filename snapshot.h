@@ -0,0 +1,46 @@
+/*
+ * @file: snapshot.h
+ * @brief: snapshots of what the web cache holds in memory, so that a proxy
+ * taking over from another one, as in a blue/green deploy, starts out with
+ * its hot set rather than an empty cache. The old proxy dumps its objects to
+ * a file, and the new one loads them from it at startup.
+ *
+ * A snapshot is a header followed by one record per object, its key,
+ * freshness and sizes, then the key and the response, each record padded to
+ * 8 bytes, so it is written and read front to back in one go. It is written
+ * to a temporary file renamed over the snapshot once complete, so a snapshot
+ * is never seen half written. Loading maps the whole file once and copies the
+ * objects into the cache straight from the mapping.
+ *
+ * @Author Sanah Imani <simani@unix.andrew.cmu.edu>
+ */
+
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* writing a snapshot of the cache to path. Shards are read-locked one at a
+ * time, just long enough to take a reference to each of their objects, which
+ * are then written out with the cache carrying on as usual, so the snapshot
+ * isn't of the cache at a single point in time.
+ *
+ * @params[in] path the snapshot
+ *
+ * @return false if the snapshot could not be written.
+ */
+bool snapshot_dump(const char *path);
+
+/* adding the objects of the snapshot at path to the cache, as add_to_cache()
+ * would, the least recently used of each shard first. Objects that went stale
+ * since with no way of being revalidated or served stale are left out.
+ *
+ * @params[in] path the snapshot
+ *
+ * @return the number of objects added, or -1 if there is a file at path that
+ * isn't a snapshot. A missing snapshot is an empty one.
+ */
+long snapshot_load(const char *path);
+
+#endif /* __SNAPSHOT_H__ */
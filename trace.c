@@ -0,0 +1,163 @@
+/*
+ * @file: trace.c
+ * @brief: the sampled request tracing, following the signature in trace.h.
+ * Each ring is written by its worker and read by the flusher thread alone,
+ * which see each other's progress through head and tail, so the records
+ * between them are owned by one side at a time.
+ *
+ * @Author Sanah Imani <simani@unix.andrew.cmu.edu>
+ */
+
+#include <trace.h>
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char *stage_names[TRACE_STAGES] = {
+    "start",     "parsed",     "lookup",    "resolved",
+    "connected", "first_byte", "last_byte", "cached"};
+
+static FILE *trace_file = NULL;
+static unsigned trace_rate = TRACE_DEFAULT_RATE;
+static int64_t wall_offset; // realtime minus monotonic, in microseconds
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_ring_t *rings = NULL; // every ring, drained by the flusher
+
+// microseconds since an arbitrary point, from the monotonic clock.
+static uint64_t trace_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/*a helper writing a record out as a line: when the request started, in
+ *seconds since the epoch, its key, and how long after the start it reached
+ *each stage, in microseconds, or - if it didn't.
+ */
+static void write_record(const trace_record_t *rec) {
+    int64_t start = (int64_t)rec->times[TRACE_START] + wall_offset;
+    fprintf(trace_file, "%" PRId64 ".%06" PRId64 " %s", start / 1000000,
+            start % 1000000, rec->key[0] != '\0' ? rec->key : "-");
+    for (int s = TRACE_START + 1; s < TRACE_STAGES; s++) {
+        if (rec->times[s] == 0) {
+            fprintf(trace_file, " %s=-", stage_names[s]);
+        } else {
+            fprintf(trace_file, " %s=%" PRIu64, stage_names[s],
+                    rec->times[s] - rec->times[TRACE_START]);
+        }
+    }
+    fputc('\n', trace_file);
+}
+
+/*
+ * flush_routine - draining the records of every ring into the trace file
+ * every TRACE_FLUSH_MS, along with how many were dropped since.
+ */
+static void *flush_routine(void *arg) {
+    (void)arg;
+    while (true) {
+        usleep(TRACE_FLUSH_MS * 1000);
+        pthread_mutex_lock(&rings_lock);
+        trace_ring_t *first = rings;
+        pthread_mutex_unlock(&rings_lock);
+        bool wrote = false;
+        // rings are only ever added at the front, so the list from first on
+        // stays as it is.
+        for (trace_ring_t *ring = first; ring != NULL; ring = ring->next) {
+            size_t head = atomic_load_explicit(&ring->head,
+                                               memory_order_acquire);
+            size_t tail = atomic_load_explicit(&ring->tail,
+                                               memory_order_relaxed);
+            for (; tail != head; tail++) {
+                write_record(&ring->records[tail & (TRACE_RING - 1)]);
+                wrote = true;
+            }
+            atomic_store_explicit(&ring->tail, tail, memory_order_release);
+            unsigned long dropped = atomic_exchange_explicit(
+                &ring->dropped, 0, memory_order_relaxed);
+            if (dropped > 0) {
+                fprintf(trace_file, "# dropped %lu\n", dropped);
+                wrote = true;
+            }
+        }
+        if (wrote) {
+            fflush(trace_file);
+        }
+    }
+    return NULL;
+}
+
+bool trace_init(const char *path, unsigned rate) {
+    if ((trace_file = fopen(path, "a")) == NULL) {
+        perror(path);
+        return false;
+    }
+    trace_rate = rate == 0 ? 1 : rate;
+    struct timespec real;
+    clock_gettime(CLOCK_REALTIME, &real);
+    wall_offset = (int64_t)real.tv_sec * 1000000 + real.tv_nsec / 1000 -
+                  (int64_t)trace_clock();
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, flush_routine, NULL) != 0) {
+        fclose(trace_file);
+        trace_file = NULL;
+        return false;
+    }
+    pthread_detach(tid);
+    return true;
+}
+
+trace_ring_t *trace_ring_new(void) {
+    trace_ring_t *ring = (trace_ring_t *)calloc(1, sizeof(trace_ring_t));
+    if (ring == NULL) {
+        return NULL;
+    }
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->dropped, 0);
+    pthread_mutex_lock(&rings_lock);
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&rings_lock);
+    return ring;
+}
+
+void trace_begin(trace_ring_t *ring, trace_span_t *span) {
+    span->sampled = ring != NULL && ring->seen++ % trace_rate == 0;
+    if (span->sampled) {
+        memset(span->times, 0, sizeof(span->times));
+        span->times[TRACE_START] = trace_clock();
+    }
+}
+
+void trace_stamp(trace_span_t *span, enum trace_stage stage) {
+    span->times[stage] = trace_clock();
+}
+
+void trace_end(trace_ring_t *ring, trace_span_t *span, const char *key) {
+    if (!span->sampled) {
+        return;
+    }
+    span->sampled = false;
+    if (span->times[TRACE_PARSED] == 0) {
+        return; // the connection closed with no request on it
+    }
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail == TRACE_RING) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    trace_record_t *rec = &ring->records[head & (TRACE_RING - 1)];
+    memcpy(rec->times, span->times, sizeof(rec->times));
+    rec->key[0] = '\0';
+    if (key != NULL) {
+        strncat(rec->key, key, TRACE_KEY - 1);
+    }
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
@@ -0,0 +1,113 @@
+/*
+ * @file: trace.h
+ * @brief: optional, sampled tracing of the time a request spends in each
+ * stage of the proxy: from the connection being accepted (or the previous
+ * response on it being done) to the request being parsed, looked up in the
+ * cache, the server being resolved and connected to, its first byte
+ * arriving, the last byte being relayed and the response being cached.
+ *
+ * One request in every rate is traced. Its stages are stamped in its
+ * connection, and once it is over the stamps go into a ring of the worker's
+ * own, which has a single writer and a single reader and so takes no lock.
+ * A background thread drains the rings of every worker into the trace file
+ * now and then, one line per request. Records finding their ring full are
+ * dropped and counted, rather than stalling a worker.
+ *
+ * @Author Sanah Imani <simani@unix.andrew.cmu.edu>
+ */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TRACE_RING 1024      // records per worker ring, a power of 2
+#define TRACE_KEY 128        // bytes of the cache key kept per record
+#define TRACE_FLUSH_MS 100   // how often the rings are drained
+#define TRACE_DEFAULT_RATE 100 // one request traced in this many by default
+
+/* The stages of a request, in the order they are usually reached. */
+enum trace_stage {
+    TRACE_START,     // the connection was accepted or its last response done
+    TRACE_PARSED,    // the request header block was parsed
+    TRACE_LOOKUP,    // the cache lookup was done
+    TRACE_RESOLVED,  // the server host was resolved
+    TRACE_CONNECTED, // a connection to the server was ready
+    TRACE_FIRST_BYTE, // the first byte of the response arrived from it
+    TRACE_LAST_BYTE, // the last byte of the response was written to the client
+    TRACE_CACHED,    // the response was added to the cache
+    TRACE_STAGES
+};
+
+/* The stamps of one request, kept in its connection. */
+typedef struct trace_span {
+    bool sampled;                  // whether the request is traced
+    uint64_t times[TRACE_STAGES];  // when each stage was reached, in
+                                   // microseconds, 0 if it wasn't
+} trace_span_t;
+
+/* A traced request, as it goes through a ring. */
+typedef struct trace_record {
+    uint64_t times[TRACE_STAGES]; // as in trace_span_t
+    char key[TRACE_KEY];          // the start of the cache key
+} trace_record_t;
+
+/* The records of one worker on their way to the trace file. */
+typedef struct trace_ring {
+    trace_record_t records[TRACE_RING];
+    atomic_size_t head;      // records written, by the worker alone
+    atomic_size_t tail;      // records read, by the flusher alone
+    atomic_ulong dropped;    // records the ring had no room for
+    uint64_t seen;           // requests started, which sampling counts
+    struct trace_ring *next; // the next ring drained
+} trace_ring_t;
+
+/* opening the trace file and starting the thread draining the rings into it.
+ *
+ * @params[in] path the trace file, appended to
+ * @params[in] rate one request in rate is traced
+ *
+ * @return false if the file can't be opened or the thread started.
+ */
+bool trace_init(const char *path, unsigned rate);
+
+/* adding a ring for a worker, once trace_init() has succeeded.
+ *
+ * @return the ring, or NULL if there is no memory for it.
+ */
+trace_ring_t *trace_ring_new(void);
+
+/* a request is starting on a connection, which is sampled or not.
+ *
+ * @params[in] ring the worker's ring, or NULL if tracing is off
+ * @params[out] span the stamps of the request
+ */
+void trace_begin(trace_ring_t *ring, trace_span_t *span);
+
+// stamping a span with the current time, see trace_mark().
+void trace_stamp(trace_span_t *span, enum trace_stage stage);
+
+/* recording that a request reached a stage, which costs no more than a
+ * branch for requests that aren't traced.
+ *
+ * @params[in] span the stamps of the request
+ * @params[in] stage the stage reached
+ */
+static inline void trace_mark(trace_span_t *span, enum trace_stage stage) {
+    if (span->sampled) {
+        trace_stamp(span, stage);
+    }
+}
+
+/* a request is over, so its stamps go into the ring, provided it was traced
+ * and got as far as being parsed.
+ *
+ * @params[in] ring the worker's ring
+ * @params[in,out] span the stamps of the request, no longer sampled after
+ * @params[in] key its cache key, or NULL
+ */
+void trace_end(trace_ring_t *ring, trace_span_t *span, const char *key);
+
+#endif /* __TRACE_H__ */
@@ -0,0 +1,131 @@
+/*
+ * @file: upstream.c
+ * @brief: the per-worker pool of idle persistent server connections, following
+ * the signature in upstream.h. Origins are chained into a small hash table on
+ * "host:port" and each keeps its idle connections as a stack, so the most
+ * recently used (and least likely to have been closed by the server) is
+ * handed out first.
+ *
+ * @Author Sanah Imani <simani@unix.andrew.cmu.edu>
+ */
+
+#include <upstream.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// the monotonic clock in seconds, unaffected by changes to the wall clock.
+static time_t now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/*a helper checking that an idle connection is still usable: the server must
+ *neither have closed it nor sent anything on it since the last response.
+ */
+static bool conn_alive(int fd) {
+    char ch;
+    ssize_t n = recv(fd, &ch, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/*a helper finding the origin of a host and port, creating it if asked to.
+ *
+ * @return the origin, or NULL if there is none (or no memory for a new one).
+ */
+static upstream_origin_t *find_origin(upstream_pool_t *pool, const char *host,
+                                      const char *port, bool create) {
+    char key[UPSTREAM_KEYLEN];
+    int len = snprintf(key, sizeof(key), "%s:%s", host, port);
+    if (len < 0 || (size_t)len >= sizeof(key)) {
+        return NULL;
+    }
+    // FNV-1a, as for cache keys.
+    uint64_t hash = 14695981039346656037ULL;
+    for (int i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)key[i]) * 1099511628211ULL;
+    }
+    upstream_origin_t **bucket = &pool->buckets[hash & (UPSTREAM_BUCKETS - 1)];
+    for (upstream_origin_t *o = *bucket; o != NULL; o = o->next) {
+        if (strcmp(o->key, key) == 0) {
+            return o;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    upstream_origin_t *o = (upstream_origin_t *)calloc(1, sizeof(*o));
+    if (o == NULL) {
+        return NULL;
+    }
+    memcpy(o->key, key, (size_t)len + 1);
+    o->next = *bucket;
+    *bucket = o;
+    return o;
+}
+
+void upstream_init(upstream_pool_t *pool) {
+    memset(pool, 0, sizeof(*pool));
+    pool->lastSweep = now_sec();
+}
+
+int upstream_get(upstream_pool_t *pool, const char *host, const char *port) {
+    upstream_origin_t *o = find_origin(pool, host, port, false);
+    if (o == NULL) {
+        return -1;
+    }
+    while (o->nidle > 0) {
+        int fd = o->fds[--o->nidle];
+        pool->nidle--;
+        if (conn_alive(fd)) {
+            return fd;
+        }
+        close(fd);
+    }
+    return -1;
+}
+
+void upstream_put(upstream_pool_t *pool, const char *host, const char *port,
+                  int fd) {
+    upstream_origin_t *o = find_origin(pool, host, port, true);
+    if (o == NULL || o->nidle == UPSTREAM_MAX_IDLE) {
+        close(fd);
+        return;
+    }
+    o->fds[o->nidle] = fd;
+    o->since[o->nidle] = now_sec();
+    o->nidle++;
+    pool->nidle++;
+}
+
+void upstream_sweep(upstream_pool_t *pool) {
+    time_t now = now_sec();
+    if (pool->nidle == 0 || now == pool->lastSweep) {
+        return;
+    }
+    pool->lastSweep = now;
+    for (int b = 0; b < UPSTREAM_BUCKETS; b++) {
+        for (upstream_origin_t *o = pool->buckets[b]; o != NULL; o = o->next) {
+            // keeping the survivors in the order they were parked.
+            int kept = 0;
+            for (int i = 0; i < o->nidle; i++) {
+                if (now - o->since[i] < UPSTREAM_IDLE_TIMEOUT &&
+                    conn_alive(o->fds[i])) {
+                    o->fds[kept] = o->fds[i];
+                    o->since[kept] = o->since[i];
+                    kept++;
+                } else {
+                    close(o->fds[i]);
+                }
+            }
+            pool->nidle -= o->nidle - kept;
+            o->nidle = kept;
+        }
+    }
+}
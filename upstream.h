@@ -0,0 +1,79 @@
+/*
+ * @file: upstream.h
+ * @brief: a pool of idle persistent connections to web servers, keyed by the
+ * origin (host:port) they are connected to. Once a response has been relayed
+ * in full from a server that keeps its connections open, the proxy parks the
+ * connection here, and the next miss for the same origin picks it up instead
+ * of resolving the host and going through a new TCP handshake.
+ *
+ * Each worker thread has a pool of its own, as in its event loop, so pools are
+ * never shared and need no locking. Connections idle for longer than
+ * UPSTREAM_IDLE_TIMEOUT, or closed by the server while idle, are dropped.
+ *
+ * @Author Sanah Imani <simani@unix.andrew.cmu.edu>
+ */
+
+#ifndef __UPSTREAM_H__
+#define __UPSTREAM_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+#define UPSTREAM_MAX_IDLE 32      // idle connections kept per origin
+#define UPSTREAM_IDLE_TIMEOUT 30  // seconds an idle connection is kept for
+#define UPSTREAM_BUCKETS 64       // hash buckets of origins, a power of 2
+#define UPSTREAM_KEYLEN (256 + 8) // max length of "host:port"
+
+/* An origin and its idle connections, most recently parked last. */
+typedef struct upstream_origin {
+    char key[UPSTREAM_KEYLEN];       // "host:port"
+    int fds[UPSTREAM_MAX_IDLE];      // the idle connections
+    time_t since[UPSTREAM_MAX_IDLE]; // when each was parked
+    int nidle;                       // connections in fds
+    struct upstream_origin *next;    // next origin in the same bucket
+} upstream_origin_t;
+
+typedef struct upstream_pool {
+    upstream_origin_t *buckets[UPSTREAM_BUCKETS];
+    int nidle;        // idle connections across all origins
+    time_t lastSweep; // when idle connections were last checked
+} upstream_pool_t;
+
+/* initialising an empty pool.
+ *
+ * @params[out] pool the pool
+ */
+void upstream_init(upstream_pool_t *pool);
+
+/* taking an idle connection to an origin out of the pool. The most recently
+ * parked connection is tried first, and connections the server has closed in
+ * the meantime are dropped on the way.
+ *
+ * @params[in] pool the pool
+ * @params[in] host the host of the origin
+ * @params[in] port the port of the origin
+ *
+ * @return a connected socket, or -1 if the pool has none for the origin.
+ */
+int upstream_get(upstream_pool_t *pool, const char *host, const char *port);
+
+/* parking a connection the previous response has been read from in full. The
+ * connection is closed instead if the origin already has UPSTREAM_MAX_IDLE.
+ *
+ * @params[in] pool the pool
+ * @params[in] host the host of the origin
+ * @params[in] port the port of the origin
+ * @params[in] fd the connected socket, no longer registered with epoll
+ */
+void upstream_put(upstream_pool_t *pool, const char *host, const char *port,
+                  int fd);
+
+/* closing the connections that timed out or were closed by the server. Does
+ * nothing if called again within the same second.
+ *
+ * @params[in] pool the pool
+ */
+void upstream_sweep(upstream_pool_t *pool);
+
+#endif /* __UPSTREAM_H__ */